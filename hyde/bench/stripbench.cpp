@@ -0,0 +1,171 @@
+#include "j3dconv.hpp"
+#include "accessor.hpp"
+#include "primitive.hpp"
+
+#include <bstream.h>
+#include <tiny_gltf.h>
+#include <tri_stripper.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Compares the linear stripifier against TriStripper on the same triangle lists, printing the display list
+// size, simulated cache misses and time each one takes. Runs on generated grids, or on every triangle list
+// primitive in the binary glTFs given on the command line.
+//
+// Usage: stripbench [model.glb ...]
+
+// Bytes per vertex used to measure display list size, as for 16-bit position, normal and texcoord indices
+const uint32_t BENCH_VERTEX_SIZE = 6;
+// Cache size TriStripper strips for, matching the largest of SPrimitiveSettings' defaults
+const uint32_t BENCH_STRIP_CACHE_SIZE = 16;
+// Grid sizes, in quads per side, used when no models are given
+const uint32_t BENCH_GRID_SIZES[] = { 32, 128, 512 };
+
+struct SBenchCase {
+    std::string mName;
+    std::vector<uint32_t> mTriangles;
+};
+
+struct SBenchResult {
+    size_t mPrimitiveCount = 0;
+    size_t mDisplayListSize = 0;
+    size_t mCacheMisses = 0;
+    double mMilliseconds = 0.0;
+};
+
+void BuildGrid(uint32_t quadsPerSide, std::vector<uint32_t>& triangles) {
+    uint32_t rowSize = quadsPerSide + 1;
+
+    for (uint32_t y = 0; y < quadsPerSide; y++) {
+        for (uint32_t x = 0; x < quadsPerSide; x++) {
+            uint32_t corner = y * rowSize + x;
+
+            triangles.insert(triangles.end(), { corner, corner + rowSize, corner + 1 });
+            triangles.insert(triangles.end(), { corner + 1, corner + rowSize, corner + rowSize + 1 });
+        }
+    }
+}
+
+bool LoadModelCases(const std::string& path, std::vector<SBenchCase>& cases) {
+    tinygltf::Model model;
+    if (!libj3dconv::LoadGltf(&model, path, libj3dconv::EImageLoadMode::Deferred)) {
+        std::cout << "Unable to load " << path << std::endl;
+        return false;
+    }
+
+    std::vector<bStream::CMemoryStream> buffers;
+    for (auto& buf : model.buffers) {
+        buffers.push_back(bStream::CMemoryStream(buf.data.data(), buf.data.size(), bStream::Little, bStream::In));
+    }
+
+    for (size_t m = 0; m < model.meshes.size(); m++) {
+        const tinygltf::Mesh& mesh = model.meshes[m];
+
+        for (size_t p = 0; p < mesh.primitives.size(); p++) {
+            const tinygltf::Primitive& prim = mesh.primitives[p];
+            if (prim.mode != TINYGLTF_MODE_TRIANGLES || prim.indices < 0) {
+                continue;
+            }
+
+            SBenchCase benchCase;
+            benchCase.mName = path + " mesh " + std::to_string(m) + " primitive " + std::to_string(p);
+
+            if (!Accessor::ReadIndices(&model, buffers, prim.indices, benchCase.mTriangles)) {
+                continue;
+            }
+
+            benchCase.mTriangles.resize(benchCase.mTriangles.size() / 3 * 3);
+            cases.push_back(std::move(benchCase));
+        }
+    }
+
+    return true;
+}
+
+SBenchResult Measure(const CPrimitiveOptimizer& optimizer, const std::vector<SPendingPrimitive>& primitives, double milliseconds) {
+    SBenchResult result;
+    result.mPrimitiveCount = primitives.size();
+    result.mDisplayListSize = optimizer.MeasureDisplayListSize(primitives);
+    result.mCacheMisses = optimizer.SimulateCacheMisses(primitives);
+    result.mMilliseconds = milliseconds;
+
+    return result;
+}
+
+SBenchResult RunTriStripper(const CPrimitiveOptimizer& optimizer, const std::vector<uint32_t>& triangles) {
+    auto start = std::chrono::steady_clock::now();
+
+    triangle_stripper::indices indicesToStrip(triangles.begin(), triangles.end());
+    triangle_stripper::tri_stripper stripper(indicesToStrip);
+    stripper.SetCacheSize(BENCH_STRIP_CACHE_SIZE);
+    stripper.SetMinStripSize(2);
+
+    triangle_stripper::primitive_vector strippedPrimitives;
+    stripper.Strip(&strippedPrimitives);
+
+    std::vector<SPendingPrimitive> primitives;
+    for (const triangle_stripper::primitive_group& group : strippedPrimitives) {
+        if (group.Indices.size() == 0) {
+            continue;
+        }
+
+        SPendingPrimitive& pending = primitives.emplace_back();
+        pending.mPrimitiveType = group.Type == triangle_stripper::TRIANGLE_STRIP ? EGXPrimitiveType::TriangleStrips : EGXPrimitiveType::Triangles;
+        pending.mIndices.assign(group.Indices.begin(), group.Indices.end());
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    return Measure(optimizer, primitives, std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+SBenchResult RunLinear(const CPrimitiveOptimizer& optimizer, const std::vector<uint32_t>& triangles) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<SPendingPrimitive> primitives;
+    CLinearStripifier stripifier;
+    stripifier.Strip(triangles.data(), triangles.size(), primitives);
+
+    auto end = std::chrono::steady_clock::now();
+    return Measure(optimizer, primitives, std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+void PrintResult(const std::string& stripifier, const SBenchResult& result) {
+    std::cout << "  " << std::left << std::setw(12) << stripifier << std::right
+        << std::setw(10) << result.mPrimitiveCount << " primitives"
+        << std::setw(12) << result.mDisplayListSize << " bytes"
+        << std::setw(10) << result.mCacheMisses << " misses"
+        << std::setw(12) << std::fixed << std::setprecision(2) << result.mMilliseconds << " ms" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::vector<SBenchCase> cases;
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            LoadModelCases(argv[i], cases);
+        }
+    }
+    else {
+        for (const uint32_t gridSize : BENCH_GRID_SIZES) {
+            SBenchCase& benchCase = cases.emplace_back();
+            benchCase.mName = std::to_string(gridSize) + "x" + std::to_string(gridSize) + " grid";
+            BuildGrid(gridSize, benchCase.mTriangles);
+        }
+    }
+
+    SPrimitiveSettings settings;
+    CPrimitiveOptimizer optimizer(settings, BENCH_VERTEX_SIZE);
+
+    for (const SBenchCase& benchCase : cases) {
+        std::cout << benchCase.mName << ": " << benchCase.mTriangles.size() / 3 << " triangles" << std::endl;
+
+        PrintResult("TriStripper", RunTriStripper(optimizer, benchCase.mTriangles));
+        PrintResult("Linear", RunLinear(optimizer, benchCase.mTriangles));
+    }
+
+    return cases.empty() ? 1 : 0;
+}
@@ -9,7 +9,9 @@ int main() {
     libj3dconv::LoadGltf(&model, "D:\\SZS Tools\\J3DConv\\link.glb");
 
     CConverterObject t;
-    t.Load(&model);
+    if (!t.Load(&model)) {
+        return 1;
+    }
 
     bStream::CFileStream f("D:\\SZS Tools\\J3DConv\\test.bmd", bStream::Big, bStream::Out);
     t.WriteBMD(f);
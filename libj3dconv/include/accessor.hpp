@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace Accessor {
+    // Decodes every element of the given glTF accessor into values, with each component converted to float.
+    // Honors the accessor's byte offset, its buffer view's stride, and the normalized flag.
+    // Components past the accessor's own component count are left as 0. Returns false if the accessor can't be read.
+    bool ReadVec4(
+        const tinygltf::Model* model,
+        std::vector<bStream::CMemoryStream>& buffers,
+        uint32_t accessorIndex,
+        std::vector<glm::vec4>& values
+    );
+
+    // Same as ReadVec4, but packs each element into componentCount (1 to 4) floats, dropping or zero-filling
+    // components to fit.
+    bool ReadFloats(
+        const tinygltf::Model* model,
+        std::vector<bStream::CMemoryStream>& buffers,
+        uint32_t accessorIndex,
+        uint32_t componentCount,
+        std::vector<float>& values
+    );
+
+    // Reads a MAT4 accessor of floats, such as a skin's inverse bind matrices. glTF stores matrices column by column,
+    // the same as glm. Returns false if the accessor isn't a float MAT4 or can't be read.
+    bool ReadMat4(
+        const tinygltf::Model* model,
+        std::vector<bStream::CMemoryStream>& buffers,
+        uint32_t accessorIndex,
+        std::vector<glm::mat4>& values
+    );
+
+    // Decodes a scalar accessor of unsigned integers, such as a primitive's indices, into values.
+    // Doesn't touch the buffer streams' positions, so it's safe to call from several threads at once.
+    bool ReadIndices(
+        const tinygltf::Model* model,
+        std::vector<bStream::CMemoryStream>& buffers,
+        uint32_t accessorIndex,
+        std::vector<uint32_t>& values
+    );
+}
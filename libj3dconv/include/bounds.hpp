@@ -0,0 +1,14 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <glm/glm.hpp>
+
+namespace Bounds {
+    // Grows boxMin and boxMax to contain every point's xyz, and maxLengthSquared to the largest squared distance
+    // of any point from the origin. Each point's w is ignored. Works on four points at a time with SSE2 where available.
+    void ExpandBox(const glm::vec4* points, size_t count, glm::vec3& boxMin, glm::vec3& boxMax, float& maxLengthSquared);
+
+    // Returns the largest squared distance of any point's xyz from center, or 0 if there are no points.
+    float MaxDistanceSquared(const glm::vec4* points, size_t count, const glm::vec3& center);
+}
@@ -1,11 +1,13 @@
 #pragma once
 
 #include "types.hpp"
+#include "vertex.hpp"
 
 #include <glm/glm.hpp>
 #include <glm/mat4x4.hpp>
 
 #include <vector>
+#include <unordered_map>
 
 class CShape;
 
@@ -13,15 +15,33 @@ struct SEnvelope {
     std::vector<uint16_t> JointIndices;
     std::vector<float> Weights;
 
-    bool operator==(const SEnvelope& other) {
+    bool operator==(const SEnvelope& other) const {
         return JointIndices == other.JointIndices && Weights == other.Weights;
     }
 
-    bool operator!=(const SEnvelope& other) {
+    bool operator!=(const SEnvelope& other) const {
         return !operator==(other);
     }
 };
 
+// Hashes an envelope's joints and weights, so identical envelopes are found without comparing against every other one.
+struct SEnvelopeHash {
+    size_t operator()(const SEnvelope& envelope) const;
+};
+
+// Optional cleanup of skin weights before envelopes are built. Every step makes nearly identical envelopes
+// come out the same, so fewer of them have to be blended at runtime.
+struct SSkinWeightSettings {
+    bool bEnabled = false;
+
+    // Influences lighter than this are dropped, though a vertex always keeps its heaviest one.
+    float MinWeight = 0.01f;
+    // Most influences kept per vertex, heaviest first.
+    uint32_t MaxInfluences = MAX_VERTEX_INFLUENCES;
+    // Weights are snapped to multiples of this, while still adding up to exactly 1. 0 leaves them unsnapped.
+    float WeightStep = 1.0f / 64.0f;
+};
+
 class CEnvelopeData {
     // EVP1 data
     std::vector<SEnvelope> mEnvelopes;
@@ -31,13 +51,35 @@ class CEnvelopeData {
     std::vector<uint16_t> mUnskinnedIndices;
     std::vector<uint16_t> mSkinnedIndices;
 
+    // Where each envelope and joint already is in mEnvelopes and mUnskinnedIndices
+    std::unordered_map<SEnvelope, uint16_t, SEnvelopeHash> mEnvelopeLookup;
+    std::unordered_map<uint16_t, uint16_t> mUnskinnedLookup;
+
+    // Gets a vertex's influences sorted by joint, with repeated joints merged. Vertices without any are attached to defaultJoint.
+    void GetVertexEnvelope(const CVertexPool& pool, uint32_t vertex, uint16_t defaultJoint, SEnvelope& envelope) const;
+
+    SSkinWeightSettings mSkinWeightSettings;
+
+    // Applies mSkinWeightSettings to a single envelope, keeping it sorted by joint.
+    void PruneEnvelope(const SEnvelope& envelope, SEnvelope& pruned) const;
+
+    uint16_t AddUnskinnedIndex(uint16_t jointIndex);
+    uint16_t AddEnvelope(const SEnvelope& envelope);
+
 public:
     CEnvelopeData();
     ~CEnvelopeData();
 
+    // Prunes, caps and snaps every skinned vertex's weights, then reports how many envelopes that saved and the
+    // largest position change it can cause. Needs the inverse bind matrices, so it runs after ReadInverseBindMatrices.
+    void PruneSkinWeights(const shared_vector<CShape>& shapes, const CVertexData& vertexData);
     void ProcessEnvelopes(const shared_vector<CShape>& shapes);
     void ReadInverseBindMatrices(const tinygltf::Model* model, std::vector<bStream::CMemoryStream>& buffers);
 
+    void SetSkinWeightSettings(const SSkinWeightSettings& settings) { mSkinWeightSettings = settings; }
+
+    const std::vector<glm::mat4>& GetInverseBindMatrices() const { return mInverseBindMatrices; }
+
     void WriteEVP1(bStream::CStream& stream);
     void WriteDRW1(bStream::CStream& stream);
 };
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "types.hpp"
+#include "j3denum.hpp"
+
+#include <vector>
+
+// Represents how a palette's entries are encoded.
+enum class EPaletteFormat {
+    IA8,
+    RGB565,
+    RGB5A3,
+
+    None
+};
+
+// How hard the CMPR encoder searches for each block's endpoints.
+enum class ECMPRQuality {
+    // Endpoints from the corners of the block's color bounding box.
+    Fast,
+    // Endpoints along the block's principal color axis, refined by least squares.
+    Normal,
+    // Normal, plus repeated refinement, both palette modes, and a search around the endpoints one 565 step at a time.
+    High
+};
+
+namespace GXTexture {
+    // Size in bytes of one image in the given format, padded out to whole tiles.
+    uint32_t GetImageSize(EGXTextureFormat format, uint32_t width, uint32_t height);
+
+    // Encodes an RGBA8 image as CMPR into dst, which must hold GetImageSize bytes. Texels with alpha below 128 become
+    // transparent. Rows of tiles are spread across threads.
+    void EncodeCMPR(const uint8_t* rgba, uint32_t width, uint32_t height, ECMPRQuality quality, uint8_t* dst);
+
+    // Encodes an RGBA8 image into dst in one of the formats that store each texel directly: I4, I8, IA4, IA8, RGB565,
+    // RGB5A3 or RGBA8. Texels are swizzled straight into their tiles, which dst must have GetImageSize bytes for.
+    // Returns false for any other format.
+    bool EncodeDirect(EGXTextureFormat format, const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst);
+
+    // Counts the distinct colors among an image's RGBA8 texels once they're rounded to the palette format. Stops
+    // counting once there are more than limit.
+    uint32_t CountPaletteColors(EPaletteFormat paletteFormat, const uint8_t* rgba, size_t texelCount, uint32_t limit);
+
+    // Encodes an RGBA8 image as C4, C8 or C14X2 into dst, which must hold GetImageSize bytes, and fills palette with the
+    // TLUT in paletteFormat. Images with more colors than the format can index are quantized down with median cut,
+    // refined by k-means. The TLUT is padded to a whole number of 16 entry rows. Returns false for any other format.
+    bool EncodePalette(EGXTextureFormat format, EPaletteFormat paletteFormat, const uint8_t* rgba, uint32_t width, uint32_t height,
+        uint8_t* dst, std::vector<uint8_t>& palette);
+
+    // Encodes an RGBA8 image as C4, C8 or C14X2 against a TLUT from EncodePalette, matching each color to its nearest
+    // entry. Used for mip levels, which have to share the base image's TLUT.
+    bool EncodePaletteIndices(EGXTextureFormat format, EPaletteFormat paletteFormat, const std::vector<uint8_t>& palette,
+        const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst);
+
+    // How many images a mip chain in the format can have, counting the full size image, before a level would be
+    // smaller than one tile.
+    uint32_t GetMaxMipCount(EGXTextureFormat format, uint32_t width, uint32_t height);
+
+    // Halves an sRGB RGBA8 image to (width + 1) / 2 by (height + 1) / 2 into dst with a 2x2 box filter. Colors are
+    // averaged in linear light rather than sRGB, and rows are spread across threads.
+    void DownsampleImage(const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst);
+}
@@ -1,14 +1,36 @@
 #pragma once
 
 #include "types.hpp"
+#include "util.hpp"
 
 #include <filesystem>
 #include <cstdint>
 
 namespace libj3dconv {
-	bool LoadGltf(tinygltf::Model* model, std::filesystem::path filePath);
-	bool LoadGltf(tinygltf::Model* model, const uint8_t* data, size_t size);
+	// How images embedded in the glTF are handled while loading.
+	enum class EImageLoadMode {
+		// Decode every image up front, as tinygltf does by default.
+		Decode,
+		// Only keep the encoded bytes. CTextureData decodes the images that textures use when it needs them.
+		Deferred
+	};
+
+	// A GLB that was memory-mapped rather than read into memory. The model's embedded
+	// buffer is left as a placeholder, and BinChunk points at its real bytes in the mapping.
+	struct SMappedGlb {
+		Util::CMappedFile File;
+
+		const uint8_t* BinChunk = nullptr;
+		size_t BinChunkSize = 0;
+	};
+
+	bool LoadGltf(tinygltf::Model* model, std::filesystem::path filePath, EImageLoadMode imageMode = EImageLoadMode::Decode);
+	bool LoadGltf(tinygltf::Model* model, const uint8_t* data, size_t size, EImageLoadMode imageMode = EImageLoadMode::Decode);
+	bool LoadGltfMapped(tinygltf::Model* model, SMappedGlb* glb, std::filesystem::path filePath, EImageLoadMode imageMode = EImageLoadMode::Decode);
 
 	bool SaveBMD(tinygltf::Model* model, std::filesystem::path filePath);
 	bool SaveBMD(tinygltf::Model* model, bStream::CStream& stream);
+	// For models loaded with LoadGltfMapped, whose embedded buffer is only readable through the mapping.
+	bool SaveBMD(tinygltf::Model* model, const SMappedGlb* glb, std::filesystem::path filePath);
+	bool SaveBMD(tinygltf::Model* model, const SMappedGlb* glb, bStream::CStream& stream);
 }
@@ -90,3 +90,18 @@ enum class EGXPrimitiveType : uint8_t {
     LineStrips = 0xB0,
     Points = 0xB8
 };
+
+// Represents how a texture's texels are encoded.
+enum class EGXTextureFormat : uint8_t {
+    I4 = 0x00,
+    I8 = 0x01,
+    IA4 = 0x02,
+    IA8 = 0x03,
+    RGB565 = 0x04,
+    RGB5A3 = 0x05,
+    RGBA8 = 0x06,
+    C4 = 0x08,
+    C8 = 0x09,
+    C14X2 = 0x0A,
+    CMPR = 0x0E
+};
@@ -6,24 +6,38 @@
 #include "envelope.hpp"
 #include "skeleton.hpp"
 #include "shape.hpp"
+#include "texture.hpp"
+
+namespace libj3dconv {
+    struct SMappedGlb;
+}
 
 class CConverterObject {
-    std::vector<uint8_t*> mBuffers;
+    // Non-owning views over the glTF buffers, which must outlive Load().
     std::vector<bStream::CMemoryStream> mBufferStreams;
 
     CVertexData mVertexData;
     CSkeletonData mSkeletonData;
     CEnvelopeData mEnvelopeData;
     CShapeData mShapeData;
+    CTextureData mTextureData;
 
-    void WriteTEX1(bStream::CStream& stream, tinygltf::Model* model);
+    // Skips texture processing, so deferred images are never decoded.
+    bool mGeometryOnly = false;
 
-    void LoadBuffers(tinygltf::Model* model);
+    bool LoadBuffers(tinygltf::Model* model, const libj3dconv::SMappedGlb* glb);
 
 public:
     CConverterObject();
     ~CConverterObject();
 
+    void SetGeometryOnly(bool geometryOnly) { mGeometryOnly = geometryOnly; }
+    void SetQuantizationSettings(const SQuantizationSettings& settings) { mVertexData.SetQuantizationSettings(settings); }
+    void SetPrimitiveSettings(const SPrimitiveSettings& settings) { mShapeData.SetPrimitiveSettings(settings); }
+    void SetSkinWeightSettings(const SSkinWeightSettings& settings) { mEnvelopeData.SetSkinWeightSettings(settings); }
+    void SetTextureSettings(const STextureSettings& settings) { mTextureData.SetTextureSettings(settings); }
+
     bool Load(tinygltf::Model* model);
+    bool Load(tinygltf::Model* model, const libj3dconv::SMappedGlb* glb);
     bool WriteBMD(bStream::CStream& stream);
 };
\ No newline at end of file
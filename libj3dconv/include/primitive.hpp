@@ -0,0 +1,96 @@
+#pragma once
+
+#include "types.hpp"
+#include "j3denum.hpp"
+
+#include <vector>
+
+// A primitive whose indices are ready, but whose vertex attributes haven't been merged into CVertexData yet.
+struct SPendingPrimitive {
+    EGXPrimitiveType mPrimitiveType = EGXPrimitiveType::None;
+    std::vector<uint32_t> mIndices;
+};
+
+// The GX draw command stores a primitive's vertex count in 16 bits.
+const size_t MAX_PRIMITIVE_VERTEX_COUNT = UINT16_MAX;
+
+// Cuts a primitive into pieces of at most maxCount vertices that draw the same thing together. Strips, fans
+// and line strips repeat the vertices they share with the previous piece; strip pieces always start on an
+// even triangle, so every triangle keeps its winding. Leaves pieces empty for types that can't be split.
+void SplitPrimitive(EGXPrimitiveType primitiveType, const std::vector<uint32_t>& vertices, size_t maxCount, std::vector<std::vector<uint32_t>>& pieces);
+// Counts the pieces SplitPrimitive would cut a primitive of vertexCount vertices into, and the vertices
+// in all of them together, without building them.
+void MeasureSplitPrimitive(EGXPrimitiveType primitiveType, size_t vertexCount, size_t maxCount, size_t& pieceCount, size_t& pieceVertexCount);
+
+// Which algorithm builds triangle strips.
+enum class EStripifier {
+    // TriStripper for ordinary meshes, and the linear stripifier for ones with at least LinearStripifierThreshold triangles.
+    Auto,
+    // Slower, but can reorder strips for a vertex cache and usually finds fewer, longer strips.
+    TriStripper,
+    // Greedy single pass over the mesh's connectivity, in time and memory linear in the index count.
+    Linear
+};
+
+// Controls how CPrimitiveOptimizer encodes a shape's triangles.
+struct SPrimitiveSettings {
+    // How much display list size matters compared to vertex cache misses, from 0 (only misses) to 1 (only size).
+    float SizeWeight = 0.5f;
+
+    EStripifier Stripifier = EStripifier::Auto;
+    uint32_t LinearStripifierThreshold = 100000;
+
+    // Cache sizes that TriStripper builds candidate strips for. The linear stripifier ignores them.
+    std::vector<uint32_t> StripCacheSizes = { 4, 8, 16 };
+
+    // For the strips-plus-list candidates, strips shorter than this many triangles go into a single triangle list instead.
+    uint32_t ResidualMinStripSize = 4;
+
+    // Entries in the FIFO vertex cache that candidates are scored against.
+    uint32_t SimulatedCacheSize = 16;
+};
+
+// Greedy stripifier that runs in time linear in the index count. It reads 16 or 32-bit index arrays
+// as they are, without widening them the way TriStripper does.
+class CLinearStripifier {
+    uint32_t mMinStripSize = 2;
+
+    template<typename TIndex>
+    void StripIndices(const TIndex* indices, size_t indexCount, std::vector<SPendingPrimitive>& primitives);
+
+public:
+    // Strips with fewer triangles than this are returned as a triangle list instead.
+    void SetMinStripSize(uint32_t minStripSize) { mMinStripSize = minStripSize; }
+
+    void Strip(const uint16_t* indices, size_t indexCount, std::vector<SPendingPrimitive>& primitives);
+    void Strip(const uint32_t* indices, size_t indexCount, std::vector<SPendingPrimitive>& primitives);
+};
+
+// Encodes a triangle list as GX primitives. Several encodings are tried (a plain list, strips at
+// several cache sizes, strips plus a residual list, and fans), and the one with the best mix of
+// display list size and simulated cache misses is kept.
+class CPrimitiveOptimizer {
+    SPrimitiveSettings mSettings;
+
+    // Bytes each vertex takes up in the display list
+    uint32_t mVertexSize = 0;
+
+    void BuildList(const std::vector<uint32_t>& triangles, std::vector<SPendingPrimitive>& primitives);
+    void BuildStrips(const std::vector<uint32_t>& triangles, uint32_t cacheSize, uint32_t minStripSize, std::vector<SPendingPrimitive>& primitives);
+    void BuildLinearStrips(const std::vector<uint32_t>& triangles, uint32_t minStripSize, std::vector<SPendingPrimitive>& primitives);
+    void BuildFans(const std::vector<uint32_t>& triangles, std::vector<SPendingPrimitive>& primitives);
+
+    // Moves single-triangle strips and fans into one triangle list at the end, since they cost more as separate draws.
+    void MergeSmallPrimitives(std::vector<SPendingPrimitive>& primitives);
+
+public:
+    CPrimitiveOptimizer(const SPrimitiveSettings& settings, uint32_t vertexSize);
+
+    // Exact size of the primitives in a display list, not counting the packet's padding. Primitives with more
+    // than MAX_PRIMITIVE_VERTEX_COUNT vertices are measured as the pieces CShape::WriteDisplayList splits them into.
+    size_t MeasureDisplayListSize(const std::vector<SPendingPrimitive>& primitives) const;
+    // Number of vertices that would miss a FIFO cache of SimulatedCacheSize entries when the primitives are drawn in order.
+    size_t SimulateCacheMisses(const std::vector<SPendingPrimitive>& primitives) const;
+
+    void Optimize(const std::vector<uint32_t>& triangles, std::vector<SPendingPrimitive>& primitives);
+};
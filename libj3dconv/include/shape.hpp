@@ -3,29 +3,65 @@
 #include "types.hpp"
 #include "util.hpp"
 #include "j3denum.hpp"
+#include "vertex.hpp"
+#include "primitive.hpp"
 
 #include <glm/glm.hpp>
+#include <map>
 #include <vector>
 #include <string>
 
-struct SVertex;
-class CVertexData;
 
 /* SPrimitive */
 
 struct SPrimitive {
     EGXPrimitiveType mPrimitiveType = EGXPrimitiveType::None;
-    shared_vector<SVertex> mVertices;
+    // Indices into the owning shape's vertex pool
+    std::vector<uint32_t> mVertices;
 
 public:
     SPrimitive() { }
     ~SPrimitive();
 };
 
+/* SVertexDescriptorEntry */
+
+// One attribute in a shape's vertex descriptor, and how its indices are stored in the display list.
+struct SVertexDescriptorEntry {
+    EGXAttribute mAttribute = EGXAttribute::Null;
+    EGXAttributeIndexType mIndexType = EGXAttributeIndexType::None;
+
+    bool operator==(const SVertexDescriptorEntry& other) const {
+        return mAttribute == other.mAttribute && mIndexType == other.mIndexType;
+    }
+
+    bool operator!=(const SVertexDescriptorEntry& other) const {
+        return !operator==(other);
+    }
+};
+
+/* SShapePacket */
+
+// Most position matrices GX can have loaded at once.
+const uint32_t MAX_PACKET_MATRIX_COUNT = 10;
+
+// A run of a shape's primitives that draws with one set of loaded position matrices.
+struct SShapePacket {
+    // The draw matrix in each matrix slot while the packet draws, or UINT16_MAX for slots nothing has loaded.
+    std::vector<uint16_t> mSlotMatrices;
+    // The draw matrices the packet loads into each slot. Slots that keep what the previous packet loaded are UINT16_MAX.
+    // Empty if the shape was never given a draw matrix.
+    std::vector<uint16_t> mMatrixTable;
+
+    shared_vector<SPrimitive> mPrimitives;
+};
+
 /* CShape */
 
 class CShape {
     shared_vector<SPrimitive> mPrimitives;
+    std::vector<SShapePacket> mPackets;
+    CVertexPool mVertexPool;
 
     // Utility properties
     std::string mMaterialName = "";
@@ -33,38 +69,87 @@ class CShape {
     uint32_t mIndex = UINT32_MAX;
     uint32_t mMaterialIndex = UINT32_MAX;
     uint32_t mJointIndex = UINT32_MAX;
+    // The DRW1 matrix a single-matrix shape draws with
+    uint16_t mDrawMatrixIndex = UINT16_MAX;
 
     // J3D properties
-    uint8_t mMatrixType;
-    std::vector<EGXAttribute> mEnabledAttributes;
+    uint8_t mMatrixType = 0;
+    std::vector<SVertexDescriptorEntry> mVertexDescriptor;
     Util::UConvBoundingVolume mBounds;
 
+    // Re-encodes a set of triangle lists as whichever mix of lists, strips and fans scores best.
+    void OptimizePrimitives(shared_vector<SPrimitive>& primitives, const SPrimitiveSettings& settings) const;
+    // Splits a multi-matrix shape's primitives into packets that each use at most MAX_PACKET_MATRIX_COUNT matrices.
+    void PartitionPackets();
+
+    void WritePrimitive(bStream::CStream& stream, const SShapePacket& packet, EGXPrimitiveType primitiveType, const uint32_t* vertices, size_t vertexCount) const;
+
 public:
     CShape();
     ~CShape();
 
-    void CalculateBoundingVolume(const std::vector<glm::vec4>& positions);
+    void CalculateBoundingVolume(const SAttributeArray& positions, const std::vector<uint32_t>& indices);
+    // Same as above, over every position in the shape's vertex pool.
+    void CalculateBoundingVolume(const SAttributeArray& positions);
+
+    // Whether other can be folded into this shape. They need the same material and draw matrix, and the same
+    // attributes in their vertex descriptors. Both descriptors must be built.
+    bool CanMerge(const CShape& other) const;
+    // Appends other's vertices and primitives to this shape. Bounds need recalculating afterwards.
+    void Merge(const CShape& other);
+
+    // Works out which attributes the shape's vertices use, and picks the smallest index type for each one.
+    void BuildVertexDescriptor();
+    // Bytes each vertex takes up in the display list, according to the current vertex descriptor.
+    uint32_t GetDisplayListVertexSize() const;
+    // Splits the shape into packets by position matrix, and picks each packet's primitive encoding.
+    void BuildPackets(const SPrimitiveSettings& settings);
+    void WriteDisplayList(bStream::CStream& stream, const SShapePacket& packet) const;
 
     void AddPrimitive(std::shared_ptr<SPrimitive> prim) { if (prim != nullptr) mPrimitives.push_back(prim); }
     shared_vector<SPrimitive>& GetPrimitives() { return mPrimitives; }
+    const std::vector<SShapePacket>& GetPackets() const { return mPackets; }
+
+    CVertexPool& GetVertexPool() { return mVertexPool; }
+    const CVertexPool& GetVertexPool() const { return mVertexPool; }
 
     const std::string& GetMaterialName() const { return mMaterialName; }
 
     uint32_t GetIndex() const { return mIndex; }
     uint32_t GetMaterialIndex() const { return mMaterialIndex; }
     uint32_t GetJointIndex() const { return mJointIndex; }
+    uint16_t GetDrawMatrixIndex() const { return mDrawMatrixIndex; }
+
+    uint8_t GetMatrixType() const { return mMatrixType; }
+    const std::vector<SVertexDescriptorEntry>& GetVertexDescriptor() const { return mVertexDescriptor; }
+    const Util::UConvBoundingVolume& GetBounds() const { return mBounds; }
 
     void SetMaterialName(std::string name) { mMaterialName = name; }
 
     void SetIndex(uint32_t index) { mIndex = index; }
     void SetMaterialIndex(uint32_t index) { mMaterialIndex = index; }
     void SetJointIndex(uint32_t index) { mJointIndex = index; }
+    void SetDrawMatrixIndex(uint16_t index) { mDrawMatrixIndex = index; }
+};
+
+/* SDecodedPrimitive */
+
+// Everything decoded from a single glTF primitive.
+struct SDecodedPrimitive {
+    SVertexAttributes mAttributes;
+    std::vector<glm::vec4> mJointIndices;
+    std::vector<glm::vec4> mWeights;
+
+    // Null if the primitive was skipped
+    std::shared_ptr<CShape> mShape;
+    std::vector<SPendingPrimitive> mPendingPrimitives;
 };
 
 /* UConverterShape Data */
 
 class CShapeData {
     shared_vector<CShape> mShapes;
+    SPrimitiveSettings mPrimitiveSettings;
 
     void ReadGltfVertexAttribute(
         const tinygltf::Model* model,
@@ -72,12 +157,28 @@ class CShapeData {
         uint32_t attributeAccessorIndex,
         std::vector<glm::vec4>& values
     );
+    void ReadGltfVertexAttribute(
+        const tinygltf::Model* model,
+        std::vector<bStream::CMemoryStream>& buffers,
+        uint32_t attributeAccessorIndex,
+        SAttributeArray& values
+    );
     void ReadGltfIndices(
         const tinygltf::Model* model,
         std::vector<bStream::CMemoryStream>& buffers,
         uint32_t indexAccessorIndex,
-        std::vector<uint16_t>& indices
+        std::vector<uint32_t>& indices
+    );
+
+    // Reads a primitive without touching any shared state, so it can run on any thread.
+    void DecodePrimitive(
+        const tinygltf::Model* model,
+        std::vector<bStream::CMemoryStream>& buffers,
+        const tinygltf::Mesh& mesh,
+        const tinygltf::Primitive& prim,
+        SDecodedPrimitive& decoded
     );
+    void MergePrimitive(SDecodedPrimitive& decoded, CVertexData& vertexData);
 
 public:
     CShapeData();
@@ -89,5 +190,13 @@ public:
         std::vector<bStream::CMemoryStream>& buffers
     );
 
+    // Builds every shape's packets. Must run after the vertex attributes are quantized, since the index sizes
+    // it measures depend on the final attribute arrays, and after envelopes have set the position matrices.
+    void BuildPackets();
+
     shared_vector<CShape>& GetShapes() { return mShapes; }
+
+    void SetPrimitiveSettings(const SPrimitiveSettings& settings) { mPrimitiveSettings = settings; }
+
+    void WriteSHP1(bStream::CStream& stream);
 };
\ No newline at end of file
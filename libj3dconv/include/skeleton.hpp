@@ -10,6 +10,7 @@
 #include <string>
 
 class CShape;
+class CVertexData;
 
 enum class EHierarchyNodeType {
     End = 0,
@@ -42,17 +43,21 @@ struct SJoint {
     uint32_t JointIndex = UINT32_MAX;
     shared_vector<CShape> AttachedShapes;
 
-    void WriteHierarchyRecursive(bStream::CStream& stream);
+    // Writes this joint and everything below it, walking the tree with its own stack so deep chains can't overflow.
+    void WriteHierarchy(bStream::CStream& stream);
 };
 
 class CSkeletonData {
     shared_vector<SJoint> mJoints;
     std::shared_ptr<SJoint> mRootJoint;
 
+    // glTF node index to joint index, UINT32_MAX for nodes that aren't joints
+    std::vector<uint32_t> mNodeJointIndices;
+
     void CreateDummyRoot(tinygltf::Model* model);
 
     void CreateSkeleton(tinygltf::Model* model);
-    void BuildHierarchyRecursive(const std::vector<tinygltf::Node>& nodes, std::shared_ptr<SJoint> parent, uint32_t currentIndex);
+    void BuildHierarchy(const std::vector<tinygltf::Node>& nodes, uint32_t rootNodeIndex);
 
 public:
     CSkeletonData();
@@ -64,4 +69,13 @@ public:
     void WriteJNT1(bStream::CStream& stream);
 
     void AttachShapesToSkeleton(shared_vector<CShape>& shapes);
+
+    // Orders every joint's shapes and children so the INF1 walk switches materials, then textures, as rarely as
+    // it can, and folds shapes under the same joint that share a material into one where possible. Shapes are
+    // renumbered and put in that draw order. Runs after envelopes are processed and before packets are built.
+    void PlanDrawOrder(shared_vector<CShape>& shapes, const CVertexData& vertexData, const tinygltf::Model* model);
+
+    // Fits each joint's box and sphere around the vertices it influences, in the joint's own bind space, found through
+    // the joint's inverse bind matrix. Joints that don't move any vertices get empty bounds.
+    void CalculateJointBounds(const shared_vector<CShape>& shapes, const CVertexData& vertexData, const std::vector<glm::mat4>& inverseBindMatrices);
 };
\ No newline at end of file
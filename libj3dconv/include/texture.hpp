@@ -1,6 +1,8 @@
 #pragma once
 
 #include "types.hpp"
+#include "j3denum.hpp"
+#include "gxtexture.hpp"
 
 #include <vector>
 #include <string>
@@ -11,14 +13,6 @@ enum class EWrapMode {
     Mirror
 };
 
-enum class EPaletteFormat {
-    IA8,
-    RGB565,
-    RGB5A3,
-
-    None
-};
-
 enum class EFilterMode {
     Nearest,
     Linear,
@@ -29,8 +23,30 @@ enum class EFilterMode {
     LinearMipmapLinear
 };
 
+// How a texture's alpha has to be handled, as stored in TEX1.
+enum class ETextureAlpha {
+    Opaque,
+    // Every texel is either fully transparent or fully opaque
+    Cutout,
+    Translucent
+};
+
+struct STextureSettings {
+    ECMPRQuality CMPRQuality = ECMPRQuality::Normal;
+
+    // Stores textures with few enough colors as C4 or C8 wherever that's no larger than their direct format.
+    bool bLosslessPalettes = true;
+    // Quantizes textures that would otherwise need a 16-bit format (IA8 or RGB5A3) down to C8, halving their size.
+    bool bQuantizePalettes = false;
+
+    // Generates mipmaps for textures whose sampler minifies with them.
+    bool bGenerateMipmaps = true;
+};
+
 struct STexture {
     std::string mName;
+    // The glTF texture this was made from
+    int mGltfTextureIndex = -1;
     std::vector<uint8_t> mData;
     size_t mWidth;
     size_t mHeight;
@@ -42,13 +58,50 @@ struct STexture {
     EFilterMode mFilterMag = EFilterMode::Linear;
 
     EPaletteFormat mPaletteFormat = EPaletteFormat::None;
+
+    EGXTextureFormat mFormat = EGXTextureFormat::CMPR;
+    ETextureAlpha mAlpha = ETextureAlpha::Opaque;
+    // mData encoded in mFormat, followed by its mip levels, as it's written to TEX1
+    std::vector<uint8_t> mImageData;
+    // Images in mImageData, counting the full size one
+    uint32_t mMipCount = 1;
+    // The TLUT for indexed formats, in mPaletteFormat
+    std::vector<uint8_t> mPaletteData;
+};
+
+// Pixels decoded from a glTF image, before they're attached to a texture.
+struct SDecodedImage {
+    std::vector<uint8_t> mData;
+    int mWidth = 0;
+    int mHeight = 0;
+
+    bool mValid = false;
 };
 
 class CTextureData {
     shared_vector<STexture> mTextures;
+    // TEX1 index of each glTF texture, or -1 for ones that were skipped
+    std::vector<int> mTextureIndices;
+    STextureSettings mTextureSettings;
 
     EWrapMode ConvertWrapMode(int mode);
     EFilterMode ConvertFilterMode(int mode);
+    // GX's value for a filter mode. Without mipmaps, the mipmap part of a minification filter is dropped.
+    uint8_t GetGXFilterMode(EFilterMode mode, bool bHasMipmaps);
+
+    bool IsGrayscale(const std::vector<uint8_t>& data);
+    // Picks the format a texture is encoded in from its colors and alpha.
+    EGXTextureFormat ChooseFormat(const STexture& texture, bool bGrayscale);
+    bool UsesMipmaps(EFilterMode mode);
+
+    // Encodes a texture's pixels into its format, along with its mip levels if its sampler uses them.
+    // Returns false if the texture can't be encoded.
+    bool EncodeTexture(STexture& texture);
+    // Encodes one image of a texture into dst. The full size image builds the TLUT for indexed formats; mip levels reuse it.
+    bool EncodeImage(STexture& texture, const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst, bool bBaseLevel);
+
+    // Decodes the image to RGBA8 if it was loaded as-is; otherwise converts tinygltf's decoded pixels to RGBA8.
+    bool DecodeImage(const tinygltf::Image& img, std::vector<uint8_t>& data, int& width, int& height);
 
 public:
     CTextureData();
@@ -56,5 +109,16 @@ public:
 
     void ProcessTextureData(const tinygltf::Model* model, std::vector<bStream::CMemoryStream>& buffers);
 
+    void SetTextureSettings(const STextureSettings& settings) { mTextureSettings = settings; }
+
+    // The TEX1 index of a glTF texture, or -1 if it was skipped or doesn't exist.
+    int GetTextureIndex(int gltfTextureIndex) const {
+        if (gltfTextureIndex < 0 || static_cast<size_t>(gltfTextureIndex) >= mTextureIndices.size()) {
+            return -1;
+        }
+
+        return mTextureIndices[gltfTextureIndex];
+    }
+
     void WriteTEX1(bStream::CStream& stream);
 };
@@ -16,6 +16,9 @@ namespace bStream {
 namespace tinygltf {
     class Model;
     class Node;
+    struct Mesh;
+    struct Primitive;
+    struct Image;
 }
 
 template<typename T>
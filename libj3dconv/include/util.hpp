@@ -10,6 +10,7 @@
 #include <filesystem>
 #include <cstddef>
 #include <algorithm>
+#include <functional>
 
 namespace Util {
     // Returns the index of the given element in the given vector, or -1 if the element is not in that vector.
@@ -46,14 +47,48 @@ namespace Util {
         return static_cast<typename std::underlying_type<E>::type>(e);
     }
 
+    // Sets how many threads ParallelFor may use. 0 uses one thread per hardware thread.
+    void SetThreadCount(uint32_t threadCount);
+    uint32_t GetThreadCount();
+
+    // Calls func(i) for every i in [0, count) across a persistent pool of worker threads, handing out indices as threads
+    // free up. func must be safe to call concurrently for different indices. Returns once every call has finished.
+    // If func throws, no further indices are started and the first exception is rethrown here. Nested calls run inline.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& func);
+
     std::string LoadTextFile(std::filesystem::path filePath);
     void PadStreamWithString(bStream::CStream* stream, uint32_t padValue, std::string str = "");
     void WriteOffset(bStream::CStream* stream, size_t relativeTo, uint32_t location);
 
+    // A read-only view of a file's contents, mapped into memory rather than read into a buffer.
+    class CMappedFile {
+        const uint8_t* mData = nullptr;
+        size_t mSize = 0;
+
+#ifdef _WIN32
+        void* mFileHandle = nullptr;
+        void* mMappingHandle = nullptr;
+#endif
+
+    public:
+        CMappedFile() { }
+        ~CMappedFile();
+
+        CMappedFile(const CMappedFile&) = delete;
+        CMappedFile& operator=(const CMappedFile&) = delete;
+
+        bool Open(std::filesystem::path filePath);
+        void Close();
+
+        const uint8_t* GetData() const { return mData; }
+        size_t GetSize() const { return mSize; }
+        bool IsOpen() const { return mData != nullptr; }
+    };
+
     struct UConvBoundingVolume {
         float BoundingSphereRadius = 0.0f;
 
         glm::vec3 BoundingBoxMin = { FLT_MAX, FLT_MAX, FLT_MAX };
-        glm::vec3 BoundingBoxMax = { FLT_MIN, FLT_MIN, FLT_MIN };
+        glm::vec3 BoundingBoxMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
     };
 }
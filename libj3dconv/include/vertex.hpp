@@ -4,38 +4,139 @@
 #include "j3denum.hpp"
 
 #include <glm/glm.hpp>
+#include <glm/gtx/hash.hpp>
 
+#include <array>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 struct SPrimitive;
 
-struct SVertex {
-    uint16_t PositionIndex = UINT16_MAX;
+// Number of GX vertex attributes, for arrays indexed by attribute.
+const size_t GX_ATTRIBUTE_COUNT = static_cast<size_t>(EGXAttribute::Attribute_Max);
 
-    // If this is set, then the mesh is using normal/binormal/tangent
+// How many components the converter keeps for an attribute, or 0 if it doesn't store the attribute's values.
+uint32_t GetAttributeComponentCount(EGXAttribute attribute);
+
+// Values of a single vertex attribute, packed at the attribute's real component count.
+struct SAttributeArray {
+    uint32_t ComponentCount = 0;
+    std::vector<float> Values;
+
+    size_t Size() const { return ComponentCount == 0 ? 0 : Values.size() / ComponentCount; }
+    bool Empty() const { return Values.empty(); }
+
+    const float* Get(size_t index) const { return Values.data() + index * ComponentCount; }
+    float* Get(size_t index) { return Values.data() + index * ComponentCount; }
+
+    void Add(const float* value) { Values.insert(Values.end(), value, value + ComponentCount); }
+    void RemoveLast() { Values.resize(Values.size() - ComponentCount); }
+};
+
+// Every vertex attribute of a primitive or model, indexed by attribute.
+struct SVertexAttributes {
+    std::array<SAttributeArray, GX_ATTRIBUTE_COUNT> Arrays;
+
+    SVertexAttributes();
+
+    SAttributeArray& operator[](EGXAttribute attribute) { return Arrays[static_cast<size_t>(attribute)]; }
+    const SAttributeArray& operator[](EGXAttribute attribute) const { return Arrays[static_cast<size_t>(attribute)]; }
+
+    bool Has(EGXAttribute attribute) const { return !operator[](attribute).Empty(); }
+};
+
+// Hashes and compares an attribute's values by their index in its SAttributeArray,
+// so the lookup tables don't need their own copy of every value.
+struct SAttributeValueHash {
+    const SAttributeArray* Array = nullptr;
+
+    size_t operator()(uint32_t index) const {
+        const float* value = Array->Get(index);
+        size_t seed = 0;
+
+        for (uint32_t i = 0; i < Array->ComponentCount; i++) {
+            glm::detail::hash_combine(seed, std::hash<float>()(value[i]));
+        }
+
+        return seed;
+    }
+};
+
+struct SAttributeValueEqual {
+    const SAttributeArray* Array = nullptr;
+
+    bool operator()(uint32_t a, uint32_t b) const {
+        const float* valueA = Array->Get(a);
+        const float* valueB = Array->Get(b);
+
+        for (uint32_t i = 0; i < Array->ComponentCount; i++) {
+            if (valueA[i] != valueB[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+using attribute_index_set = std::unordered_set<uint32_t, SAttributeValueHash, SAttributeValueEqual>;
+
+// Most joints that can influence a single vertex, matching glTF's JOINTS_0/WEIGHTS_0.
+const uint32_t MAX_VERTEX_INFLUENCES = 4;
+
+// Packed vertex storage for a shape. Each vertex property lives in its own array and vertices
+// are addressed by index, so passes that only look at one property read memory linearly.
+class CVertexPool {
+    std::vector<uint16_t> mPositionIndices;
+    std::vector<uint16_t> mNormalIndices;
+    std::vector<uint16_t> mColorIndices[2];
+    std::vector<uint16_t> mTexCoordIndices[8];
+    std::vector<uint16_t> mPosMatrixIndices;
+
+    // If this is set, then the vertex is using normal/binormal/tangent
     // rather than typical vertex normals.
-    bool bUseNBT = false;
-    uint16_t NormalIndex = UINT16_MAX;
-
-    uint16_t ColorIndex[2]{ UINT16_MAX, UINT16_MAX };
-    uint16_t TexCoordIndex[8]{
-        UINT16_MAX,
-        UINT16_MAX,
-        UINT16_MAX,
-        UINT16_MAX,
-        UINT16_MAX,
-        UINT16_MAX,
-        UINT16_MAX,
-        UINT16_MAX
-    };
-
-    uint16_t PosMatrixIndex = UINT16_MAX;
-
-    std::vector<uint16_t> JointIndices;
-    std::vector<float> Weights;
-
-    void SetIndex(EGXAttribute attribute, uint16_t index);
+    std::vector<uint8_t> mUseNBT;
+
+    // Skinning influences, MAX_VERTEX_INFLUENCES slots per vertex
+    std::vector<uint8_t> mInfluenceCounts;
+    std::vector<uint16_t> mJointIndices;
+    std::vector<float> mWeights;
+
+public:
+    CVertexPool() { }
+    ~CVertexPool() { }
+
+    // Adds a vertex with every index unset, and returns its index in the pool.
+    uint32_t AddVertex();
+    void Reserve(size_t count);
+    // Adds copies of every vertex in other after this pool's own vertices.
+    void Append(const CVertexPool& other);
+
+    uint32_t GetVertexCount() const { return static_cast<uint32_t>(mPositionIndices.size()); }
+
+    // Returns the index array for the given attribute, or nullptr if the pool doesn't store it.
+    std::vector<uint16_t>* GetIndexArray(EGXAttribute attribute);
+    const std::vector<uint16_t>* GetIndexArray(EGXAttribute attribute) const;
+
+    uint16_t GetIndex(EGXAttribute attribute, uint32_t vertex) const;
+    void SetIndex(EGXAttribute attribute, uint32_t vertex, uint16_t index);
+
+    bool GetUseNBT(uint32_t vertex) const { return mUseNBT[vertex] != 0; }
+    void SetUseNBT(uint32_t vertex, bool useNBT) { mUseNBT[vertex] = useNBT; }
+
+    uint16_t GetPosMatrixIndex(uint32_t vertex) const { return mPosMatrixIndices[vertex]; }
+    void SetPosMatrixIndex(uint32_t vertex, uint16_t index) { mPosMatrixIndices[vertex] = index; }
+
+    uint32_t GetInfluenceCount(uint32_t vertex) const { return mInfluenceCounts[vertex]; }
+    const uint16_t* GetJointIndices(uint32_t vertex) const { return &mJointIndices[vertex * MAX_VERTEX_INFLUENCES]; }
+    const float* GetWeights(uint32_t vertex) const { return &mWeights[vertex * MAX_VERTEX_INFLUENCES]; }
+
+    // Returns false if the vertex's influence slots are already full.
+    bool AddInfluence(uint32_t vertex, uint16_t jointIndex, float weight);
+    void ClearInfluences(uint32_t vertex) { mInfluenceCounts[vertex] = 0; }
 };
 
 struct SNBTData {
@@ -45,7 +146,7 @@ struct SNBTData {
 
     SNBTData(glm::vec3 nrm, glm::vec3 tan, glm::vec3 bit) : Normal(nrm), Tangent(tan), Bitangent(bit) { }
 
-    bool operator==(const SNBTData& other) {
+    bool operator==(const SNBTData& other) const {
         if (Normal == other.Normal && Tangent == other.Tangent && Bitangent == other.Bitangent) {
             return true;
         }
@@ -53,33 +154,97 @@ struct SNBTData {
         return false;
     }
 
-    bool operator!= (const SNBTData& other) {
+    bool operator!= (const SNBTData& other) const {
         return !(operator==(other));
     }
 };
 
+struct SNBTDataHash {
+    size_t operator()(const SNBTData& nbt) const {
+        size_t seed = std::hash<glm::vec3>()(nbt.Normal);
+        glm::detail::hash_combine(seed, std::hash<glm::vec3>()(nbt.Tangent));
+        glm::detail::hash_combine(seed, std::hash<glm::vec3>()(nbt.Bitangent));
+
+        return seed;
+    }
+};
+
+// Largest error allowed per component when an attribute is stored as fixed-point in VTX1.
+// A tolerance of 0 only picks fixed-point when every value is exactly representable.
+struct SQuantizationSettings {
+    // In model units
+    float PositionTolerance = 0.0f;
+    float NormalTolerance = 1.0f / 32768.0f;
+    float TexCoordTolerance = 1.0f / 512.0f;
+};
+
+// How an attribute's values are stored in VTX1.
+struct SAttributeFormat {
+    EGXComponentType ComponentType = EGXComponentType::Float;
+    uint8_t FixedPointExponent = 0;
+};
+
+class CShape;
+
 class CVertexData {
-    std::map<EGXAttribute, std::vector<glm::vec4>> mVertexData;
-    shared_vector<SNBTData> mNBTData;
+    SVertexAttributes mVertexData;
+    // Holds the first index of each unique value in mVertexData, so lookups don't scan the whole attribute.
+    // The sets point into mVertexData, which is why CVertexData can't be copied.
+    std::array<attribute_index_set, GX_ATTRIBUTE_COUNT> mVertexDataIndices;
+    std::vector<SNBTData> mNBTData;
+    std::unordered_map<SNBTData, uint16_t, SNBTDataHash> mNBTDataIndices;
+
+    // Attributes that ran out of 16-bit indices, so the error is only reported once per attribute
+    std::set<EGXAttribute> mOverflowedAttributes;
 
-    void ProcessNBTData(const std::vector<glm::vec4>& tangents, const uint16_t vertexIndex, std::shared_ptr<SVertex> vertex);
+    SQuantizationSettings mQuantizationSettings;
+    std::map<EGXAttribute, SAttributeFormat> mAttributeFormats;
+
+    void ReportAttributeOverflow(EGXAttribute attribute);
+
+    // Picks the smallest component type, and the most precise exponent for it, that keeps every value within tolerance.
+    SAttributeFormat ChooseAttributeFormat(EGXAttribute attribute, const SAttributeArray& values);
+    SAttributeFormat GetAttributeFormat(EGXAttribute attribute) const;
+    void WriteAttributeComponent(bStream::CStream& stream, float value, const SAttributeFormat& format);
+
+    // Returns the index of the value if the attribute already has it. Otherwise adds it if add is set.
+    uint16_t FindValueInAttribute(EGXAttribute attribute, const float* value, bool add);
+
+    void ProcessNBTData(const SAttributeArray& tangents, const uint32_t vertexIndex, CVertexPool& pool, const uint32_t poolIndex);
     void WriteNBTData(bStream::CStream& stream);
 
 public:
     CVertexData();
     ~CVertexData();
 
-    bool AttributeContainsValue(EGXAttribute attribute, const glm::vec4& value);
-    uint16_t AddValueToAttribute(EGXAttribute attribute, const glm::vec4& value);
-    uint16_t GetIndexOfValueInAttribute(EGXAttribute attribute, const glm::vec4& value);
+    CVertexData(const CVertexData&) = delete;
+    CVertexData& operator=(const CVertexData&) = delete;
 
-    void BuildConverterPrimitive(const std::map<EGXAttribute, std::vector<glm::vec4>>& attributes,
-        const std::vector<uint16_t>& indices,
+    // Values have the attribute's component count, as given by GetAttributeComponentCount().
+    bool AttributeContainsValue(EGXAttribute attribute, const float* value);
+    uint16_t AddValueToAttribute(EGXAttribute attribute, const float* value);
+    uint16_t GetIndexOfValueInAttribute(EGXAttribute attribute, const float* value);
+
+    // Adds the primitive's vertices to the pool. poolIndices maps source vertices to pool vertices
+    // (UINT32_MAX if not added yet), so vertices shared between primitives are only stored once.
+    void BuildConverterPrimitive(const SVertexAttributes& attributes,
+        const std::vector<uint32_t>& indices,
         const std::vector<glm::vec4>& jointIndices,
         const std::vector<glm::vec4>& jointWeights,
+        CVertexPool& pool,
+        std::vector<uint32_t>& poolIndices,
         std::shared_ptr<SPrimitive> primitive);
 
+    void SetQuantizationSettings(const SQuantizationSettings& settings) { mQuantizationSettings = settings; }
+
+    // Chooses a storage format for positions, normals and texcoords, then collapses values that quantize
+    // to the same result and points the shapes' vertices at the merged values.
+    void QuantizeAttributes(shared_vector<CShape>& shapes);
+
     void WriteVTX1(bStream::CStream& stream);
 
-    uint32_t GetVertexCount() const { return static_cast<uint32_t>(mVertexData.at(EGXAttribute::Position).size()); }
+    uint32_t GetVertexCount() const { return static_cast<uint32_t>(mVertexData[EGXAttribute::Position].Size()); }
+    const SAttributeArray& GetAttributeValues(EGXAttribute attribute) const { return mVertexData[attribute]; }
+    // Whether any attribute had more unique values than 16-bit indices can address. Such a model can't be written.
+    bool HasOverflowed() const { return !mOverflowedAttributes.empty(); }
 };
@@ -0,0 +1,411 @@
+#include "accessor.hpp"
+
+#include <bstream.h>
+#include <tiny_gltf.h>
+
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define J3DCONV_ACCESSOR_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+    // Scale that maps a normalized integer component to [0, 1] or [-1, 1], per the glTF spec.
+    template<typename T>
+    constexpr float NormalizedScale() {
+        if constexpr (std::is_floating_point_v<T>) {
+            return 1.0f;
+        }
+        else {
+            return 1.0f / static_cast<float>(std::numeric_limits<T>::max());
+        }
+    }
+
+    // Reads one element of NumComponents components into dstComponents floats, zero-filling the rest.
+    template<typename T, uint32_t NumComponents, bool Normalized>
+    inline void DecodeElementScalar(const uint8_t* src, float* dst, uint32_t dstComponents) {
+        T components[NumComponents];
+        std::memcpy(components, src, sizeof(components));
+
+        for (uint32_t i = 0; i < dstComponents; i++) {
+            if (i >= NumComponents) {
+                dst[i] = 0.0f;
+                continue;
+            }
+
+            float value = static_cast<float>(components[i]);
+
+            if constexpr (Normalized) {
+                value *= NormalizedScale<T>();
+
+                if constexpr (std::is_signed_v<T>) {
+                    value = value < -1.0f ? -1.0f : value;
+                }
+            }
+
+            dst[i] = value;
+        }
+    }
+
+#ifdef J3DCONV_ACCESSOR_SSE2
+    // Loads one element and widens its components to 4 floats in a single register.
+    template<typename T, uint32_t NumComponents>
+    inline __m128 LoadWidened(const uint8_t* src) {
+        if constexpr (std::is_same_v<T, float>) {
+            if constexpr (NumComponents == 4) {
+                return _mm_loadu_ps(reinterpret_cast<const float*>(src));
+            }
+            else {
+                float components[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                std::memcpy(components, src, sizeof(float) * NumComponents);
+
+                return _mm_loadu_ps(components);
+            }
+        }
+        else if constexpr (sizeof(T) == 1) {
+            int32_t packed = 0;
+            std::memcpy(&packed, src, NumComponents);
+
+            __m128i bytes = _mm_cvtsi32_si128(packed);
+            __m128i words, dwords;
+
+            if constexpr (std::is_signed_v<T>) {
+                // Place each byte in the top of its lane, then shift down to sign-extend
+                words = _mm_unpacklo_epi8(bytes, bytes);
+                dwords = _mm_srai_epi32(_mm_unpacklo_epi16(words, words), 24);
+            }
+            else {
+                words = _mm_unpacklo_epi8(bytes, _mm_setzero_si128());
+                dwords = _mm_unpacklo_epi16(words, _mm_setzero_si128());
+            }
+
+            return _mm_cvtepi32_ps(dwords);
+        }
+        else {
+            int64_t packed = 0;
+            std::memcpy(&packed, src, sizeof(T) * NumComponents);
+
+            __m128i words = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&packed));
+            __m128i dwords;
+
+            if constexpr (std::is_signed_v<T>) {
+                dwords = _mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16);
+            }
+            else {
+                dwords = _mm_unpacklo_epi16(words, _mm_setzero_si128());
+            }
+
+            return _mm_cvtepi32_ps(dwords);
+        }
+    }
+#endif
+
+    // Decodes count elements into dst, which holds dstComponents (1 to 4) floats per element.
+    template<typename T, uint32_t NumComponents, bool Normalized>
+    void DecodeElements(const uint8_t* src, size_t stride, size_t count, float* dst, uint32_t dstComponents) {
+#ifdef J3DCONV_ACCESSOR_SSE2
+        // 32-bit integers can't be widened, so they take the scalar path below.
+        if constexpr (sizeof(T) != 4 || std::is_same_v<T, float>) {
+            const __m128 scale = _mm_set1_ps(NormalizedScale<T>());
+            const __m128 minValue = _mm_set1_ps(-1.0f);
+
+            // Each store writes 4 floats, and the spill into the next element is overwritten when that element is decoded.
+            // Elements too close to the end for that are stored through a temporary instead.
+            size_t storeEnd = count * dstComponents;
+
+            for (size_t i = 0; i < count; i++, src += stride) {
+                __m128 value = LoadWidened<T, NumComponents>(src);
+
+                if constexpr (Normalized && !std::is_same_v<T, float>) {
+                    value = _mm_mul_ps(value, scale);
+
+                    if constexpr (std::is_signed_v<T>) {
+                        value = _mm_max_ps(value, minValue);
+                    }
+                }
+
+                if (i * dstComponents + 4 <= storeEnd) {
+                    _mm_storeu_ps(dst + i * dstComponents, value);
+                }
+                else {
+                    float components[4];
+                    _mm_storeu_ps(components, value);
+                    std::memcpy(dst + i * dstComponents, components, sizeof(float) * dstComponents);
+                }
+            }
+
+            return;
+        }
+#endif
+
+        for (size_t i = 0; i < count; i++, src += stride) {
+            DecodeElementScalar<T, NumComponents, Normalized>(src, dst + i * dstComponents, dstComponents);
+        }
+    }
+
+    template<typename T, uint32_t NumComponents>
+    void DecodeElements(const uint8_t* src, size_t stride, size_t count, bool normalized, float* dst, uint32_t dstComponents) {
+        if (normalized) {
+            DecodeElements<T, NumComponents, true>(src, stride, count, dst, dstComponents);
+        }
+        else {
+            DecodeElements<T, NumComponents, false>(src, stride, count, dst, dstComponents);
+        }
+    }
+
+    template<typename T>
+    void DecodeIndices(const uint8_t* src, size_t stride, size_t count, uint32_t* dst) {
+        for (size_t i = 0; i < count; i++, src += stride) {
+            T index;
+            std::memcpy(&index, src, sizeof(T));
+
+            dst[i] = index;
+        }
+    }
+
+    template<typename T>
+    void DecodeElements(const uint8_t* src, size_t stride, size_t count, uint32_t numComponents, bool normalized, float* dst, uint32_t dstComponents) {
+        switch (numComponents) {
+            case 1:
+                DecodeElements<T, 1>(src, stride, count, normalized, dst, dstComponents);
+                break;
+            case 2:
+                DecodeElements<T, 2>(src, stride, count, normalized, dst, dstComponents);
+                break;
+            case 3:
+                DecodeElements<T, 3>(src, stride, count, normalized, dst, dstComponents);
+                break;
+            case 4:
+                DecodeElements<T, 4>(src, stride, count, normalized, dst, dstComponents);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+namespace {
+    // Finds where an accessor's first element lives and how far apart its elements are,
+    // making sure that every element lies within its buffer.
+    bool GetAccessorData(
+        const tinygltf::Model* model,
+        std::vector<bStream::CMemoryStream>& buffers,
+        uint32_t accessorIndex,
+        const uint8_t*& data,
+        size_t& stride
+    ) {
+        if (accessorIndex >= model->accessors.size()) {
+            return false;
+        }
+
+        const auto& accessor = model->accessors[accessorIndex];
+        if (accessor.bufferView < 0 || static_cast<size_t>(accessor.bufferView) >= model->bufferViews.size()) {
+            return false;
+        }
+
+        const auto& view = model->bufferViews[accessor.bufferView];
+        if (view.buffer < 0 || static_cast<size_t>(view.buffer) >= buffers.size()) {
+            return false;
+        }
+
+        int32_t numComponents = tinygltf::GetNumComponentsInType(accessor.type);
+        int32_t componentSize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+
+        if (numComponents < 1 || componentSize < 1) {
+            return false;
+        }
+
+        size_t elementSize = static_cast<size_t>(numComponents) * componentSize;
+        size_t startOffset = view.byteOffset + accessor.byteOffset;
+
+        stride = view.byteStride != 0 ? view.byteStride : elementSize;
+
+        auto& stream = buffers[view.buffer];
+        if (accessor.count != 0 && startOffset + stride * (accessor.count - 1) + elementSize > stream.getSize()) {
+            std::cout << "Accessor " << accessorIndex << " reads past the end of buffer " << view.buffer << "!" << std::endl;
+            return false;
+        }
+
+        data = stream.getBuffer() + startOffset;
+        return true;
+    }
+}
+
+namespace {
+    // Checks that the accessor can be decoded as floats, and returns how many elements it has.
+    bool GetFloatAccessor(
+        const tinygltf::Model* model,
+        std::vector<bStream::CMemoryStream>& buffers,
+        uint32_t accessorIndex,
+        const uint8_t*& src,
+        size_t& stride,
+        size_t& count
+    ) {
+        if (!GetAccessorData(model, buffers, accessorIndex, src, stride)) {
+            return false;
+        }
+
+        // Matrices aren't vertex attributes, so only scalars and vectors are supported here.
+        const auto& accessor = model->accessors[accessorIndex];
+        if (tinygltf::GetNumComponentsInType(accessor.type) > 4) {
+            return false;
+        }
+
+        count = accessor.count;
+        return true;
+    }
+
+    // Decodes the accessor's elements into dst, dstComponents floats per element.
+    bool DecodeFloatAccessor(const tinygltf::Accessor& accessor, const uint8_t* src, size_t stride, float* dst, uint32_t dstComponents) {
+        int32_t numComponents = tinygltf::GetNumComponentsInType(accessor.type);
+
+        switch (accessor.componentType) {
+            case TINYGLTF_COMPONENT_TYPE_BYTE:
+                DecodeElements<int8_t>(src, stride, accessor.count, numComponents, accessor.normalized, dst, dstComponents);
+                return true;
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+                DecodeElements<uint8_t>(src, stride, accessor.count, numComponents, accessor.normalized, dst, dstComponents);
+                return true;
+            case TINYGLTF_COMPONENT_TYPE_SHORT:
+                DecodeElements<int16_t>(src, stride, accessor.count, numComponents, accessor.normalized, dst, dstComponents);
+                return true;
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+                DecodeElements<uint16_t>(src, stride, accessor.count, numComponents, accessor.normalized, dst, dstComponents);
+                return true;
+            case TINYGLTF_COMPONENT_TYPE_INT:
+                DecodeElements<int32_t>(src, stride, accessor.count, numComponents, accessor.normalized, dst, dstComponents);
+                return true;
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+                DecodeElements<uint32_t>(src, stride, accessor.count, numComponents, accessor.normalized, dst, dstComponents);
+                return true;
+            case TINYGLTF_COMPONENT_TYPE_FLOAT:
+                DecodeElements<float>(src, stride, accessor.count, numComponents, false, dst, dstComponents);
+                return true;
+            default:
+                return false;
+        }
+    }
+}
+
+bool Accessor::ReadVec4(
+    const tinygltf::Model* model,
+    std::vector<bStream::CMemoryStream>& buffers,
+    uint32_t accessorIndex,
+    std::vector<glm::vec4>& values
+) {
+    const uint8_t* src = nullptr;
+    size_t stride = 0, count = 0;
+
+    if (!GetFloatAccessor(model, buffers, accessorIndex, src, stride, count)) {
+        return false;
+    }
+
+    size_t firstValue = values.size();
+    values.resize(firstValue + count);
+
+    if (!DecodeFloatAccessor(model->accessors[accessorIndex], src, stride, reinterpret_cast<float*>(values.data() + firstValue), 4)) {
+        values.resize(firstValue);
+        return false;
+    }
+
+    return true;
+}
+
+bool Accessor::ReadFloats(
+    const tinygltf::Model* model,
+    std::vector<bStream::CMemoryStream>& buffers,
+    uint32_t accessorIndex,
+    uint32_t componentCount,
+    std::vector<float>& values
+) {
+    const uint8_t* src = nullptr;
+    size_t stride = 0, count = 0;
+
+    if (componentCount < 1 || componentCount > 4 || !GetFloatAccessor(model, buffers, accessorIndex, src, stride, count)) {
+        return false;
+    }
+
+    size_t firstValue = values.size();
+    values.resize(firstValue + count * componentCount);
+
+    if (!DecodeFloatAccessor(model->accessors[accessorIndex], src, stride, values.data() + firstValue, componentCount)) {
+        values.resize(firstValue);
+        return false;
+    }
+
+    return true;
+}
+
+bool Accessor::ReadMat4(
+    const tinygltf::Model* model,
+    std::vector<bStream::CMemoryStream>& buffers,
+    uint32_t accessorIndex,
+    std::vector<glm::mat4>& values
+) {
+    static_assert(sizeof(glm::mat4) == sizeof(float) * 16, "glm::mat4 must be 16 packed floats");
+
+    const uint8_t* src = nullptr;
+    size_t stride = 0;
+
+    if (!GetAccessorData(model, buffers, accessorIndex, src, stride)) {
+        return false;
+    }
+
+    const auto& accessor = model->accessors[accessorIndex];
+    if (accessor.type != TINYGLTF_TYPE_MAT4 || accessor.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT) {
+        return false;
+    }
+
+    size_t firstValue = values.size();
+    values.resize(firstValue + accessor.count);
+
+    for (size_t i = 0; i < accessor.count; i++, src += stride) {
+        std::memcpy(&values[firstValue + i], src, sizeof(glm::mat4));
+    }
+
+    return true;
+}
+
+bool Accessor::ReadIndices(
+    const tinygltf::Model* model,
+    std::vector<bStream::CMemoryStream>& buffers,
+    uint32_t accessorIndex,
+    std::vector<uint32_t>& values
+) {
+    const uint8_t* src = nullptr;
+    size_t stride = 0;
+
+    if (!GetAccessorData(model, buffers, accessorIndex, src, stride)) {
+        return false;
+    }
+
+    const auto& accessor = model->accessors[accessorIndex];
+    if (accessor.type != TINYGLTF_TYPE_SCALAR) {
+        return false;
+    }
+
+    size_t firstValue = values.size();
+    values.resize(firstValue + accessor.count);
+    uint32_t* dst = values.data() + firstValue;
+
+    switch (accessor.componentType) {
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+            DecodeIndices<uint8_t>(src, stride, accessor.count, dst);
+            break;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+            DecodeIndices<uint16_t>(src, stride, accessor.count, dst);
+            break;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+            DecodeIndices<uint32_t>(src, stride, accessor.count, dst);
+            break;
+        default:
+            values.resize(firstValue);
+            return false;
+    }
+
+    return true;
+}
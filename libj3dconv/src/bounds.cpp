@@ -0,0 +1,116 @@
+#include "bounds.hpp"
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define J3DCONV_BOUNDS_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+    void ExpandBoxScalar(const glm::vec4* points, size_t count, glm::vec3& boxMin, glm::vec3& boxMax, float& maxLengthSquared) {
+        for (size_t i = 0; i < count; i++) {
+            const glm::vec3 p(points[i]);
+
+            boxMin = glm::min(boxMin, p);
+            boxMax = glm::max(boxMax, p);
+            maxLengthSquared = std::max(maxLengthSquared, glm::dot(p, p));
+        }
+    }
+
+    float MaxDistanceSquaredScalar(const glm::vec4* points, size_t count, const glm::vec3& center) {
+        float maxDistanceSquared = 0.0f;
+
+        for (size_t i = 0; i < count; i++) {
+            const glm::vec3 d = glm::vec3(points[i]) - center;
+            maxDistanceSquared = std::max(maxDistanceSquared, glm::dot(d, d));
+        }
+
+        return maxDistanceSquared;
+    }
+
+#ifdef J3DCONV_BOUNDS_SSE2
+    float HorizontalMin(__m128 v) {
+        v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(v);
+    }
+
+    float HorizontalMax(__m128 v) {
+        v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(v);
+    }
+#endif
+}
+
+namespace Bounds {
+    void ExpandBox(const glm::vec4* points, size_t count, glm::vec3& boxMin, glm::vec3& boxMax, float& maxLengthSquared) {
+#ifdef J3DCONV_BOUNDS_SSE2
+        // Four points are transposed into one register per axis, so each lane tracks its own running bounds.
+        // The lanes are only combined once at the end.
+        const float* values = reinterpret_cast<const float*>(points);
+        size_t simdCount = count & ~static_cast<size_t>(3);
+
+        __m128 minX = _mm_set1_ps(boxMin.x), minY = _mm_set1_ps(boxMin.y), minZ = _mm_set1_ps(boxMin.z);
+        __m128 maxX = _mm_set1_ps(boxMax.x), maxY = _mm_set1_ps(boxMax.y), maxZ = _mm_set1_ps(boxMax.z);
+        __m128 maxLength = _mm_set1_ps(maxLengthSquared);
+
+        for (size_t i = 0; i < simdCount; i += 4) {
+            __m128 x = _mm_loadu_ps(values + i * 4);
+            __m128 y = _mm_loadu_ps(values + i * 4 + 4);
+            __m128 z = _mm_loadu_ps(values + i * 4 + 8);
+            __m128 w = _mm_loadu_ps(values + i * 4 + 12);
+            _MM_TRANSPOSE4_PS(x, y, z, w);
+
+            minX = _mm_min_ps(minX, x);
+            minY = _mm_min_ps(minY, y);
+            minZ = _mm_min_ps(minZ, z);
+
+            maxX = _mm_max_ps(maxX, x);
+            maxY = _mm_max_ps(maxY, y);
+            maxZ = _mm_max_ps(maxZ, z);
+
+            __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+            maxLength = _mm_max_ps(maxLength, lengthSquared);
+        }
+
+        boxMin = { HorizontalMin(minX), HorizontalMin(minY), HorizontalMin(minZ) };
+        boxMax = { HorizontalMax(maxX), HorizontalMax(maxY), HorizontalMax(maxZ) };
+        maxLengthSquared = HorizontalMax(maxLength);
+
+        ExpandBoxScalar(points + simdCount, count - simdCount, boxMin, boxMax, maxLengthSquared);
+#else
+        ExpandBoxScalar(points, count, boxMin, boxMax, maxLengthSquared);
+#endif
+    }
+
+    float MaxDistanceSquared(const glm::vec4* points, size_t count, const glm::vec3& center) {
+#ifdef J3DCONV_BOUNDS_SSE2
+        const float* values = reinterpret_cast<const float*>(points);
+        size_t simdCount = count & ~static_cast<size_t>(3);
+
+        const __m128 centerX = _mm_set1_ps(center.x), centerY = _mm_set1_ps(center.y), centerZ = _mm_set1_ps(center.z);
+        __m128 maxDistance = _mm_setzero_ps();
+
+        for (size_t i = 0; i < simdCount; i += 4) {
+            __m128 x = _mm_loadu_ps(values + i * 4);
+            __m128 y = _mm_loadu_ps(values + i * 4 + 4);
+            __m128 z = _mm_loadu_ps(values + i * 4 + 8);
+            __m128 w = _mm_loadu_ps(values + i * 4 + 12);
+            _MM_TRANSPOSE4_PS(x, y, z, w);
+
+            x = _mm_sub_ps(x, centerX);
+            y = _mm_sub_ps(y, centerY);
+            z = _mm_sub_ps(z, centerZ);
+
+            __m128 distanceSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+            maxDistance = _mm_max_ps(maxDistance, distanceSquared);
+        }
+
+        return std::max(HorizontalMax(maxDistance), MaxDistanceSquaredScalar(points + simdCount, count - simdCount, center));
+#else
+        return MaxDistanceSquaredScalar(points, count, center);
+#endif
+    }
+}
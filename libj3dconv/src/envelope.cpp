@@ -1,4 +1,5 @@
 #include "envelope.hpp"
+#include "accessor.hpp"
 #include "shape.hpp"
 #include "util.hpp"
 
@@ -6,6 +7,32 @@
 #include <tiny_gltf.h>
 #include <glm/glm.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <unordered_set>
+
+/* SEnvelopeHash */
+
+size_t SEnvelopeHash::operator()(const SEnvelope& envelope) const {
+    uint64_t hash = envelope.JointIndices.size();
+
+    for (size_t i = 0; i < envelope.JointIndices.size(); i++) {
+        uint32_t weightBits = 0;
+        std::memcpy(&weightBits, &envelope.Weights[i], sizeof(weightBits));
+
+        uint64_t influence = static_cast<uint64_t>(envelope.JointIndices[i]) << 32 | weightBits;
+        hash ^= influence + 0x9E3779B97F4A7C15 + (hash << 6) + (hash >> 2);
+    }
+
+    return static_cast<size_t>(hash);
+}
+
+/* CEnvelopeData */
+
 CEnvelopeData::CEnvelopeData() {
 
 }
@@ -14,102 +41,289 @@ CEnvelopeData::~CEnvelopeData() {
 
 }
 
-void CEnvelopeData::ProcessEnvelopes(const shared_vector<CShape>& shapes) {
-    // Fill unskinned indices first
-    for (auto shape : shapes) {
-        for (std::shared_ptr<SPrimitive> prim : shape->GetPrimitives()) {
-            for (std::shared_ptr<SVertex> v : prim->mVertices) {
-                /*if (v->SkinInfo.JointIndices.size() == 1) {
-                    uint16_t jointIndex = UINT16_MAX;
-
-                    const auto itr = std::find(mUnskinnedIndices.begin(), mUnskinnedIndices.end(), v->SkinInfo.JointIndices[0]);
-                    if (itr == mUnskinnedIndices.end()) {
-                        jointIndex = mUnskinnedIndices.size();
-                        mUnskinnedIndices.push_back(v->SkinInfo.JointIndices[0]);
-                    }
-                    else {
-                        jointIndex = itr - mUnskinnedIndices.begin();
-                    }
+void CEnvelopeData::GetVertexEnvelope(const CVertexPool& pool, uint32_t vertex, uint16_t defaultJoint, SEnvelope& envelope) const {
+    envelope.JointIndices.clear();
+    envelope.Weights.clear();
 
-                    v->PosMatrixIndex = jointIndex;
-                }*/
-            }
+    uint32_t influenceCount = pool.GetInfluenceCount(vertex);
+    if (influenceCount == 0) {
+        envelope.JointIndices.push_back(defaultJoint);
+        envelope.Weights.push_back(1.0f);
+        return;
+    }
+
+    std::array<std::pair<uint16_t, float>, MAX_VERTEX_INFLUENCES> influences;
+    for (uint32_t i = 0; i < influenceCount; i++) {
+        influences[i] = { pool.GetJointIndices(vertex)[i], pool.GetWeights(vertex)[i] };
+    }
+
+    std::sort(influences.begin(), influences.begin() + influenceCount);
+
+    for (uint32_t i = 0; i < influenceCount; i++) {
+        const auto& [joint, weight] = influences[i];
+
+        if (envelope.JointIndices.size() != 0 && envelope.JointIndices.back() == joint) {
+            envelope.Weights.back() += weight;
+            continue;
         }
+
+        envelope.JointIndices.push_back(joint);
+        envelope.Weights.push_back(weight);
     }
+}
 
-    // Fill skinned indices next
-    for (auto shape : shapes) {
-        for (std::shared_ptr<SPrimitive> prim : shape->GetPrimitives()) {
-            for (std::shared_ptr<SVertex> v : prim->mVertices) {
-                /*if (v->SkinInfo.JointIndices.size() != 1) {
-                    SEnvelope env = { v->SkinInfo.JointIndices, v->SkinInfo.Weights };
-                    uint16_t envelopeIndex = UINT16_MAX;
-
-                    const auto envelopeItr = std::find(mEnvelopes.begin(), mEnvelopes.end(), env);
-                    if (envelopeItr == mEnvelopes.end()) {
-                        envelopeIndex = mEnvelopes.size();
-                        mEnvelopes.push_back(env);
-                    }
-                    else {
-                        envelopeIndex = envelopeItr - mEnvelopes.begin();
-                    }
+void CEnvelopeData::PruneEnvelope(const SEnvelope& envelope, SEnvelope& pruned) const {
+    pruned.JointIndices.clear();
+    pruned.Weights.clear();
+
+    // Influences from heaviest to lightest
+    std::array<uint32_t, MAX_VERTEX_INFLUENCES> order;
+    uint32_t influenceCount = static_cast<uint32_t>(std::min<size_t>(envelope.JointIndices.size(), MAX_VERTEX_INFLUENCES));
+
+    std::iota(order.begin(), order.begin() + influenceCount, 0);
+    std::stable_sort(order.begin(), order.begin() + influenceCount, [&](uint32_t a, uint32_t b) {
+        return envelope.Weights[a] > envelope.Weights[b];
+    });
+
+    uint32_t keptCount = 1;
+    uint32_t maxInfluences = std::max<uint32_t>(mSkinWeightSettings.MaxInfluences, 1);
+
+    while (keptCount < influenceCount && keptCount < maxInfluences && envelope.Weights[order[keptCount]] >= mSkinWeightSettings.MinWeight) {
+        keptCount++;
+    }
+
+    float totalWeight = 0.0f;
+    for (uint32_t i = 0; i < keptCount; i++) {
+        totalWeight += envelope.Weights[order[i]];
+    }
+
+    std::array<float, MAX_VERTEX_INFLUENCES> weights;
+    for (uint32_t i = 0; i < keptCount; i++) {
+        weights[i] = totalWeight > 0.0f ? envelope.Weights[order[i]] / totalWeight : 1.0f / keptCount;
+    }
+
+    // Snap to the grid by rounding down, then hand the steps that are left over to the weights that lost the most.
+    // That keeps the total at exactly 1, so the blended matrix isn't scaled.
+    if (mSkinWeightSettings.WeightStep > 0.0f) {
+        uint32_t stepCount = std::max<uint32_t>(static_cast<uint32_t>(std::lround(1.0f / mSkinWeightSettings.WeightStep)), 1);
+
+        std::array<uint32_t, MAX_VERTEX_INFLUENCES> steps;
+        std::array<uint32_t, MAX_VERTEX_INFLUENCES> byRemainder;
+        uint32_t usedSteps = 0;
+
+        for (uint32_t i = 0; i < keptCount; i++) {
+            steps[i] = static_cast<uint32_t>(weights[i] * stepCount);
+            usedSteps += steps[i];
+        }
+
+        std::iota(byRemainder.begin(), byRemainder.begin() + keptCount, 0);
+        std::stable_sort(byRemainder.begin(), byRemainder.begin() + keptCount, [&](uint32_t a, uint32_t b) {
+            return weights[a] * stepCount - steps[a] > weights[b] * stepCount - steps[b];
+        });
+
+        for (uint32_t i = 0; usedSteps < stepCount; i = (i + 1) % keptCount) {
+            steps[byRemainder[i]]++;
+            usedSteps++;
+        }
+
+        for (uint32_t i = 0; i < keptCount; i++) {
+            weights[i] = static_cast<float>(steps[i]) / stepCount;
+        }
+    }
+
+    // Put the survivors back in joint order, so equal envelopes compare equal
+    std::array<std::pair<uint16_t, float>, MAX_VERTEX_INFLUENCES> influences;
+    uint32_t survivorCount = 0;
+
+    for (uint32_t i = 0; i < keptCount; i++) {
+        if (weights[i] > 0.0f) {
+            influences[survivorCount++] = { envelope.JointIndices[order[i]], weights[i] };
+        }
+    }
+
+    // At most MAX_VERTEX_INFLUENCES entries, so a bounded insertion sort is enough
+    for (uint32_t i = 1; i < survivorCount; i++) {
+        for (uint32_t j = i; j > 0 && influences[j] < influences[j - 1]; j--) {
+            std::swap(influences[j], influences[j - 1]);
+        }
+    }
+
+    for (uint32_t i = 0; i < survivorCount; i++) {
+        pruned.JointIndices.push_back(influences[i].first);
+        pruned.Weights.push_back(influences[i].second);
+    }
+}
+
+void CEnvelopeData::PruneSkinWeights(const shared_vector<CShape>& shapes, const CVertexData& vertexData) {
+    if (!mSkinWeightSettings.bEnabled) {
+        return;
+    }
+
+    // Where each joint sits in the bind pose
+    std::vector<glm::vec3> jointPositions;
+    for (const glm::mat4& ibm : mInverseBindMatrices) {
+        jointPositions.push_back(glm::vec3(glm::inverse(ibm)[3]));
+    }
+
+    const SAttributeArray& positions = vertexData.GetAttributeValues(EGXAttribute::Position);
+
+    std::unordered_set<SEnvelope, SEnvelopeHash> envelopesBefore, envelopesAfter;
+    SEnvelope envelope, pruned;
+    float maxError = 0.0f;
+
+    for (const auto& shape : shapes) {
+        CVertexPool& pool = shape->GetVertexPool();
+        uint16_t shapeJoint = static_cast<uint16_t>(shape->GetJointIndex());
+
+        for (uint32_t v = 0; v < pool.GetVertexCount(); v++) {
+            if (pool.GetInfluenceCount(v) == 0) {
+                continue;
+            }
+
+            GetVertexEnvelope(pool, v, shapeJoint, envelope);
+            PruneEnvelope(envelope, pruned);
+
+            if (envelope.JointIndices.size() > 1) {
+                envelopesBefore.insert(envelope);
+            }
+            if (pruned.JointIndices.size() > 1) {
+                envelopesAfter.insert(pruned);
+            }
 
-                    uint16_t indexIndex = UINT16_MAX;
+            // Rotating joint j by a small angle moves the vertex by about that angle times its distance from the joint,
+            // scaled by the joint's weight. Summing how much each joint's weight changed gives the worst case per radian.
+            uint16_t positionIndex = pool.GetIndex(EGXAttribute::Position, v);
+            if (positionIndex != UINT16_MAX && positionIndex < positions.Size()) {
+                const float* p = positions.Get(positionIndex);
+                glm::vec3 position(p[0], p[1], p[2]);
 
-                    const auto indexItr = std::find(mSkinnedIndices.begin(), mSkinnedIndices.end(), envelopeIndex);
-                    if (indexItr == mSkinnedIndices.end()) {
-                        indexIndex = mSkinnedIndices.size();
-                        mSkinnedIndices.push_back(envelopeIndex);
+                float error = 0.0f;
+                size_t a = 0, b = 0;
+
+                while (a < envelope.JointIndices.size() || b < pruned.JointIndices.size()) {
+                    uint16_t joint;
+                    float weightChange;
+
+                    if (b == pruned.JointIndices.size() || (a < envelope.JointIndices.size() && envelope.JointIndices[a] < pruned.JointIndices[b])) {
+                        joint = envelope.JointIndices[a];
+                        weightChange = envelope.Weights[a++];
+                    }
+                    else if (a == envelope.JointIndices.size() || pruned.JointIndices[b] < envelope.JointIndices[a]) {
+                        joint = pruned.JointIndices[b];
+                        weightChange = pruned.Weights[b++];
                     }
                     else {
-                        indexIndex = indexItr - mSkinnedIndices.begin();
+                        joint = envelope.JointIndices[a];
+                        weightChange = envelope.Weights[a++] - pruned.Weights[b++];
                     }
 
-                    v->PosMatrixIndex = mUnskinnedIndices.size() + indexIndex;
-                }*/
+                    glm::vec3 jointPosition = joint < jointPositions.size() ? jointPositions[joint] : glm::vec3(0.0f);
+                    error += std::abs(weightChange) * glm::length(position - jointPosition);
+                }
+
+                maxError = std::max(maxError, error);
+            }
+
+            pool.ClearInfluences(v);
+            for (size_t i = 0; i < pruned.JointIndices.size(); i++) {
+                pool.AddInfluence(v, pruned.JointIndices[i], pruned.Weights[i]);
             }
         }
     }
+
+    std::cout << "Skin weight pruning reduced the envelope count from " << envelopesBefore.size() << " to " << envelopesAfter.size()
+        << ". Largest position error is " << maxError << " units per radian of joint rotation." << std::endl;
 }
 
-void CEnvelopeData::ReadInverseBindMatrices(const tinygltf::Model* model, std::vector<bStream::CMemoryStream>& buffers) {
-    // No skins or envelopes means we don't need to read the IBMs
-    if (model->skins.size() == 0 || mEnvelopes.size() == 0) {
-        return;
+uint16_t CEnvelopeData::AddUnskinnedIndex(uint16_t jointIndex) {
+    const auto [itr, bInserted] = mUnskinnedLookup.try_emplace(jointIndex, static_cast<uint16_t>(mUnskinnedIndices.size()));
+    if (bInserted) {
+        mUnskinnedIndices.push_back(jointIndex);
     }
 
-    tinygltf::Skin skin = model->skins[0];
+    return itr->second;
+}
 
-    const auto& ibmAccessor = model->accessors[skin.inverseBindMatrices];
-    const auto& ibmView = model->bufferViews[ibmAccessor.bufferView];
+uint16_t CEnvelopeData::AddEnvelope(const SEnvelope& envelope) {
+    // Every envelope gets exactly one skinned draw matrix, so the two share an index.
+    const auto [itr, bInserted] = mEnvelopeLookup.try_emplace(envelope, static_cast<uint16_t>(mEnvelopes.size()));
+    if (bInserted) {
+        mSkinnedIndices.push_back(static_cast<uint16_t>(mEnvelopes.size()));
+        mEnvelopes.push_back(envelope);
+    }
 
-    auto& ibmStream = buffers[ibmView.buffer];
-    ibmStream.seek(ibmView.byteOffset);
+    return itr->second;
+}
 
-    for (uint32_t i = 0; i < ibmAccessor.count; i++) {
-        glm::mat4 ibm;
+void CEnvelopeData::ProcessEnvelopes(const shared_vector<CShape>& shapes) {
+    SEnvelope envelope;
 
-        ibm[0][0] = ibmStream.readFloat();
-        ibm[1][0] = ibmStream.readFloat();
-        ibm[2][0] = ibmStream.readFloat();
-        ibm[3][0] = ibmStream.readFloat();
+    // Fill unskinned indices first, since skinned draw matrices come after all of them. Every shape gets its
+    // joint's, which is what it draws with when none of its vertices are skinned.
+    for (auto shape : shapes) {
+        CVertexPool& pool = shape->GetVertexPool();
+        uint16_t shapeJoint = static_cast<uint16_t>(shape->GetJointIndex());
 
-        ibm[0][1] = ibmStream.readFloat();
-        ibm[1][1] = ibmStream.readFloat();
-        ibm[2][1] = ibmStream.readFloat();
-        ibm[3][1] = ibmStream.readFloat();
+        AddUnskinnedIndex(shapeJoint);
 
-        ibm[0][2] = ibmStream.readFloat();
-        ibm[1][2] = ibmStream.readFloat();
-        ibm[2][2] = ibmStream.readFloat();
-        ibm[3][2] = ibmStream.readFloat();
+        for (uint32_t v = 0; v < pool.GetVertexCount(); v++) {
+            GetVertexEnvelope(pool, v, shapeJoint, envelope);
 
-        ibm[0][3] = ibmStream.readFloat();
-        ibm[1][3] = ibmStream.readFloat();
-        ibm[2][3] = ibmStream.readFloat();
-        ibm[3][3] = ibmStream.readFloat();
+            if (envelope.JointIndices.size() == 1) {
+                pool.SetPosMatrixIndex(v, AddUnskinnedIndex(envelope.JointIndices[0]));
+            }
+        }
+    }
+
+    // Fill skinned indices next
+    for (auto shape : shapes) {
+        CVertexPool& pool = shape->GetVertexPool();
+        uint16_t shapeJoint = static_cast<uint16_t>(shape->GetJointIndex());
+
+        for (uint32_t v = 0; v < pool.GetVertexCount(); v++) {
+            GetVertexEnvelope(pool, v, shapeJoint, envelope);
+
+            if (envelope.JointIndices.size() != 1) {
+                pool.SetPosMatrixIndex(v, static_cast<uint16_t>(mUnskinnedIndices.size() + AddEnvelope(envelope)));
+            }
+        }
+
+        // Shapes that only use one draw matrix don't need per-vertex matrix indices.
+        uint16_t drawMatrix = pool.GetVertexCount() != 0 ? pool.GetPosMatrixIndex(0) : mUnskinnedLookup[shapeJoint];
+        bool bSingleMatrix = true;
+
+        for (uint32_t v = 1; v < pool.GetVertexCount() && bSingleMatrix; v++) {
+            bSingleMatrix = pool.GetPosMatrixIndex(v) == drawMatrix;
+        }
+
+        if (bSingleMatrix) {
+            shape->SetDrawMatrixIndex(drawMatrix);
 
-        mInverseBindMatrices.push_back(ibm);
+            for (uint32_t v = 0; v < pool.GetVertexCount(); v++) {
+                pool.SetPosMatrixIndex(v, UINT16_MAX);
+            }
+        }
+    }
+}
+
+void CEnvelopeData::ReadInverseBindMatrices(const tinygltf::Model* model, std::vector<bStream::CMemoryStream>& buffers) {
+    // No skins means we don't need to read the IBMs
+    if (model->skins.size() == 0) {
+        return;
+    }
+
+    const tinygltf::Skin& skin = model->skins[0];
+    mInverseBindMatrices.clear();
+
+    // The matrices are optional, and every joint's is the identity without them
+    if (skin.inverseBindMatrices < 0) {
+        mInverseBindMatrices.assign(skin.joints.size(), glm::identity<glm::mat4>());
+        return;
+    }
+
+    if (!Accessor::ReadMat4(model, buffers, skin.inverseBindMatrices, mInverseBindMatrices)) {
+        std::cout << "Unable to read the skin's inverse bind matrices, identity matrices will be used instead." << std::endl;
+        mInverseBindMatrices.assign(skin.joints.size(), glm::identity<glm::mat4>());
     }
 }
 
@@ -156,8 +370,10 @@ void CEnvelopeData::WriteEVP1(bStream::CStream& stream) {
 
         // Write inverse bind matrices offset
         Util::WriteOffset(&stream, streamStartPos, 0x18);
-        // Write inverse bind matrices
-        for (const glm::mat3x4& m : mInverseBindMatrices) {
+        // Write inverse bind matrices. EVP1 stores the top three rows, so the transpose's first three columns are written.
+        for (const glm::mat4& ibm : mInverseBindMatrices) {
+            glm::mat3x4 m(glm::transpose(ibm));
+
             stream.writeFloat(m[0][0]);
             stream.writeFloat(m[0][1]);
             stream.writeFloat(m[0][2]);
@@ -0,0 +1,1414 @@
+#include "gxtexture.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <queue>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define J3DCONV_GXTEXTURE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Texels with less alpha than this are encoded as transparent in CMPR
+const uint8_t CMPR_ALPHA_THRESHOLD = 128;
+
+// How many times High quality runs least squares and the one-step endpoint search before settling
+const uint32_t CMPR_MAX_REFINE_PASSES = 4;
+
+// How many k-means passes refine a palette after median cut
+const uint32_t PALETTE_REFINE_PASSES = 4;
+
+// Larger palettes keep their median cut boxes as they are, since every k-means pass would search each entry for each color
+const uint32_t PALETTE_MAX_REFINED_ENTRIES = 256;
+
+// How many colors one thread matches against the palette at a time
+const size_t PALETTE_COLORS_PER_JOB = 1024;
+
+// GX samples at most LODs 0 through 10
+const uint32_t MAX_MIP_COUNT = 11;
+
+// Entries in the linear to sRGB table. Fine enough that the steep part of the curve near black still rounds correctly.
+const uint32_t SRGB_TABLE_SIZE = 0x10000;
+
+namespace {
+    // Width and height in texels of one 32-byte tile in the given format. RGBA8 tiles are two 32-byte halves.
+    void GetTileDimensions(EGXTextureFormat format, uint32_t& tileWidth, uint32_t& tileHeight) {
+        switch (format) {
+        case EGXTextureFormat::I4:
+        case EGXTextureFormat::C4:
+        case EGXTextureFormat::CMPR:
+            tileWidth = 8;
+            tileHeight = 8;
+            break;
+        case EGXTextureFormat::I8:
+        case EGXTextureFormat::IA4:
+        case EGXTextureFormat::C8:
+            tileWidth = 8;
+            tileHeight = 4;
+            break;
+        default:
+            tileWidth = 4;
+            tileHeight = 4;
+            break;
+        }
+    }
+
+    /* CMPR */
+
+    // One 4x4 DXT1 block's texels, split into channels so four texels can be compared at once.
+    struct SCMPRBlock {
+        alignas(16) float R[16];
+        alignas(16) float G[16];
+        alignas(16) float B[16];
+
+        // Bit i is set if texel i is transparent
+        uint16_t TransparentMask = 0;
+    };
+
+    void Expand565(uint16_t color, int rgb[3]) {
+        int r = (color >> 11) & 0x1F;
+        int g = (color >> 5) & 0x3F;
+        int b = color & 0x1F;
+
+        rgb[0] = (r << 3) | (r >> 2);
+        rgb[1] = (g << 2) | (g >> 4);
+        rgb[2] = (b << 3) | (b >> 2);
+    }
+
+    uint16_t Quantize565(const float rgb[3]) {
+        int r = static_cast<int>(std::lround(std::clamp(rgb[0], 0.0f, 255.0f) * 31.0f / 255.0f));
+        int g = static_cast<int>(std::lround(std::clamp(rgb[1], 0.0f, 255.0f) * 63.0f / 255.0f));
+        int b = static_cast<int>(std::lround(std::clamp(rgb[2], 0.0f, 255.0f) * 31.0f / 255.0f));
+
+        return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+    }
+
+    // The colors GX decodes a block's palette to. With color0 > color1 the two middle colors are 5:3 and 3:5 blends,
+    // since that's what the hardware does rather than the 2:1 of PC DXT1. Otherwise the third color is the midpoint
+    // and the fourth is transparent.
+    void BuildCMPRPalette(uint16_t color0, uint16_t color1, float palette[4][3]) {
+        int c0[3], c1[3];
+        Expand565(color0, c0);
+        Expand565(color1, c1);
+
+        for (uint32_t i = 0; i < 3; i++) {
+            palette[0][i] = static_cast<float>(c0[i]);
+            palette[1][i] = static_cast<float>(c1[i]);
+
+            if (color0 > color1) {
+                palette[2][i] = static_cast<float>((c0[i] * 5 + c1[i] * 3) >> 3);
+                palette[3][i] = static_cast<float>((c0[i] * 3 + c1[i] * 5) >> 3);
+            }
+            else {
+                palette[2][i] = static_cast<float>((c0[i] + c1[i]) >> 1);
+                palette[3][i] = 0.0f;
+            }
+        }
+    }
+
+    // Picks the closest palette color for every texel and returns the block's total squared error.
+    // Transparent texels always take index 3, which is only transparent in three-color mode.
+    float FitCMPRIndices(const SCMPRBlock& block, uint16_t color0, uint16_t color1, uint8_t indices[16]) {
+        float palette[4][3];
+        BuildCMPRPalette(color0, color1, palette);
+
+        // Opaque texels can't use the transparent entry
+        uint32_t paletteSize = color0 > color1 ? 4 : 3;
+
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        __m128 totalError = _mm_setzero_ps();
+
+        for (uint32_t i = 0; i < 16; i += 4) {
+            __m128 r = _mm_load_ps(block.R + i);
+            __m128 g = _mm_load_ps(block.G + i);
+            __m128 b = _mm_load_ps(block.B + i);
+
+            __m128 bestError = _mm_set1_ps(FLT_MAX);
+            __m128i bestIndex = _mm_setzero_si128();
+
+            for (uint32_t p = 0; p < paletteSize; p++) {
+                __m128 dr = _mm_sub_ps(r, _mm_set1_ps(palette[p][0]));
+                __m128 dg = _mm_sub_ps(g, _mm_set1_ps(palette[p][1]));
+                __m128 db = _mm_sub_ps(b, _mm_set1_ps(palette[p][2]));
+                __m128 error = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+                __m128i closer = _mm_castps_si128(_mm_cmplt_ps(error, bestError));
+                bestError = _mm_min_ps(bestError, error);
+                bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(p)), _mm_andnot_si128(closer, bestIndex));
+            }
+
+            alignas(16) int32_t laneIndices[4];
+            alignas(16) float laneErrors[4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(laneIndices), bestIndex);
+            _mm_store_ps(laneErrors, bestError);
+
+            for (uint32_t lane = 0; lane < 4; lane++) {
+                if (block.TransparentMask & (1 << (i + lane))) {
+                    indices[i + lane] = 3;
+                    laneErrors[lane] = 0.0f;
+                }
+                else {
+                    indices[i + lane] = static_cast<uint8_t>(laneIndices[lane]);
+                }
+            }
+
+            totalError = _mm_add_ps(totalError, _mm_load_ps(laneErrors));
+        }
+
+        alignas(16) float sums[4];
+        _mm_store_ps(sums, totalError);
+        return sums[0] + sums[1] + sums[2] + sums[3];
+#else
+        float totalError = 0.0f;
+
+        for (uint32_t i = 0; i < 16; i++) {
+            if (block.TransparentMask & (1 << i)) {
+                indices[i] = 3;
+                continue;
+            }
+
+            float bestError = FLT_MAX;
+
+            for (uint32_t p = 0; p < paletteSize; p++) {
+                float dr = block.R[i] - palette[p][0];
+                float dg = block.G[i] - palette[p][1];
+                float db = block.B[i] - palette[p][2];
+                float error = dr * dr + dg * dg + db * db;
+
+                if (error < bestError) {
+                    bestError = error;
+                    indices[i] = static_cast<uint8_t>(p);
+                }
+            }
+
+            totalError += bestError;
+        }
+
+        return totalError;
+#endif
+    }
+
+    // The best encoding of a block found so far.
+    struct SCMPRCandidate {
+        uint16_t Color0 = 0;
+        uint16_t Color1 = 0;
+        uint8_t Indices[16] = { };
+        float Error = FLT_MAX;
+    };
+
+    // Orders two endpoints for the wanted palette mode, fits them, and keeps them if they beat the best so far.
+    bool TryCMPREndpoints(const SCMPRBlock& block, uint16_t a, uint16_t b, bool bThreeColor, SCMPRCandidate& best) {
+        uint16_t color0 = bThreeColor ? std::min(a, b) : std::max(a, b);
+        uint16_t color1 = bThreeColor ? std::max(a, b) : std::min(a, b);
+
+        SCMPRCandidate candidate;
+        candidate.Color0 = color0;
+        candidate.Color1 = color1;
+        candidate.Error = FitCMPRIndices(block, color0, color1, candidate.Indices);
+
+        if (candidate.Error < best.Error) {
+            best = candidate;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Solves for the two endpoint colors that best reproduce the block with its current indices.
+    // Returns false if the indices don't pin both endpoints down.
+    bool SolveCMPREndpoints(const SCMPRBlock& block, const SCMPRCandidate& current, float endpoint0[3], float endpoint1[3]) {
+        bool bFourColor = current.Color0 > current.Color1;
+
+        // How much of each endpoint goes into each palette entry
+        const float weights0[4] = { 1.0f, 0.0f, bFourColor ? 5.0f / 8.0f : 0.5f, bFourColor ? 3.0f / 8.0f : 0.0f };
+
+        float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+        float ap[3] = { }, bp[3] = { };
+
+        for (uint32_t i = 0; i < 16; i++) {
+            if (block.TransparentMask & (1 << i)) {
+                continue;
+            }
+
+            float a = weights0[current.Indices[i]];
+            float b = 1.0f - a;
+            const float p[3] = { block.R[i], block.G[i], block.B[i] };
+
+            aa += a * a;
+            ab += a * b;
+            bb += b * b;
+
+            for (uint32_t c = 0; c < 3; c++) {
+                ap[c] += a * p[c];
+                bp[c] += b * p[c];
+            }
+        }
+
+        float determinant = aa * bb - ab * ab;
+        if (std::abs(determinant) < 1e-6f) {
+            return false;
+        }
+
+        for (uint32_t c = 0; c < 3; c++) {
+            endpoint0[c] = (ap[c] * bb - bp[c] * ab) / determinant;
+            endpoint1[c] = (bp[c] * aa - ap[c] * ab) / determinant;
+        }
+
+        return true;
+    }
+
+    void EncodeCMPRBlock(const SCMPRBlock& block, ECMPRQuality quality, uint8_t* dst) {
+        SCMPRCandidate best;
+
+        // Mean and bounds of the opaque texels
+        float mean[3] = { }, minColor[3] = { 255.0f, 255.0f, 255.0f }, maxColor[3] = { };
+        uint32_t opaqueCount = 0;
+
+        for (uint32_t i = 0; i < 16; i++) {
+            if (block.TransparentMask & (1 << i)) {
+                continue;
+            }
+
+            const float p[3] = { block.R[i], block.G[i], block.B[i] };
+            for (uint32_t c = 0; c < 3; c++) {
+                mean[c] += p[c];
+                minColor[c] = std::min(minColor[c], p[c]);
+                maxColor[c] = std::max(maxColor[c], p[c]);
+            }
+
+            opaqueCount++;
+        }
+
+        bool bThreeColor = block.TransparentMask != 0;
+
+        if (opaqueCount == 0) {
+            TryCMPREndpoints(block, 0, 0, true, best);
+        }
+        else {
+            for (uint32_t c = 0; c < 3; c++) {
+                mean[c] /= opaqueCount;
+            }
+
+            float covariance[6] = { }; // rr, rg, rb, gg, gb, bb
+            for (uint32_t i = 0; i < 16; i++) {
+                if (block.TransparentMask & (1 << i)) {
+                    continue;
+                }
+
+                float d[3] = { block.R[i] - mean[0], block.G[i] - mean[1], block.B[i] - mean[2] };
+                covariance[0] += d[0] * d[0];
+                covariance[1] += d[0] * d[1];
+                covariance[2] += d[0] * d[2];
+                covariance[3] += d[1] * d[1];
+                covariance[4] += d[1] * d[2];
+                covariance[5] += d[2] * d[2];
+            }
+
+            float endpoint0[3], endpoint1[3];
+
+            if (quality == ECMPRQuality::Fast) {
+                // Take the box diagonal that runs the same way as the colors, relative to the channel that varies most
+                uint32_t mainChannel = covariance[0] >= covariance[3] && covariance[0] >= covariance[5] ? 0 : (covariance[3] >= covariance[5] ? 1 : 2);
+                const uint32_t covarianceIndex[3][3] = { { 0, 1, 2 }, { 1, 3, 4 }, { 2, 4, 5 } };
+
+                for (uint32_t c = 0; c < 3; c++) {
+                    // Pull the corners in a little, since the extremes are rarely worth a palette entry each
+                    float inset = (maxColor[c] - minColor[c]) / 16.0f;
+                    bool bFlip = covariance[covarianceIndex[mainChannel][c]] < 0.0f;
+
+                    endpoint0[c] = (bFlip ? minColor[c] + inset : maxColor[c] - inset);
+                    endpoint1[c] = (bFlip ? maxColor[c] - inset : minColor[c] + inset);
+                }
+            }
+            else {
+                // Principal axis by power iteration, starting from the box diagonal
+                float axis[3] = { maxColor[0] - minColor[0], maxColor[1] - minColor[1], maxColor[2] - minColor[2] };
+
+                for (uint32_t iteration = 0; iteration < 8; iteration++) {
+                    float next[3] = {
+                        covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+                        covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+                        covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+                    };
+
+                    float length = std::max({ std::abs(next[0]), std::abs(next[1]), std::abs(next[2]) });
+                    if (length < 1e-6f) {
+                        break;
+                    }
+
+                    for (uint32_t c = 0; c < 3; c++) {
+                        axis[c] = next[c] / length;
+                    }
+                }
+
+                float minT = FLT_MAX, maxT = -FLT_MAX;
+                for (uint32_t i = 0; i < 16; i++) {
+                    if (block.TransparentMask & (1 << i)) {
+                        continue;
+                    }
+
+                    float t = (block.R[i] - mean[0]) * axis[0] + (block.G[i] - mean[1]) * axis[1] + (block.B[i] - mean[2]) * axis[2];
+                    minT = std::min(minT, t);
+                    maxT = std::max(maxT, t);
+                }
+
+                float axisLengthSquared = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+                if (axisLengthSquared < 1e-12f) {
+                    axisLengthSquared = 1.0f;
+                    minT = maxT = 0.0f;
+                }
+
+                for (uint32_t c = 0; c < 3; c++) {
+                    endpoint0[c] = mean[c] + axis[c] * maxT / axisLengthSquared;
+                    endpoint1[c] = mean[c] + axis[c] * minT / axisLengthSquared;
+                }
+            }
+
+            uint16_t color0 = Quantize565(endpoint0), color1 = Quantize565(endpoint1);
+            TryCMPREndpoints(block, color0, color1, bThreeColor, best);
+
+            // Opaque blocks can also use three-color mode, which sometimes fits better with its midpoint
+            if (quality == ECMPRQuality::High && !bThreeColor) {
+                TryCMPREndpoints(block, color0, color1, true, best);
+            }
+
+            uint32_t refinePasses = quality == ECMPRQuality::Fast ? 0 : (quality == ECMPRQuality::Normal ? 1 : CMPR_MAX_REFINE_PASSES);
+
+            for (uint32_t pass = 0; pass < refinePasses; pass++) {
+                bool bImproved = false;
+                bool bBestThreeColor = best.Color0 <= best.Color1;
+
+                if (SolveCMPREndpoints(block, best, endpoint0, endpoint1)) {
+                    bImproved |= TryCMPREndpoints(block, Quantize565(endpoint0), Quantize565(endpoint1), bBestThreeColor, best);
+                }
+
+                // Nudge each channel of each endpoint by one step and keep whatever helps
+                if (quality == ECMPRQuality::High) {
+                    const uint16_t channelSteps[3] = { 1 << 11, 1 << 5, 1 };
+                    const uint16_t channelMasks[3] = { 0x1F << 11, 0x3F << 5, 0x1F };
+
+                    for (uint32_t endpoint = 0; endpoint < 2; endpoint++) {
+                        for (uint32_t c = 0; c < 3; c++) {
+                            uint16_t current[2] = { best.Color0, best.Color1 };
+                            uint16_t channel = current[endpoint] & channelMasks[c];
+
+                            if (channel != channelMasks[c]) {
+                                uint16_t nudged[2] = { current[0], current[1] };
+                                nudged[endpoint] += channelSteps[c];
+                                bImproved |= TryCMPREndpoints(block, nudged[0], nudged[1], bBestThreeColor, best);
+                            }
+
+                            if (channel != 0) {
+                                uint16_t nudged[2] = { current[0], current[1] };
+                                nudged[endpoint] -= channelSteps[c];
+                                bImproved |= TryCMPREndpoints(block, nudged[0], nudged[1], bBestThreeColor, best);
+                            }
+                        }
+                    }
+                }
+
+                if (!bImproved) {
+                    break;
+                }
+            }
+        }
+
+        // Four-color mode with equal endpoints decodes as three-color, where index 3 is transparent
+        if (best.Color0 == best.Color1 && block.TransparentMask == 0) {
+            std::fill(std::begin(best.Indices), std::end(best.Indices), 0);
+        }
+
+        dst[0] = static_cast<uint8_t>(best.Color0 >> 8);
+        dst[1] = static_cast<uint8_t>(best.Color0);
+        dst[2] = static_cast<uint8_t>(best.Color1 >> 8);
+        dst[3] = static_cast<uint8_t>(best.Color1);
+
+        // The leftmost texel of each row is in the top two bits
+        for (uint32_t y = 0; y < 4; y++) {
+            const uint8_t* row = best.Indices + y * 4;
+            dst[4 + y] = static_cast<uint8_t>((row[0] << 6) | (row[1] << 4) | (row[2] << 2) | row[3]);
+        }
+    }
+
+    // Reads the 4x4 block at (blockX, blockY), repeating the last row and column for blocks that hang off the edge.
+    void ReadCMPRBlock(const uint8_t* rgba, uint32_t width, uint32_t height, uint32_t blockX, uint32_t blockY, SCMPRBlock& block) {
+        block.TransparentMask = 0;
+
+        for (uint32_t y = 0; y < 4; y++) {
+            uint32_t sourceY = std::min(blockY + y, height - 1);
+
+            for (uint32_t x = 0; x < 4; x++) {
+                uint32_t sourceX = std::min(blockX + x, width - 1);
+                const uint8_t* texel = rgba + (static_cast<size_t>(sourceY) * width + sourceX) * 4;
+                uint32_t i = y * 4 + x;
+
+                block.R[i] = texel[0];
+                block.G[i] = texel[1];
+                block.B[i] = texel[2];
+
+                if (texel[3] < CMPR_ALPHA_THRESHOLD) {
+                    block.TransparentMask |= 1 << i;
+                }
+            }
+        }
+    }
+
+    /* Direct formats */
+
+    // Rounds a channel value in [0, 255] to the nearest step in [0, maxValue].
+    uint32_t QuantizeChannel(uint32_t value, uint32_t maxValue) {
+        uint32_t x = value * maxValue + 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+    // Rec. 601 luma, as the intensity formats store it.
+    uint32_t GetIntensity(const uint8_t* texel) {
+        return (77 * texel[0] + 150 * texel[1] + 29 * texel[2] + 128) >> 8;
+    }
+
+    void WriteBigEndian16(uint8_t* dst, uint32_t value) {
+        dst[0] = static_cast<uint8_t>(value >> 8);
+        dst[1] = static_cast<uint8_t>(value);
+    }
+
+    uint32_t GetRGB565(const uint8_t* texel) {
+        return (QuantizeChannel(texel[0], 31) << 11) | (QuantizeChannel(texel[1], 63) << 5) | QuantizeChannel(texel[2], 31);
+    }
+
+    uint32_t GetRGB5A3(const uint8_t* texel) {
+        uint32_t alpha = QuantizeChannel(texel[3], 7);
+
+        // Texels that would quantize to full alpha get the extra color precision instead
+        if (alpha == 7) {
+            return 0x8000 | (QuantizeChannel(texel[0], 31) << 10) | (QuantizeChannel(texel[1], 31) << 5) | QuantizeChannel(texel[2], 31);
+        }
+
+        return (alpha << 12) | (QuantizeChannel(texel[0], 15) << 8) | (QuantizeChannel(texel[1], 15) << 4) | QuantizeChannel(texel[2], 15);
+    }
+
+#ifdef J3DCONV_GXTEXTURE_SSE2
+    // Each helper below works on four texels with one 32-bit lane per texel.
+
+    __m128i LoadTexels(const uint8_t* texels) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(texels));
+    }
+
+    void SplitChannels(__m128i texels, __m128i& r, __m128i& g, __m128i& b, __m128i& a) {
+        const __m128i byteMask = _mm_set1_epi32(0xFF);
+
+        r = _mm_and_si128(texels, byteMask);
+        g = _mm_and_si128(_mm_srli_epi32(texels, 8), byteMask);
+        b = _mm_and_si128(_mm_srli_epi32(texels, 16), byteMask);
+        a = _mm_srli_epi32(texels, 24);
+    }
+
+    // QuantizeChannel for each lane. The products fit in 16 bits, so a 16-bit multiply is exact and leaves each
+    // lane's upper half zero.
+    __m128i QuantizeChannels(__m128i values, uint32_t maxValue) {
+        __m128i x = _mm_add_epi32(_mm_mullo_epi16(values, _mm_set1_epi32(maxValue)), _mm_set1_epi32(128));
+        return _mm_srli_epi32(_mm_add_epi32(x, _mm_srli_epi32(x, 8)), 8);
+    }
+
+    __m128i GetIntensities(__m128i r, __m128i g, __m128i b) {
+        __m128i rg = _mm_add_epi32(_mm_mullo_epi16(r, _mm_set1_epi32(77)), _mm_mullo_epi16(g, _mm_set1_epi32(150)));
+        __m128i b128 = _mm_add_epi32(_mm_mullo_epi16(b, _mm_set1_epi32(29)), _mm_set1_epi32(128));
+        return _mm_srli_epi32(_mm_add_epi32(rg, b128), 8);
+    }
+
+    __m128i SwapBytes16(__m128i values) {
+        return _mm_or_si128(_mm_srli_epi32(values, 8), _mm_slli_epi32(_mm_and_si128(values, _mm_set1_epi32(0xFF)), 8));
+    }
+
+    // Packs the 16-bit values in two sets of lanes into eight 16-bit lanes. Sign extending first keeps the saturating
+    // pack from clamping values above 0x7FFF.
+    __m128i PackWords(__m128i low, __m128i high) {
+        low = _mm_srai_epi32(_mm_slli_epi32(low, 16), 16);
+        high = _mm_srai_epi32(_mm_slli_epi32(high, 16), 16);
+        return _mm_packs_epi32(low, high);
+    }
+
+    // Packs the byte values in two sets of lanes into the low eight bytes.
+    __m128i PackBytes(__m128i low, __m128i high) {
+        __m128i words = _mm_packs_epi32(low, high);
+        return _mm_packus_epi16(words, words);
+    }
+#endif
+
+    // Each row encoder takes one tile row of RGBA8 texels and writes that row's bytes of the tile to dst.
+
+    // 8 texels to 4 bytes, two 4-bit intensities per byte with the left texel in the high nibble
+    void EncodeI4Row(const uint8_t* texels, uint8_t* dst) {
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        __m128i r, g, b, a;
+        SplitChannels(LoadTexels(texels), r, g, b, a);
+        __m128i left = QuantizeChannels(GetIntensities(r, g, b), 15);
+        SplitChannels(LoadTexels(texels + 16), r, g, b, a);
+        __m128i right = QuantizeChannels(GetIntensities(r, g, b), 15);
+
+        // Each 32-bit lane now holds one pair of neighboring texels
+        __m128i pairs = _mm_packs_epi32(left, right);
+        __m128i bytes = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(pairs, _mm_set1_epi32(0xFFFF)), 4), _mm_srli_epi32(pairs, 16));
+
+        int32_t packed = _mm_cvtsi128_si32(PackBytes(bytes, bytes));
+        std::memcpy(dst, &packed, 4);
+#else
+        for (uint32_t i = 0; i < 4; i++) {
+            uint32_t left = QuantizeChannel(GetIntensity(texels + i * 8), 15);
+            uint32_t right = QuantizeChannel(GetIntensity(texels + i * 8 + 4), 15);
+            dst[i] = static_cast<uint8_t>((left << 4) | right);
+        }
+#endif
+    }
+
+    // 8 texels to 8 bytes of intensity
+    void EncodeI8Row(const uint8_t* texels, uint8_t* dst) {
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        __m128i r, g, b, a;
+        SplitChannels(LoadTexels(texels), r, g, b, a);
+        __m128i left = GetIntensities(r, g, b);
+        SplitChannels(LoadTexels(texels + 16), r, g, b, a);
+        __m128i right = GetIntensities(r, g, b);
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), PackBytes(left, right));
+#else
+        for (uint32_t i = 0; i < 8; i++) {
+            dst[i] = static_cast<uint8_t>(GetIntensity(texels + i * 4));
+        }
+#endif
+    }
+
+    // 8 texels to 8 bytes, 4-bit alpha in the high nibble and 4-bit intensity in the low
+    void EncodeIA4Row(const uint8_t* texels, uint8_t* dst) {
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        __m128i halves[2];
+
+        for (uint32_t i = 0; i < 2; i++) {
+            __m128i r, g, b, a;
+            SplitChannels(LoadTexels(texels + i * 16), r, g, b, a);
+            halves[i] = _mm_or_si128(_mm_slli_epi32(QuantizeChannels(a, 15), 4), QuantizeChannels(GetIntensities(r, g, b), 15));
+        }
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), PackBytes(halves[0], halves[1]));
+#else
+        for (uint32_t i = 0; i < 8; i++) {
+            const uint8_t* texel = texels + i * 4;
+            dst[i] = static_cast<uint8_t>((QuantizeChannel(texel[3], 15) << 4) | QuantizeChannel(GetIntensity(texel), 15));
+        }
+#endif
+    }
+
+    // 4 texels to 8 bytes, alpha then intensity
+    void EncodeIA8Row(const uint8_t* texels, uint8_t* dst) {
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        __m128i r, g, b, a;
+        SplitChannels(LoadTexels(texels), r, g, b, a);
+        __m128i words = _mm_or_si128(a, _mm_slli_epi32(GetIntensities(r, g, b), 8));
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), PackWords(words, words));
+#else
+        for (uint32_t i = 0; i < 4; i++) {
+            const uint8_t* texel = texels + i * 4;
+            dst[i * 2] = texel[3];
+            dst[i * 2 + 1] = static_cast<uint8_t>(GetIntensity(texel));
+        }
+#endif
+    }
+
+    // 4 texels to 4 big-endian RGB565 values
+    void EncodeRGB565Row(const uint8_t* texels, uint8_t* dst) {
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        __m128i r, g, b, a;
+        SplitChannels(LoadTexels(texels), r, g, b, a);
+        __m128i colors = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(QuantizeChannels(r, 31), 11), _mm_slli_epi32(QuantizeChannels(g, 63), 5)),
+            QuantizeChannels(b, 31));
+        colors = SwapBytes16(colors);
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), PackWords(colors, colors));
+#else
+        for (uint32_t i = 0; i < 4; i++) {
+            WriteBigEndian16(dst + i * 2, GetRGB565(texels + i * 4));
+        }
+#endif
+    }
+
+    // 4 texels to 4 big-endian RGB5A3 values
+    void EncodeRGB5A3Row(const uint8_t* texels, uint8_t* dst) {
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        __m128i r, g, b, a;
+        SplitChannels(LoadTexels(texels), r, g, b, a);
+
+        // Both encodings are built for every texel, then each lane keeps the one its alpha calls for
+        __m128i alpha = QuantizeChannels(a, 7);
+        __m128i opaqueMask = _mm_cmpeq_epi32(alpha, _mm_set1_epi32(7));
+
+        __m128i opaque = _mm_or_si128(_mm_or_si128(_mm_set1_epi32(0x8000), _mm_slli_epi32(QuantizeChannels(r, 31), 10)),
+            _mm_or_si128(_mm_slli_epi32(QuantizeChannels(g, 31), 5), QuantizeChannels(b, 31)));
+        __m128i translucent = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(alpha, 12), _mm_slli_epi32(QuantizeChannels(r, 15), 8)),
+            _mm_or_si128(_mm_slli_epi32(QuantizeChannels(g, 15), 4), QuantizeChannels(b, 15)));
+
+        __m128i colors = _mm_or_si128(_mm_and_si128(opaqueMask, opaque), _mm_andnot_si128(opaqueMask, translucent));
+        colors = SwapBytes16(colors);
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), PackWords(colors, colors));
+#else
+        for (uint32_t i = 0; i < 4; i++) {
+            WriteBigEndian16(dst + i * 2, GetRGB5A3(texels + i * 4));
+        }
+#endif
+    }
+
+    // 4 texels to 8 bytes of alpha and red pairs, and 8 bytes of green and blue pairs in the tile's second half
+    void EncodeRGBA8Row(const uint8_t* texels, uint8_t* dst) {
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        __m128i r, g, b, a;
+        SplitChannels(LoadTexels(texels), r, g, b, a);
+        __m128i planes = PackWords(_mm_or_si128(a, _mm_slli_epi32(r, 8)), _mm_or_si128(g, _mm_slli_epi32(b, 8)));
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), planes);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 32), _mm_unpackhi_epi64(planes, planes));
+#else
+        for (uint32_t i = 0; i < 4; i++) {
+            const uint8_t* texel = texels + i * 4;
+            dst[i * 2] = texel[3];
+            dst[i * 2 + 1] = texel[0];
+            dst[32 + i * 2] = texel[1];
+            dst[32 + i * 2 + 1] = texel[2];
+        }
+#endif
+    }
+
+    /* Palettes */
+
+    // A texel's color encoded in the palette format. Texels with the same key would share a TLUT entry anyway, so
+    // quantization only has to deal with distinct keys rather than every texel.
+    uint16_t GetPaletteKey(EPaletteFormat paletteFormat, const uint8_t* texel) {
+        switch (paletteFormat) {
+        case EPaletteFormat::IA8:
+            return static_cast<uint16_t>((texel[3] << 8) | GetIntensity(texel));
+        case EPaletteFormat::RGB565:
+            return static_cast<uint16_t>(GetRGB565(texel));
+        default:
+            return static_cast<uint16_t>(GetRGB5A3(texel));
+        }
+    }
+
+    // The color GX decodes a key to, with each channel in [0, 255].
+    void DecodePaletteKey(EPaletteFormat paletteFormat, uint16_t key, float rgba[4]) {
+        switch (paletteFormat) {
+        case EPaletteFormat::IA8:
+            rgba[0] = rgba[1] = rgba[2] = static_cast<float>(key & 0xFF);
+            rgba[3] = static_cast<float>(key >> 8);
+            break;
+        case EPaletteFormat::RGB565: {
+            int rgb[3];
+            Expand565(key, rgb);
+
+            rgba[0] = static_cast<float>(rgb[0]);
+            rgba[1] = static_cast<float>(rgb[1]);
+            rgba[2] = static_cast<float>(rgb[2]);
+            rgba[3] = 255.0f;
+            break;
+        }
+        default:
+            if (key & 0x8000) {
+                for (uint32_t c = 0; c < 3; c++) {
+                    uint32_t value = (key >> (10 - c * 5)) & 0x1F;
+                    rgba[c] = static_cast<float>((value << 3) | (value >> 2));
+                }
+
+                rgba[3] = 255.0f;
+            }
+            else {
+                for (uint32_t c = 0; c < 3; c++) {
+                    rgba[c] = static_cast<float>(((key >> (8 - c * 4)) & 0xF) * 17);
+                }
+
+                uint32_t alpha = (key >> 12) & 0x7;
+                rgba[3] = static_cast<float>((alpha << 5) | (alpha << 2) | (alpha >> 1));
+            }
+            break;
+        }
+    }
+
+    // Counts how many texels have each key. Each thread counts its own stripe of the image, and the stripes are summed after.
+    std::vector<uint32_t> CountPaletteKeys(EPaletteFormat paletteFormat, const uint8_t* rgba, size_t texelCount) {
+        size_t stripeCount = std::clamp<size_t>(texelCount / 0x10000, 1, Util::GetThreadCount());
+        std::vector<std::vector<uint32_t>> stripeCounts(stripeCount, std::vector<uint32_t>(0x10000, 0));
+
+        Util::ParallelFor(stripeCount, [&](size_t stripe) {
+            std::vector<uint32_t>& counts = stripeCounts[stripe];
+            size_t end = texelCount * (stripe + 1) / stripeCount;
+
+            for (size_t i = texelCount * stripe / stripeCount; i < end; i++) {
+                counts[GetPaletteKey(paletteFormat, rgba + i * 4)]++;
+            }
+        });
+
+        for (size_t stripe = 1; stripe < stripeCount; stripe++) {
+            for (size_t key = 0; key < 0x10000; key++) {
+                stripeCounts[0][key] += stripeCounts[stripe][key];
+            }
+        }
+
+        return std::move(stripeCounts[0]);
+    }
+
+    // One distinct key in the image, weighted by how many texels have it.
+    struct SPaletteColor {
+        float RGBA[4];
+        float Weight;
+
+        uint16_t Key;
+    };
+
+    // A run of colors that median cut may split in two.
+    struct SPaletteBox {
+        size_t Begin;
+        size_t End;
+
+        // Weighted squared distance of the box's colors from their mean
+        double Error;
+        // The channel the colors spread out along the most
+        uint32_t Axis;
+
+        bool operator<(const SPaletteBox& other) const { return Error < other.Error; }
+    };
+
+    SPaletteBox MeasurePaletteBox(const std::vector<SPaletteColor>& colors, size_t begin, size_t end) {
+        double weight = 0.0;
+        double sum[4] = { };
+        double sumSquared[4] = { };
+
+        for (size_t i = begin; i < end; i++) {
+            const SPaletteColor& color = colors[i];
+            weight += color.Weight;
+
+            for (uint32_t c = 0; c < 4; c++) {
+                sum[c] += color.RGBA[c] * color.Weight;
+                sumSquared[c] += color.RGBA[c] * color.RGBA[c] * color.Weight;
+            }
+        }
+
+        SPaletteBox box = { begin, end, 0.0, 0 };
+        double largestSpread = -1.0;
+
+        for (uint32_t c = 0; c < 4; c++) {
+            double spread = std::max(sumSquared[c] - sum[c] * sum[c] / weight, 0.0);
+            box.Error += spread;
+
+            if (spread > largestSpread) {
+                largestSpread = spread;
+                box.Axis = c;
+            }
+        }
+
+        return box;
+    }
+
+    // Median cut. The box with the most error is split at the weighted median of its widest channel until there are
+    // maxBoxes boxes, or until no box has more than one color.
+    std::vector<SPaletteBox> CutPaletteBoxes(std::vector<SPaletteColor>& colors, uint32_t maxBoxes) {
+        std::priority_queue<SPaletteBox> openBoxes;
+        std::vector<SPaletteBox> boxes;
+
+        openBoxes.push(MeasurePaletteBox(colors, 0, colors.size()));
+
+        while (!openBoxes.empty() && openBoxes.size() + boxes.size() < maxBoxes) {
+            SPaletteBox box = openBoxes.top();
+            openBoxes.pop();
+
+            if (box.End - box.Begin < 2 || box.Error <= 0.0) {
+                boxes.push_back(box);
+                continue;
+            }
+
+            std::sort(colors.begin() + box.Begin, colors.begin() + box.End, [&](const SPaletteColor& a, const SPaletteColor& b) {
+                return a.RGBA[box.Axis] < b.RGBA[box.Axis];
+            });
+
+            double halfWeight = 0.0;
+            for (size_t i = box.Begin; i < box.End; i++) {
+                halfWeight += colors[i].Weight * 0.5;
+            }
+
+            // Both halves keep at least one color
+            size_t split = box.Begin + 1;
+            for (double weight = colors[box.Begin].Weight; split < box.End - 1 && weight < halfWeight; split++) {
+                weight += colors[split].Weight;
+            }
+
+            openBoxes.push(MeasurePaletteBox(colors, box.Begin, split));
+            openBoxes.push(MeasurePaletteBox(colors, split, box.End));
+        }
+
+        for (; !openBoxes.empty(); openBoxes.pop()) {
+            boxes.push_back(openBoxes.top());
+        }
+
+        return boxes;
+    }
+
+    // Palette entries split into channels so four can be compared at once. The end is padded out to a multiple of
+    // four with entries too far away to ever be the nearest.
+    struct SPaletteSearch {
+        std::vector<float> R;
+        std::vector<float> G;
+        std::vector<float> B;
+        std::vector<float> A;
+
+        void SetEntries(const std::vector<std::array<float, 4>>& entries) {
+            size_t paddedCount = (entries.size() + 3) & ~static_cast<size_t>(3);
+
+            for (std::vector<float>* channel : { &R, &G, &B, &A }) {
+                channel->assign(paddedCount, FLT_MAX);
+            }
+
+            for (size_t i = 0; i < entries.size(); i++) {
+                R[i] = entries[i][0];
+                G[i] = entries[i][1];
+                B[i] = entries[i][2];
+                A[i] = entries[i][3];
+            }
+        }
+
+        // The entry closest to the color, taking the lowest index when several are equally close
+        uint32_t FindNearest(const float rgba[4]) const {
+#ifdef J3DCONV_GXTEXTURE_SSE2
+            const __m128 r = _mm_set1_ps(rgba[0]), g = _mm_set1_ps(rgba[1]), b = _mm_set1_ps(rgba[2]), a = _mm_set1_ps(rgba[3]);
+
+            // Each lane tracks the nearest of the entries that land in it
+            __m128 bestDistance = _mm_set1_ps(FLT_MAX);
+            __m128i bestIndex = _mm_setzero_si128();
+            __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+
+            for (size_t i = 0; i < R.size(); i += 4) {
+                __m128 dr = _mm_sub_ps(_mm_loadu_ps(&R[i]), r);
+                __m128 dg = _mm_sub_ps(_mm_loadu_ps(&G[i]), g);
+                __m128 db = _mm_sub_ps(_mm_loadu_ps(&B[i]), b);
+                __m128 da = _mm_sub_ps(_mm_loadu_ps(&A[i]), a);
+
+                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db)), _mm_mul_ps(da, da));
+                __m128i closer = _mm_castps_si128(_mm_cmplt_ps(distance, bestDistance));
+
+                bestDistance = _mm_min_ps(distance, bestDistance);
+                bestIndex = _mm_or_si128(_mm_and_si128(closer, index), _mm_andnot_si128(closer, bestIndex));
+                index = _mm_add_epi32(index, _mm_set1_epi32(4));
+            }
+
+            alignas(16) float distances[4];
+            alignas(16) uint32_t indices[4];
+            _mm_store_ps(distances, bestDistance);
+            _mm_store_si128(reinterpret_cast<__m128i*>(indices), bestIndex);
+
+            uint32_t nearest = indices[0];
+            float nearestDistance = distances[0];
+
+            for (uint32_t lane = 1; lane < 4; lane++) {
+                if (distances[lane] < nearestDistance || (distances[lane] == nearestDistance && indices[lane] < nearest)) {
+                    nearest = indices[lane];
+                    nearestDistance = distances[lane];
+                }
+            }
+
+            return nearest;
+#else
+            uint32_t nearest = 0;
+            float nearestDistance = FLT_MAX;
+
+            for (size_t i = 0; i < R.size(); i++) {
+                float dr = R[i] - rgba[0], dg = G[i] - rgba[1], db = B[i] - rgba[2], da = A[i] - rgba[3];
+                float distance = dr * dr + dg * dg + db * db + da * da;
+
+                if (distance < nearestDistance) {
+                    nearest = static_cast<uint32_t>(i);
+                    nearestDistance = distance;
+                }
+            }
+
+            return nearest;
+#endif
+        }
+    };
+
+    // Matches every color to its nearest entry, spread across threads. Returns whether any color changed entries.
+    bool AssignPaletteEntries(const std::vector<SPaletteColor>& colors, const std::vector<std::array<float, 4>>& entries,
+        std::vector<uint32_t>& assignments)
+    {
+        SPaletteSearch search;
+        search.SetEntries(entries);
+
+        size_t jobCount = (colors.size() + PALETTE_COLORS_PER_JOB - 1) / PALETTE_COLORS_PER_JOB;
+        std::vector<uint8_t> jobChanged(jobCount, 0);
+
+        Util::ParallelFor(jobCount, [&](size_t job) {
+            size_t end = std::min(colors.size(), (job + 1) * PALETTE_COLORS_PER_JOB);
+
+            for (size_t i = job * PALETTE_COLORS_PER_JOB; i < end; i++) {
+                uint32_t nearest = search.FindNearest(colors[i].RGBA);
+
+                if (nearest != assignments[i]) {
+                    assignments[i] = nearest;
+                    jobChanged[job] = 1;
+                }
+            }
+        });
+
+        return std::find(jobChanged.begin(), jobChanged.end(), 1) != jobChanged.end();
+    }
+
+    // Moves each entry to the weighted mean of the colors assigned to it. Entries with no colors stay where they are.
+    void CenterPaletteEntries(const std::vector<SPaletteColor>& colors, const std::vector<uint32_t>& assignments,
+        std::vector<std::array<float, 4>>& entries)
+    {
+        std::vector<std::array<double, 5>> sums(entries.size(), { 0.0, 0.0, 0.0, 0.0, 0.0 });
+
+        for (size_t i = 0; i < colors.size(); i++) {
+            std::array<double, 5>& sum = sums[assignments[i]];
+
+            for (uint32_t c = 0; c < 4; c++) {
+                sum[c] += colors[i].RGBA[c] * colors[i].Weight;
+            }
+
+            sum[4] += colors[i].Weight;
+        }
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (sums[i][4] <= 0.0) {
+                continue;
+            }
+
+            for (uint32_t c = 0; c < 4; c++) {
+                entries[i][c] = static_cast<float>(sums[i][c] / sums[i][4]);
+            }
+        }
+    }
+
+    // Picks at most maxEntries keys for the palette, and which of them each color's key maps to.
+    void BuildPalette(EPaletteFormat paletteFormat, std::vector<SPaletteColor>& colors, uint32_t maxEntries,
+        std::vector<uint16_t>& paletteKeys, std::vector<uint16_t>& keyIndices)
+    {
+        paletteKeys.clear();
+
+        // Images that already fit keep every color exactly
+        if (colors.size() <= maxEntries) {
+            for (size_t i = 0; i < colors.size(); i++) {
+                keyIndices[colors[i].Key] = static_cast<uint16_t>(i);
+                paletteKeys.push_back(colors[i].Key);
+            }
+
+            return;
+        }
+
+        std::vector<SPaletteBox> boxes = CutPaletteBoxes(colors, maxEntries);
+        std::vector<std::array<float, 4>> entries(boxes.size());
+        std::vector<uint32_t> assignments(colors.size());
+
+        for (size_t b = 0; b < boxes.size(); b++) {
+            for (size_t i = boxes[b].Begin; i < boxes[b].End; i++) {
+                assignments[i] = static_cast<uint32_t>(b);
+            }
+        }
+
+        CenterPaletteEntries(colors, assignments, entries);
+
+        bool bRefine = entries.size() <= PALETTE_MAX_REFINED_ENTRIES;
+        for (uint32_t pass = 0; bRefine && pass < PALETTE_REFINE_PASSES; pass++) {
+            if (!AssignPaletteEntries(colors, entries, assignments)) {
+                break;
+            }
+
+            CenterPaletteEntries(colors, assignments, entries);
+        }
+
+        // Round the entries to what the TLUT can hold, then match colors against those rather than the exact means
+        for (std::array<float, 4>& entry : entries) {
+            uint8_t texel[4];
+            for (uint32_t c = 0; c < 4; c++) {
+                texel[c] = static_cast<uint8_t>(std::lround(std::clamp(entry[c], 0.0f, 255.0f)));
+            }
+
+            paletteKeys.push_back(GetPaletteKey(paletteFormat, texel));
+            DecodePaletteKey(paletteFormat, paletteKeys.back(), entry.data());
+        }
+
+        if (bRefine) {
+            AssignPaletteEntries(colors, entries, assignments);
+        }
+
+        for (size_t i = 0; i < colors.size(); i++) {
+            keyIndices[colors[i].Key] = static_cast<uint16_t>(assignments[i]);
+        }
+    }
+
+    // Calls encodeRow(texels, dst) for every row of every tile, with dst pointing at that row's place in the output.
+    // Rows and columns past the image's edge repeat the last ones, like CMPR's edge blocks.
+    template<typename F>
+    void EncodeTiles(EGXTextureFormat format, const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst, const F& encodeRow) {
+        if (width == 0 || height == 0) {
+            return;
+        }
+
+        uint32_t tileWidth, tileHeight;
+        GetTileDimensions(format, tileWidth, tileHeight);
+
+        uint32_t tileSize = format == EGXTextureFormat::RGBA8 ? 64 : 32;
+        uint32_t rowSize = 32 / tileHeight;
+        uint32_t tilesWide = (width + tileWidth - 1) / tileWidth;
+        uint32_t tilesHigh = (height + tileHeight - 1) / tileHeight;
+
+        Util::ParallelFor(tilesHigh, [&](size_t tileY) {
+            uint8_t edgeTexels[8 * 4];
+            uint8_t* tileDst = dst + tileY * tilesWide * tileSize;
+
+            for (uint32_t tileX = 0; tileX < tilesWide; tileX++) {
+                uint32_t sourceX = tileX * tileWidth;
+
+                for (uint32_t row = 0; row < tileHeight; row++) {
+                    uint32_t sourceY = std::min(static_cast<uint32_t>(tileY) * tileHeight + row, height - 1);
+                    const uint8_t* texels = rgba + (static_cast<size_t>(sourceY) * width + sourceX) * 4;
+
+                    if (sourceX + tileWidth > width) {
+                        for (uint32_t x = 0; x < tileWidth; x++) {
+                            std::memcpy(edgeTexels + x * 4, texels + std::min(x, width - 1 - sourceX) * 4, 4);
+                        }
+
+                        texels = edgeTexels;
+                    }
+
+                    encodeRow(texels, tileDst + row * rowSize);
+                }
+
+                tileDst += tileSize;
+            }
+        });
+    }
+
+    // How many TLUT entries the indexed format can address, or 0 if it isn't indexed.
+    uint32_t GetMaxPaletteEntries(EGXTextureFormat format) {
+        switch (format) {
+        case EGXTextureFormat::C4:
+            return 16;
+        case EGXTextureFormat::C8:
+            return 256;
+        case EGXTextureFormat::C14X2:
+            return 0x4000;
+        default:
+            return 0;
+        }
+    }
+
+    // Every distinct key among the texels, weighted by how many texels have it.
+    std::vector<SPaletteColor> GatherPaletteColors(EPaletteFormat paletteFormat, const uint8_t* rgba, size_t texelCount) {
+        std::vector<uint32_t> keyCounts = CountPaletteKeys(paletteFormat, rgba, texelCount);
+        std::vector<SPaletteColor> colors;
+
+        for (uint32_t key = 0; key < 0x10000; key++) {
+            if (keyCounts[key] == 0) {
+                continue;
+            }
+
+            SPaletteColor color;
+            DecodePaletteKey(paletteFormat, static_cast<uint16_t>(key), color.RGBA);
+            color.Weight = static_cast<float>(keyCounts[key]);
+            color.Key = static_cast<uint16_t>(key);
+
+            colors.push_back(color);
+        }
+
+        return colors;
+    }
+
+    // Writes each texel's entry, looked up by its key, into the index tiles.
+    void WritePaletteIndices(EGXTextureFormat format, EPaletteFormat paletteFormat, const std::vector<uint16_t>& keyIndices,
+        const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst)
+    {
+        auto getIndex = [&](const uint8_t* texel) { return keyIndices[GetPaletteKey(paletteFormat, texel)]; };
+
+        switch (format) {
+        case EGXTextureFormat::C4:
+            EncodeTiles(format, rgba, width, height, dst, [&](const uint8_t* texels, uint8_t* rowDst) {
+                for (uint32_t i = 0; i < 4; i++) {
+                    rowDst[i] = static_cast<uint8_t>((getIndex(texels + i * 8) << 4) | getIndex(texels + i * 8 + 4));
+                }
+            });
+            break;
+        case EGXTextureFormat::C8:
+            EncodeTiles(format, rgba, width, height, dst, [&](const uint8_t* texels, uint8_t* rowDst) {
+                for (uint32_t i = 0; i < 8; i++) {
+                    rowDst[i] = static_cast<uint8_t>(getIndex(texels + i * 4));
+                }
+            });
+            break;
+        default:
+            EncodeTiles(format, rgba, width, height, dst, [&](const uint8_t* texels, uint8_t* rowDst) {
+                for (uint32_t i = 0; i < 4; i++) {
+                    WriteBigEndian16(rowDst + i * 2, getIndex(texels + i * 4));
+                }
+            });
+            break;
+        }
+    }
+
+    /* Mipmaps */
+
+    // sRGB to linear light for every 8-bit value
+    const float* GetLinearTable() {
+        static const std::vector<float> table = [] {
+            std::vector<float> values(256);
+
+            for (uint32_t i = 0; i < 256; i++) {
+                float c = i / 255.0f;
+                values[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+            }
+
+            return values;
+        }();
+
+        return table.data();
+    }
+
+    // Linear light back to 8-bit sRGB, indexed by the linear value scaled to the table's size
+    const uint8_t* GetSRGBTable() {
+        static const std::vector<uint8_t> table = [] {
+            std::vector<uint8_t> values(SRGB_TABLE_SIZE);
+
+            for (uint32_t i = 0; i < SRGB_TABLE_SIZE; i++) {
+                float c = i / static_cast<float>(SRGB_TABLE_SIZE - 1);
+                float srgb = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+                values[i] = static_cast<uint8_t>(std::lround(std::clamp(srgb, 0.0f, 1.0f) * 255.0f));
+            }
+
+            return values;
+        }();
+
+        return table.data();
+    }
+
+    // Averages four texels into one. Colors are weighted by alpha so that transparent texels, whose color is usually
+    // meaningless, don't bleed into their neighbors; if all four are transparent their colors are averaged evenly.
+    void DownsampleTexel(const uint8_t* const texels[4], const float* toLinear, const uint8_t* toSRGB, uint8_t* dst) {
+        alignas(16) float color[4];
+
+#ifdef J3DCONV_GXTEXTURE_SSE2
+        // Lane 3 of each linear color is 1, so it sums up the alpha weights alongside the colors
+        __m128 weighted = _mm_setzero_ps();
+        __m128 even = _mm_setzero_ps();
+
+        for (uint32_t i = 0; i < 4; i++) {
+            const uint8_t* texel = texels[i];
+            __m128 linear = _mm_setr_ps(toLinear[texel[0]], toLinear[texel[1]], toLinear[texel[2]], 1.0f);
+
+            weighted = _mm_add_ps(weighted, _mm_mul_ps(linear, _mm_set1_ps(texel[3])));
+            even = _mm_add_ps(even, linear);
+        }
+
+        float weight = _mm_cvtss_f32(_mm_shuffle_ps(weighted, weighted, _MM_SHUFFLE(3, 3, 3, 3)));
+        _mm_store_ps(color, weight > 0.0f ? _mm_div_ps(weighted, _mm_set1_ps(weight)) : _mm_mul_ps(even, _mm_set1_ps(0.25f)));
+#else
+        float weighted[4] = { };
+        float even[4] = { };
+
+        for (uint32_t i = 0; i < 4; i++) {
+            const uint8_t* texel = texels[i];
+            float alpha = texel[3];
+
+            for (uint32_t c = 0; c < 3; c++) {
+                weighted[c] += toLinear[texel[c]] * alpha;
+                even[c] += toLinear[texel[c]];
+            }
+
+            weighted[3] += alpha;
+        }
+
+        for (uint32_t c = 0; c < 3; c++) {
+            color[c] = weighted[3] > 0.0f ? weighted[c] / weighted[3] : even[c] * 0.25f;
+        }
+#endif
+
+        for (uint32_t c = 0; c < 3; c++) {
+            dst[c] = toSRGB[static_cast<uint32_t>(std::clamp(color[c], 0.0f, 1.0f) * (SRGB_TABLE_SIZE - 1) + 0.5f)];
+        }
+
+        dst[3] = static_cast<uint8_t>((texels[0][3] + texels[1][3] + texels[2][3] + texels[3][3] + 2) / 4);
+    }
+}
+
+namespace GXTexture {
+    uint32_t GetImageSize(EGXTextureFormat format, uint32_t width, uint32_t height) {
+        uint32_t tileWidth, tileHeight;
+        GetTileDimensions(format, tileWidth, tileHeight);
+
+        uint32_t tileCount = ((width + tileWidth - 1) / tileWidth) * ((height + tileHeight - 1) / tileHeight);
+        return tileCount * (format == EGXTextureFormat::RGBA8 ? 64 : 32);
+    }
+
+    void EncodeCMPR(const uint8_t* rgba, uint32_t width, uint32_t height, ECMPRQuality quality, uint8_t* dst) {
+        if (width == 0 || height == 0) {
+            return;
+        }
+
+        uint32_t tilesWide = (width + 7) / 8;
+        uint32_t tilesHigh = (height + 7) / 8;
+
+        // Each 8x8 tile is four blocks, in the order top left, top right, bottom left, bottom right
+        Util::ParallelFor(tilesHigh, [&](size_t tileY) {
+            SCMPRBlock block;
+            uint8_t* tileDst = dst + tileY * tilesWide * 32;
+
+            for (uint32_t tileX = 0; tileX < tilesWide; tileX++) {
+                for (uint32_t subBlock = 0; subBlock < 4; subBlock++) {
+                    uint32_t blockX = tileX * 8 + (subBlock & 1) * 4;
+                    uint32_t blockY = static_cast<uint32_t>(tileY) * 8 + (subBlock >> 1) * 4;
+
+                    ReadCMPRBlock(rgba, width, height, blockX, blockY, block);
+                    EncodeCMPRBlock(block, quality, tileDst);
+
+                    tileDst += 8;
+                }
+            }
+        });
+    }
+
+    bool EncodeDirect(EGXTextureFormat format, const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst) {
+        switch (format) {
+        case EGXTextureFormat::I4:
+            EncodeTiles(format, rgba, width, height, dst, [](const uint8_t* texels, uint8_t* rowDst) { EncodeI4Row(texels, rowDst); });
+            return true;
+        case EGXTextureFormat::I8:
+            EncodeTiles(format, rgba, width, height, dst, [](const uint8_t* texels, uint8_t* rowDst) { EncodeI8Row(texels, rowDst); });
+            return true;
+        case EGXTextureFormat::IA4:
+            EncodeTiles(format, rgba, width, height, dst, [](const uint8_t* texels, uint8_t* rowDst) { EncodeIA4Row(texels, rowDst); });
+            return true;
+        case EGXTextureFormat::IA8:
+            EncodeTiles(format, rgba, width, height, dst, [](const uint8_t* texels, uint8_t* rowDst) { EncodeIA8Row(texels, rowDst); });
+            return true;
+        case EGXTextureFormat::RGB565:
+            EncodeTiles(format, rgba, width, height, dst, [](const uint8_t* texels, uint8_t* rowDst) { EncodeRGB565Row(texels, rowDst); });
+            return true;
+        case EGXTextureFormat::RGB5A3:
+            EncodeTiles(format, rgba, width, height, dst, [](const uint8_t* texels, uint8_t* rowDst) { EncodeRGB5A3Row(texels, rowDst); });
+            return true;
+        case EGXTextureFormat::RGBA8:
+            EncodeTiles(format, rgba, width, height, dst, [](const uint8_t* texels, uint8_t* rowDst) { EncodeRGBA8Row(texels, rowDst); });
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    uint32_t CountPaletteColors(EPaletteFormat paletteFormat, const uint8_t* rgba, size_t texelCount, uint32_t limit) {
+        std::vector<bool> seenKeys(0x10000, false);
+        uint32_t colorCount = 0;
+
+        for (size_t i = 0; i < texelCount && colorCount <= limit; i++) {
+            uint16_t key = GetPaletteKey(paletteFormat, rgba + i * 4);
+
+            if (!seenKeys[key]) {
+                seenKeys[key] = true;
+                colorCount++;
+            }
+        }
+
+        return colorCount;
+    }
+
+    bool EncodePalette(EGXTextureFormat format, EPaletteFormat paletteFormat, const uint8_t* rgba, uint32_t width, uint32_t height,
+        uint8_t* dst, std::vector<uint8_t>& palette)
+    {
+        uint32_t maxEntries = GetMaxPaletteEntries(format);
+        if (maxEntries == 0) {
+            return false;
+        }
+
+        std::vector<SPaletteColor> colors = GatherPaletteColors(paletteFormat, rgba, static_cast<size_t>(width) * height);
+
+        std::vector<uint16_t> paletteKeys;
+        std::vector<uint16_t> keyIndices(0x10000, 0);
+        BuildPalette(paletteFormat, colors, maxEntries, paletteKeys, keyIndices);
+
+        // GX loads TLUTs in rows of 16 entries
+        palette.assign(((paletteKeys.size() + 15) & ~static_cast<size_t>(15)) * 2, 0);
+        for (size_t i = 0; i < paletteKeys.size(); i++) {
+            WriteBigEndian16(palette.data() + i * 2, paletteKeys[i]);
+        }
+
+        WritePaletteIndices(format, paletteFormat, keyIndices, rgba, width, height, dst);
+        return true;
+    }
+
+    bool EncodePaletteIndices(EGXTextureFormat format, EPaletteFormat paletteFormat, const std::vector<uint8_t>& palette,
+        const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst)
+    {
+        if (GetMaxPaletteEntries(format) == 0 || palette.size() < 2) {
+            return false;
+        }
+
+        std::vector<std::array<float, 4>> entries(palette.size() / 2);
+        std::vector<uint16_t> keyIndices(0x10000, UINT16_MAX);
+
+        // Going backwards leaves each key on its first entry
+        for (size_t i = entries.size(); i-- > 0;) {
+            uint16_t key = static_cast<uint16_t>((palette[i * 2] << 8) | palette[i * 2 + 1]);
+
+            DecodePaletteKey(paletteFormat, key, entries[i].data());
+            keyIndices[key] = static_cast<uint16_t>(i);
+        }
+
+        // Colors the palette already has map straight to their entry; only the rest are searched for
+        std::vector<SPaletteColor> colors = GatherPaletteColors(paletteFormat, rgba, static_cast<size_t>(width) * height);
+        colors.erase(std::remove_if(colors.begin(), colors.end(), [&](const SPaletteColor& color) {
+            return keyIndices[color.Key] != UINT16_MAX;
+        }), colors.end());
+
+        std::vector<uint32_t> assignments(colors.size(), 0);
+        AssignPaletteEntries(colors, entries, assignments);
+
+        for (size_t i = 0; i < colors.size(); i++) {
+            keyIndices[colors[i].Key] = static_cast<uint16_t>(assignments[i]);
+        }
+
+        WritePaletteIndices(format, paletteFormat, keyIndices, rgba, width, height, dst);
+        return true;
+    }
+
+    uint32_t GetMaxMipCount(EGXTextureFormat format, uint32_t width, uint32_t height) {
+        uint32_t tileWidth, tileHeight;
+        GetTileDimensions(format, tileWidth, tileHeight);
+
+        uint32_t mipCount = 1;
+        for (; mipCount < MAX_MIP_COUNT && width / 2 >= tileWidth && height / 2 >= tileHeight; mipCount++) {
+            width /= 2;
+            height /= 2;
+        }
+
+        return mipCount;
+    }
+
+    void DownsampleImage(const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst) {
+        uint32_t dstWidth = (width + 1) / 2;
+        uint32_t dstHeight = (height + 1) / 2;
+
+        const float* toLinear = GetLinearTable();
+        const uint8_t* toSRGB = GetSRGBTable();
+
+        Util::ParallelFor(dstHeight, [&](size_t y) {
+            // Odd sizes repeat the last row and column
+            const uint8_t* row0 = rgba + y * 2 * width * 4;
+            const uint8_t* row1 = rgba + static_cast<size_t>(std::min(static_cast<uint32_t>(y) * 2 + 1, height - 1)) * width * 4;
+            uint8_t* rowDst = dst + y * dstWidth * 4;
+
+            for (uint32_t x = 0; x < dstWidth; x++) {
+                uint32_t x0 = x * 2 * 4;
+                uint32_t x1 = std::min(x * 2 + 1, width - 1) * 4;
+
+                const uint8_t* texels[4] = { row0 + x0, row0 + x1, row1 + x0, row1 + x1 };
+                DownsampleTexel(texels, toLinear, toSRGB, rowDst + x * 4);
+            }
+        });
+    }
+}
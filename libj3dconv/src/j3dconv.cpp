@@ -3,13 +3,27 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include "j3dconv.hpp"
+#include "object.hpp"
 
 #include <bstream.h>
 #include <tiny_gltf.h>
 
+#include <climits>
 #include <iostream>
+#include <unordered_map>
+#include <utility>
 
-bool libj3dconv::LoadGltf(tinygltf::Model* model, std::filesystem::path filePath) {
+const uint32_t GLB_MAGIC = 0x46546C67;      // 'glTF'
+const uint32_t GLB_CHUNK_JSON = 0x4E4F534A; // 'JSON'
+const uint32_t GLB_CHUNK_BIN = 0x004E4942;  // 'BIN\0'
+const uint32_t GLB_HEADER_SIZE = 12;
+
+// Stands in for data that stays in the mapped file. tinygltf rejects empty data URIs,
+// so this decodes to 3 zero bytes.
+const std::string MAPPED_PLACEHOLDER_URI = "data:application/octet-stream;base64,AAAA";
+const size_t MAPPED_PLACEHOLDER_SIZE = 3;
+
+bool libj3dconv::LoadGltf(tinygltf::Model* model, std::filesystem::path filePath, EImageLoadMode imageMode) {
     if (filePath.empty() || !std::filesystem::exists(filePath)) {
         return false;
     }
@@ -24,17 +38,19 @@ bool libj3dconv::LoadGltf(tinygltf::Model* model, std::filesystem::path filePath
     }
 
     stream.readBytesTo(buf, bufSize);
-    bool result = LoadGltf(model, buf, bufSize);
+    bool result = LoadGltf(model, buf, bufSize, imageMode);
 
     delete[] buf;
     return result;
 }
 
-bool libj3dconv::LoadGltf(tinygltf::Model* model, const uint8_t* data, size_t size) {
+bool libj3dconv::LoadGltf(tinygltf::Model* model, const uint8_t* data, size_t size, EImageLoadMode imageMode) {
     tinygltf::TinyGLTF loader;
     std::string error = "";
     std::string warning = "";
 
+    loader.SetImagesAsIs(imageMode == EImageLoadMode::Deferred);
+
     bool result = loader.LoadBinaryFromMemory(model, &error, &warning, data, (unsigned int)size);
 
     if (!error.empty()) {
@@ -48,19 +64,205 @@ bool libj3dconv::LoadGltf(tinygltf::Model* model, const uint8_t* data, size_t si
     return result;
 }
 
+bool libj3dconv::LoadGltfMapped(tinygltf::Model* model, SMappedGlb* glb, std::filesystem::path filePath, EImageLoadMode imageMode) {
+    if (model == nullptr || glb == nullptr || !glb->File.Open(filePath)) {
+        return false;
+    }
+
+    const uint8_t* fileData = glb->File.GetData();
+    size_t fileSize = glb->File.GetSize();
+
+    // Find the JSON and BIN chunks without copying anything.
+    bStream::CMemoryStream stream(const_cast<uint8_t*>(fileData), fileSize, bStream::Little, bStream::In);
+
+    if (fileSize < GLB_HEADER_SIZE + 8 || stream.readUInt32() != GLB_MAGIC) {
+        std::cout << "File is not a binary glTF: " << filePath << std::endl;
+        return false;
+    }
+
+    stream.seek(GLB_HEADER_SIZE);
+    uint32_t jsonSize = stream.readUInt32();
+    uint32_t jsonType = stream.readUInt32();
+    size_t jsonOffset = stream.tell();
+
+    if (jsonType != GLB_CHUNK_JSON || jsonOffset + jsonSize > fileSize) {
+        std::cout << "Invalid JSON chunk in binary glTF: " << filePath << std::endl;
+        return false;
+    }
+
+    glb->BinChunk = nullptr;
+    glb->BinChunkSize = 0;
+
+    if (jsonOffset + jsonSize + 8 <= fileSize) {
+        stream.seek(jsonOffset + jsonSize);
+        uint32_t binSize = stream.readUInt32();
+        uint32_t binType = stream.readUInt32();
+
+        if (binType == GLB_CHUNK_BIN && stream.tell() + binSize <= fileSize) {
+            glb->BinChunk = fileData + stream.tell();
+            glb->BinChunkSize = binSize;
+        }
+    }
+
+    nlohmann::json json = nlohmann::json::parse(fileData + jsonOffset, fileData + jsonOffset + jsonSize, nullptr, false);
+    if (json.is_discarded()) {
+        std::cout << "Unable to parse JSON chunk in binary glTF: " << filePath << std::endl;
+        return false;
+    }
+
+    // Image index -> buffer view index, for images stored in the BIN chunk
+    std::unordered_map<int, int> mappedImageViews;
+
+    // The embedded buffer is always the first one, and it's the only one without a uri.
+    // Swap it for a placeholder so that tinygltf doesn't copy the BIN chunk into the model.
+    bool hasEmbeddedBuffer = json.contains("buffers") && json["buffers"].is_array() && json["buffers"].size() != 0
+        && !json["buffers"][0].contains("uri");
+
+    if (glb->BinChunk != nullptr && hasEmbeddedBuffer) {
+        json["buffers"][0]["uri"] = MAPPED_PLACEHOLDER_URI;
+        json["buffers"][0]["byteLength"] = MAPPED_PLACEHOLDER_SIZE;
+
+        // Images in the BIN chunk would be read from the placeholder, so point them at a placeholder too
+        // and decode them straight from the mapping in the image loader below.
+        if (json.contains("images") && json["images"].is_array()) {
+            auto& images = json["images"];
+
+            // Only looked up with find and at, so an index from the file can never add to the array
+            const auto bufferViewsItr = json.find("bufferViews");
+            const bool bHasBufferViews = bufferViewsItr != json.end() && bufferViewsItr->is_array();
+
+            for (size_t i = 0; i < images.size(); i++) {
+                auto& image = images[i];
+                if (!image.contains("bufferView") || !image["bufferView"].is_number_integer()) {
+                    continue;
+                }
+
+                // Invalid views are left in place for tinygltf to report
+                int viewIndex = image["bufferView"].get<int>();
+                if (!bHasBufferViews || viewIndex < 0 || static_cast<size_t>(viewIndex) >= bufferViewsItr->size()) {
+                    continue;
+                }
+
+                const nlohmann::json& view = bufferViewsItr->at(viewIndex);
+                if (!view.is_object() || !view.contains("buffer") || !view["buffer"].is_number_integer() || view["buffer"].get<int>() != 0) {
+                    continue;
+                }
+
+                // The image loader below reads these without checking their types
+                if (!view.contains("byteLength") || !view["byteLength"].is_number_unsigned()
+                    || (view.contains("byteOffset") && !view["byteOffset"].is_number_unsigned())) {
+                    continue;
+                }
+
+                mappedImageViews[static_cast<int>(i)] = viewIndex;
+
+                image.erase("bufferView");
+                image["uri"] = MAPPED_PLACEHOLDER_URI;
+            }
+        }
+    }
+    else {
+        glb->BinChunk = nullptr;
+        glb->BinChunkSize = 0;
+    }
+
+    std::string mappedJson = json.dump();
+
+    tinygltf::TinyGLTF loader;
+    std::string error = "";
+    std::string warning = "";
+
+    tinygltf::LoadImageDataOption imageOption;
+    imageOption.as_is = imageMode == EImageLoadMode::Deferred;
+
+    loader.SetImageLoader(
+        [&](tinygltf::Image* image, const int imageIndex, std::string* err, std::string* warn,
+            int reqWidth, int reqHeight, const unsigned char* bytes, int size, void* userData) {
+            const auto& mappedItr = mappedImageViews.find(imageIndex);
+            if (mappedItr == mappedImageViews.end()) {
+                return tinygltf::LoadImageData(image, imageIndex, err, warn, reqWidth, reqHeight, bytes, size, userData);
+            }
+
+            const nlohmann::json& view = std::as_const(json).at("bufferViews").at(mappedItr->second);
+            size_t viewOffset = view.value("byteOffset", static_cast<size_t>(0));
+            size_t viewSize = view.value("byteLength", static_cast<size_t>(0));
+
+            if (viewOffset > glb->BinChunkSize || viewSize > glb->BinChunkSize - viewOffset) {
+                if (err != nullptr) {
+                    (*err) += "Image " + std::to_string(imageIndex) + " lies outside of the BIN chunk.\n";
+                }
+
+                return false;
+            }
+
+            // The image decoders take the encoded size as an int
+            if (viewSize > static_cast<size_t>(INT_MAX)) {
+                if (err != nullptr) {
+                    (*err) += "Image " + std::to_string(imageIndex) + " is too large to decode.\n";
+                }
+
+                return false;
+            }
+
+            // Restore what the placeholder uri replaced
+            image->bufferView = mappedItr->second;
+            const nlohmann::json& imageJson = std::as_const(json).at("images").at(imageIndex);
+            if (imageJson.contains("mimeType") && imageJson["mimeType"].is_string()) {
+                image->mimeType = imageJson["mimeType"].get<std::string>();
+            }
+
+            return tinygltf::LoadImageData(image, imageIndex, err, warn, reqWidth, reqHeight,
+                glb->BinChunk + viewOffset, static_cast<int>(viewSize), userData);
+        },
+        &imageOption
+    );
+
+    std::string baseDir = filePath.parent_path().string();
+    bool result = loader.LoadASCIIFromString(model, &error, &warning, mappedJson.c_str(), (unsigned int)mappedJson.size(), baseDir);
+
+    if (!error.empty()) {
+        std::cout << "glTF loader emitted errors: " << error << std::endl;
+    }
+
+    if (!warning.empty()) {
+        std::cout << "glTF loader emitted warnings: " << warning << std::endl;
+    }
+
+    if (result && glb->BinChunk != nullptr) {
+        // Don't leave the placeholder visible in the model
+        model->buffers[0].uri.clear();
+        model->buffers[0].data.clear();
+    }
+
+    return result;
+}
+
 bool libj3dconv::SaveBMD(tinygltf::Model* model, std::filesystem::path filePath) {
+    return SaveBMD(model, nullptr, filePath);
+}
+
+bool libj3dconv::SaveBMD(tinygltf::Model* model, bStream::CStream& stream) {
+    return SaveBMD(model, nullptr, stream);
+}
+
+bool libj3dconv::SaveBMD(tinygltf::Model* model, const SMappedGlb* glb, std::filesystem::path filePath) {
     if (model == nullptr || filePath.empty()) {
         return false;
     }
 
     bStream::CFileStream stream(filePath.string().c_str(), bStream::Big, bStream::Out);
-    return SaveBMD(model, stream);
+    return SaveBMD(model, glb, stream);
 }
 
-bool libj3dconv::SaveBMD(tinygltf::Model* model, bStream::CStream& stream) {
+bool libj3dconv::SaveBMD(tinygltf::Model* model, const SMappedGlb* glb, bStream::CStream& stream) {
     if (model == nullptr) {
         return false;
     }
 
-    return true;
+    CConverterObject converter;
+    if (!converter.Load(model, glb)) {
+        return false;
+    }
+
+    return converter.WriteBMD(stream);
 }
@@ -1,4 +1,5 @@
 #include "object.hpp"
+#include "j3dconv.hpp"
 
 #include "jutnametab.hpp"
 #include "util.hpp"
@@ -8,6 +9,7 @@
 #include <glm/gtx/quaternion.hpp>
 
 #include <algorithm>
+#include <iostream>
 
 CConverterObject::CConverterObject() {
 
@@ -15,59 +17,75 @@ CConverterObject::CConverterObject() {
 
 CConverterObject::~CConverterObject() {
     mBufferStreams.clear();
-
-    for (uint8_t* buffer : mBuffers) {
-        delete[] buffer;
-    }
-    mBuffers.clear();
 }
 
-void CConverterObject::WriteTEX1(bStream::CStream& stream, tinygltf::Model* model) {
-    const auto& textures = model->textures;
-    size_t startingStreamPos = stream.tell();
-
-    stream.writeUInt32(0x54455831);
-    stream.writeUInt32(0);
-
-    stream.writeUInt16(model->textures.size());
-    stream.writeUInt16(UINT16_MAX);
+bool CConverterObject::LoadBuffers(tinygltf::Model* model, const libj3dconv::SMappedGlb* glb) {
+    mBufferStreams.clear();
 
-    if (model->textures.size() == 0) {
-        stream.writeUInt32(0);
-        stream.writeUInt32(0x20);
+    std::vector<size_t> bufferSizes;
 
-        Util::PadStreamWithString(&stream, 16);
+    for (uint32_t i = 0; i < model->buffers.size(); i++) {
+        auto& buf = model->buffers[i];
 
-        stream.writeUInt16(0);
-        stream.writeUInt16(UINT16_MAX);
-        Util::PadStreamWithString(&stream, 16);
+        // A mapped GLB's embedded buffer is always the first one, and its bytes live in the mapping.
+        if (i == 0 && glb != nullptr && glb->BinChunk != nullptr) {
+            mBufferStreams.push_back(bStream::CMemoryStream(const_cast<uint8_t*>(glb->BinChunk), glb->BinChunkSize, bStream::Little, bStream::In));
+            bufferSizes.push_back(glb->BinChunkSize);
+            continue;
+        }
 
-        return;
+        mBufferStreams.push_back(bStream::CMemoryStream(buf.data.data(), buf.data.size(), bStream::Little, bStream::In));
+        bufferSizes.push_back(buf.data.size());
     }
-}
 
-void CConverterObject::LoadBuffers(tinygltf::Model* model) {
-    for (const auto& buf : model->buffers) {
-        uint8_t* buffer = new uint8_t[buf.data.size()];
-        std::memcpy(buffer, buf.data.data(), buf.data.size());
+    // A model from LoadGltfMapped has an empty embedded buffer unless its mapping is passed along
+    for (uint32_t i = 0; i < model->bufferViews.size(); i++) {
+        const auto& view = model->bufferViews[i];
 
-        mBuffers.push_back(buffer);
-        mBufferStreams.push_back(bStream::CMemoryStream(buffer, buf.data.size(), bStream::Little, bStream::In));
-    }
-}
+        if (view.buffer < 0 || view.buffer >= static_cast<int>(bufferSizes.size())) {
+            std::cout << "Buffer view " << i << " references a buffer that does not exist." << std::endl;
+            return false;
+        }
 
+        size_t bufferSize = bufferSizes[view.buffer];
+        if (view.byteOffset > bufferSize || view.byteLength > bufferSize - view.byteOffset) {
+            std::cout << "Buffer view " << i << " runs past the end of buffer " << view.buffer << ". Models loaded with LoadGltfMapped must be converted with their SMappedGlb." << std::endl;
+            return false;
+        }
+    }
 
+    return true;
+}
 
 bool CConverterObject::Load(tinygltf::Model* model) {
-    LoadBuffers(model);
+    return Load(model, nullptr);
+}
+
+bool CConverterObject::Load(tinygltf::Model* model, const libj3dconv::SMappedGlb* glb) {
+    if (!LoadBuffers(model, glb)) {
+        return false;
+    }
 
     mSkeletonData.BuildSkeleton(model);
     
     mShapeData.BuildVertexData(model, mVertexData, mBufferStreams);
+    if (mVertexData.HasOverflowed()) {
+        return false;
+    }
+
+    mVertexData.QuantizeAttributes(mShapeData.GetShapes());
     mSkeletonData.AttachShapesToSkeleton(mShapeData.GetShapes());
 
-    mEnvelopeData.ProcessEnvelopes(mShapeData.GetShapes());
     mEnvelopeData.ReadInverseBindMatrices(model, mBufferStreams);
+    mEnvelopeData.PruneSkinWeights(mShapeData.GetShapes(), mVertexData);
+    mSkeletonData.CalculateJointBounds(mShapeData.GetShapes(), mVertexData, mEnvelopeData.GetInverseBindMatrices());
+    mEnvelopeData.ProcessEnvelopes(mShapeData.GetShapes());
+    mSkeletonData.PlanDrawOrder(mShapeData.GetShapes(), mVertexData, model);
+    mShapeData.BuildPackets();
+
+    if (!mGeometryOnly) {
+        mTextureData.ProcessTextureData(model, mBufferStreams);
+    }
 
     return true;
 }
@@ -98,13 +116,13 @@ bool CConverterObject::WriteBMD(bStream::CStream& stream) {
     mSkeletonData.WriteJNT1(stream);
 
     // Write geometry data
-    //WriteSHP1(stream);
+    mShapeData.WriteSHP1(stream);
     
     // Write material data
     //WriteMAT3(stream);
 
     // Write texture data
-    //WriteTEX1(stream);
+    mTextureData.WriteTEX1(stream);
 
     // Write file size
     Util::WriteOffset(&stream, 0, 8);
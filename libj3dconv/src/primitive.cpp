@@ -0,0 +1,518 @@
+#include "primitive.hpp"
+
+#include <tri_stripper.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+// Each GX draw command starts with a one byte opcode and a two byte vertex count.
+const size_t PRIMITIVE_HEADER_SIZE = 3;
+
+// Fans are started from each of a triangle's three corners, and the longest one is kept.
+const uint32_t TRIANGLE_CORNER_COUNT = 3;
+
+// The GX draw command stores a primitive's vertex count in 16 bits, so strips stop growing at this length.
+const size_t MAX_STRIP_VERTEX_COUNT = UINT16_MAX;
+
+/* SplitPrimitive */
+
+// Calls visit(start, end) for each run of vertices SplitPrimitive copies into a piece. Fan pieces
+// also start with the fan's center, which isn't part of the run.
+template<typename TVisit>
+void VisitPrimitivePieces(EGXPrimitiveType primitiveType, size_t vertexCount, size_t maxCount, TVisit visit) {
+    switch (primitiveType) {
+        case EGXPrimitiveType::Triangles:
+        case EGXPrimitiveType::Lines:
+        case EGXPrimitiveType::Points:
+        {
+            size_t verticesPerPrimitive = primitiveType == EGXPrimitiveType::Triangles ? 3 : primitiveType == EGXPrimitiveType::Lines ? 2 : 1;
+            size_t chunkSize = maxCount - maxCount % verticesPerPrimitive;
+
+            for (size_t start = 0; start < vertexCount; start += chunkSize) {
+                visit(start, std::min(start + chunkSize, vertexCount));
+            }
+
+            break;
+        }
+        case EGXPrimitiveType::TriangleStrips:
+        {
+            // An even length makes the next piece, which starts two vertices before this one ends, start on an even triangle.
+            size_t chunkSize = maxCount - maxCount % 2;
+
+            for (size_t start = 0; start + 2 < vertexCount; start += chunkSize - 2) {
+                visit(start, std::min(start + chunkSize, vertexCount));
+            }
+
+            break;
+        }
+        case EGXPrimitiveType::TriangleFan:
+        {
+            // Every piece starts with the fan's center, followed by a run of the rim that overlaps the last piece by one vertex.
+            size_t rimChunkSize = maxCount - 1;
+
+            for (size_t start = 1; start + 1 < vertexCount; start += rimChunkSize - 1) {
+                visit(start, std::min(start + rimChunkSize, vertexCount));
+            }
+
+            break;
+        }
+        case EGXPrimitiveType::LineStrips:
+        {
+            for (size_t start = 0; start + 1 < vertexCount; start += maxCount - 1) {
+                visit(start, std::min(start + maxCount, vertexCount));
+            }
+
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void SplitPrimitive(EGXPrimitiveType primitiveType, const std::vector<uint32_t>& vertices, size_t maxCount, std::vector<std::vector<uint32_t>>& pieces) {
+    VisitPrimitivePieces(primitiveType, vertices.size(), maxCount, [&](size_t start, size_t end) {
+        std::vector<uint32_t>& piece = pieces.emplace_back();
+        if (primitiveType == EGXPrimitiveType::TriangleFan) {
+            piece.push_back(vertices[0]);
+        }
+
+        piece.insert(piece.end(), vertices.begin() + start, vertices.begin() + end);
+    });
+}
+
+void MeasureSplitPrimitive(EGXPrimitiveType primitiveType, size_t vertexCount, size_t maxCount, size_t& pieceCount, size_t& pieceVertexCount) {
+    pieceCount = 0;
+    pieceVertexCount = 0;
+
+    VisitPrimitivePieces(primitiveType, vertexCount, maxCount, [&](size_t start, size_t end) {
+        pieceCount++;
+        pieceVertexCount += end - start + (primitiveType == EGXPrimitiveType::TriangleFan ? 1 : 0);
+    });
+}
+
+/* CLinearStripifier */
+
+template<typename TIndex>
+void CLinearStripifier::StripIndices(const TIndex* indices, size_t indexCount, std::vector<SPendingPrimitive>& primitives) {
+    uint32_t triangleCount = static_cast<uint32_t>(indexCount / 3);
+    if (triangleCount == 0) {
+        return;
+    }
+
+    uint32_t vertexCount = 0;
+    for (size_t i = 0; i < static_cast<size_t>(triangleCount) * 3; i++) {
+        vertexCount = std::max<uint32_t>(vertexCount, static_cast<uint32_t>(indices[i]) + 1);
+    }
+
+    std::vector<uint8_t> used(triangleCount, 0);
+
+    // The triangles around each vertex, stored back to back. As used triangles are found they're swapped to
+    // the front of their vertex's range and skipped from then on, so each entry is only stepped over once.
+    std::vector<uint32_t> adjacencyStart(vertexCount + 1, 0);
+    std::vector<uint32_t> liveStart;
+    std::vector<uint32_t> adjacency;
+
+    for (uint32_t t = 0; t < triangleCount; t++) {
+        const TIndex* tri = indices + t * 3;
+
+        // Degenerate triangles don't draw anything, so they're dropped rather than left to break strips.
+        if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0]) {
+            used[t] = 1;
+            continue;
+        }
+
+        for (uint32_t corner = 0; corner < TRIANGLE_CORNER_COUNT; corner++) {
+            adjacencyStart[tri[corner] + 1]++;
+        }
+    }
+
+    for (uint32_t v = 0; v < vertexCount; v++) {
+        adjacencyStart[v + 1] += adjacencyStart[v];
+    }
+
+    liveStart.assign(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    adjacency.resize(adjacencyStart[vertexCount]);
+
+    for (uint32_t t = 0; t < triangleCount; t++) {
+        if (used[t]) {
+            continue;
+        }
+
+        for (uint32_t corner = 0; corner < TRIANGLE_CORNER_COUNT; corner++) {
+            adjacency[liveStart[indices[t * 3 + corner]]++] = t;
+        }
+    }
+
+    liveStart.assign(adjacencyStart.begin(), adjacencyStart.end() - 1);
+
+    // Finds an unused triangle around vertex, optionally one with the directed edge from -> vertex.
+    // Returns the triangle and its third vertex, or UINT32_MAX if there is none.
+    auto findTriangle = [&](uint32_t vertex, uint32_t from, uint32_t& third) -> uint32_t {
+        uint32_t& live = liveStart[vertex];
+
+        for (uint32_t i = live; i < adjacencyStart[vertex + 1]; i++) {
+            uint32_t t = adjacency[i];
+
+            if (used[t]) {
+                std::swap(adjacency[i], adjacency[live]);
+                live++;
+                continue;
+            }
+
+            if (from == UINT32_MAX) {
+                return t;
+            }
+
+            const TIndex* tri = indices + t * 3;
+            for (uint32_t corner = 0; corner < TRIANGLE_CORNER_COUNT; corner++) {
+                if (tri[corner] == from && tri[(corner + 1) % 3] == vertex) {
+                    third = tri[(corner + 2) % 3];
+                    return t;
+                }
+            }
+        }
+
+        return UINT32_MAX;
+    };
+
+    SPendingPrimitive list;
+    list.mPrimitiveType = EGXPrimitiveType::Triangles;
+
+    std::vector<uint32_t> strip;
+    uint32_t seedCursor = 0;
+    uint32_t lastVertex = UINT32_MAX;
+    uint32_t third = 0;
+
+    while (true) {
+        // New strips start next to where the last one ended when they can, which keeps them close together in the
+        // vertex cache. Otherwise the first unused triangle in the input is taken.
+        uint32_t seed = lastVertex != UINT32_MAX ? findTriangle(lastVertex, UINT32_MAX, third) : UINT32_MAX;
+
+        if (seed == UINT32_MAX) {
+            while (seedCursor < triangleCount && used[seedCursor]) {
+                seedCursor++;
+            }
+
+            if (seedCursor == triangleCount) {
+                break;
+            }
+
+            seed = seedCursor;
+        }
+
+        used[seed] = 1;
+        const TIndex* tri = indices + seed * 3;
+
+        // Start from whichever corner lets the strip continue. The second triangle of a strip is wound the
+        // other way, so it has to contain the seed's last edge reversed.
+        uint32_t rotation = 0;
+        for (uint32_t corner = 0; corner < TRIANGLE_CORNER_COUNT; corner++) {
+            if (findTriangle(tri[(corner + 1) % 3], tri[(corner + 2) % 3], third) != UINT32_MAX) {
+                rotation = corner;
+                break;
+            }
+        }
+
+        strip = { tri[rotation], tri[(rotation + 1) % 3], tri[(rotation + 2) % 3] };
+
+        while (strip.size() < MAX_STRIP_VERTEX_COUNT) {
+            size_t n = strip.size();
+            bool bOddTriangle = (n - 2) % 2 == 1;
+
+            uint32_t from = bOddTriangle ? strip[n - 1] : strip[n - 2];
+            uint32_t to = bOddTriangle ? strip[n - 2] : strip[n - 1];
+
+            uint32_t next = findTriangle(to, from, third);
+            if (next == UINT32_MAX) {
+                break;
+            }
+
+            used[next] = 1;
+            strip.push_back(third);
+        }
+
+        lastVertex = strip.back();
+
+        if (strip.size() - 2 >= std::max<uint32_t>(mMinStripSize, 2)) {
+            SPendingPrimitive& pending = primitives.emplace_back();
+            pending.mPrimitiveType = EGXPrimitiveType::TriangleStrips;
+            pending.mIndices = strip;
+            continue;
+        }
+
+        // Short strips are unrolled back into triangles, keeping each one's winding.
+        for (size_t k = 0; k + 2 < strip.size(); k++) {
+            bool bOddTriangle = k % 2 == 1;
+
+            list.mIndices.push_back(bOddTriangle ? strip[k + 1] : strip[k]);
+            list.mIndices.push_back(bOddTriangle ? strip[k] : strip[k + 1]);
+            list.mIndices.push_back(strip[k + 2]);
+        }
+    }
+
+    if (list.mIndices.size() != 0) {
+        primitives.push_back(std::move(list));
+    }
+}
+
+void CLinearStripifier::Strip(const uint16_t* indices, size_t indexCount, std::vector<SPendingPrimitive>& primitives) {
+    StripIndices(indices, indexCount, primitives);
+}
+
+void CLinearStripifier::Strip(const uint32_t* indices, size_t indexCount, std::vector<SPendingPrimitive>& primitives) {
+    StripIndices(indices, indexCount, primitives);
+}
+
+/* CPrimitiveOptimizer */
+
+CPrimitiveOptimizer::CPrimitiveOptimizer(const SPrimitiveSettings& settings, uint32_t vertexSize) {
+    mSettings = settings;
+    mVertexSize = vertexSize;
+}
+
+void CPrimitiveOptimizer::BuildList(const std::vector<uint32_t>& triangles, std::vector<SPendingPrimitive>& primitives) {
+    SPendingPrimitive& list = primitives.emplace_back();
+    list.mPrimitiveType = EGXPrimitiveType::Triangles;
+    list.mIndices = triangles;
+}
+
+void CPrimitiveOptimizer::BuildStrips(const std::vector<uint32_t>& triangles, uint32_t cacheSize, uint32_t minStripSize, std::vector<SPendingPrimitive>& primitives) {
+    triangle_stripper::indices indicesToStrip(triangles.begin(), triangles.end());
+    triangle_stripper::tri_stripper stripper(indicesToStrip);
+
+    stripper.SetCacheSize(cacheSize);
+    stripper.SetMinStripSize(std::max<uint32_t>(minStripSize, 2));
+
+    triangle_stripper::primitive_vector strippedPrimitives;
+    stripper.Strip(&strippedPrimitives);
+
+    // TriStripper returns the triangles it couldn't fit into a strip as plain lists, so the type has to be kept.
+    for (const triangle_stripper::primitive_group& group : strippedPrimitives) {
+        if (group.Indices.size() == 0) {
+            continue;
+        }
+
+        SPendingPrimitive& pending = primitives.emplace_back();
+        pending.mPrimitiveType = group.Type == triangle_stripper::TRIANGLE_STRIP ? EGXPrimitiveType::TriangleStrips : EGXPrimitiveType::Triangles;
+        pending.mIndices.assign(group.Indices.begin(), group.Indices.end());
+    }
+
+    MergeSmallPrimitives(primitives);
+}
+
+void CPrimitiveOptimizer::BuildLinearStrips(const std::vector<uint32_t>& triangles, uint32_t minStripSize, std::vector<SPendingPrimitive>& primitives) {
+    CLinearStripifier stripifier;
+    stripifier.SetMinStripSize(minStripSize);
+    stripifier.Strip(triangles.data(), triangles.size(), primitives);
+
+    MergeSmallPrimitives(primitives);
+}
+
+void CPrimitiveOptimizer::BuildFans(const std::vector<uint32_t>& triangles, std::vector<SPendingPrimitive>& primitives) {
+    uint32_t triangleCount = static_cast<uint32_t>(triangles.size() / 3);
+
+    // Maps each directed edge to the triangles that contain it with the same winding
+    std::unordered_multimap<uint64_t, uint32_t> edgeTriangles;
+    edgeTriangles.reserve(triangles.size());
+
+    auto edgeKey = [](uint32_t a, uint32_t b) { return (static_cast<uint64_t>(a) << 32) | b; };
+
+    for (uint32_t t = 0; t < triangleCount; t++) {
+        const uint32_t* tri = &triangles[t * 3];
+        for (uint32_t corner = 0; corner < TRIANGLE_CORNER_COUNT; corner++) {
+            edgeTriangles.emplace(edgeKey(tri[corner], tri[(corner + 1) % 3]), t);
+        }
+    }
+
+    std::vector<bool> used(triangleCount, false);
+    // Marks the triangles taken by the fan currently being grown, so it can't loop back onto itself
+    std::vector<uint32_t> fanStamp(triangleCount, UINT32_MAX);
+    uint32_t nextStamp = 0;
+
+    std::vector<uint32_t> bestFan, bestFanTriangles;
+    std::vector<uint32_t> fan, fanTriangles;
+
+    for (uint32_t t = 0; t < triangleCount; t++) {
+        if (used[t]) {
+            continue;
+        }
+
+        const uint32_t* tri = &triangles[t * 3];
+        bestFan.clear();
+        bestFanTriangles.clear();
+
+        for (uint32_t corner = 0; corner < TRIANGLE_CORNER_COUNT; corner++) {
+            uint32_t stamp = nextStamp++;
+            uint32_t center = tri[corner];
+            uint32_t last = tri[(corner + 2) % 3];
+
+            fan = { center, tri[(corner + 1) % 3], last };
+            fanTriangles = { t };
+            fanStamp[t] = stamp;
+
+            // The next triangle in the fan is the one that continues around the center, (center, last, next).
+            while (true) {
+                auto [rangeStart, rangeEnd] = edgeTriangles.equal_range(edgeKey(center, last));
+
+                uint32_t nextTriangle = UINT32_MAX;
+                for (auto itr = rangeStart; itr != rangeEnd; ++itr) {
+                    if (!used[itr->second] && fanStamp[itr->second] != stamp) {
+                        nextTriangle = itr->second;
+                        break;
+                    }
+                }
+
+                if (nextTriangle == UINT32_MAX) {
+                    break;
+                }
+
+                const uint32_t* next = &triangles[nextTriangle * 3];
+                uint32_t nextCorner = next[0] == center ? 0 : next[1] == center ? 1 : 2;
+
+                last = next[(nextCorner + 2) % 3];
+                fan.push_back(last);
+                fanTriangles.push_back(nextTriangle);
+                fanStamp[nextTriangle] = stamp;
+            }
+
+            if (fanTriangles.size() > bestFanTriangles.size()) {
+                std::swap(bestFan, fan);
+                std::swap(bestFanTriangles, fanTriangles);
+            }
+        }
+
+        for (const uint32_t fanTriangle : bestFanTriangles) {
+            used[fanTriangle] = true;
+        }
+
+        SPendingPrimitive& pending = primitives.emplace_back();
+        pending.mPrimitiveType = EGXPrimitiveType::TriangleFan;
+        pending.mIndices = bestFan;
+    }
+
+    MergeSmallPrimitives(primitives);
+}
+
+void CPrimitiveOptimizer::MergeSmallPrimitives(std::vector<SPendingPrimitive>& primitives) {
+    std::vector<SPendingPrimitive> merged;
+    SPendingPrimitive list;
+    list.mPrimitiveType = EGXPrimitiveType::Triangles;
+
+    for (SPendingPrimitive& prim : primitives) {
+        if (prim.mPrimitiveType == EGXPrimitiveType::Triangles || prim.mIndices.size() == 3) {
+            list.mIndices.insert(list.mIndices.end(), prim.mIndices.begin(), prim.mIndices.end());
+            continue;
+        }
+
+        merged.push_back(std::move(prim));
+    }
+
+    if (list.mIndices.size() != 0) {
+        merged.push_back(std::move(list));
+    }
+
+    primitives = std::move(merged);
+}
+
+size_t CPrimitiveOptimizer::MeasureDisplayListSize(const std::vector<SPendingPrimitive>& primitives) const {
+    size_t size = 0;
+
+    for (const SPendingPrimitive& prim : primitives) {
+        // Empty primitives aren't written at all
+        if (prim.mIndices.size() == 0) {
+            continue;
+        }
+
+        if (prim.mIndices.size() <= MAX_PRIMITIVE_VERTEX_COUNT) {
+            size += PRIMITIVE_HEADER_SIZE + prim.mIndices.size() * mVertexSize;
+            continue;
+        }
+
+        // Each piece is its own draw command, and strips and fans repeat the vertices the pieces share
+        size_t pieceCount = 0;
+        size_t pieceVertexCount = 0;
+        MeasureSplitPrimitive(prim.mPrimitiveType, prim.mIndices.size(), MAX_PRIMITIVE_VERTEX_COUNT, pieceCount, pieceVertexCount);
+
+        size += pieceCount * PRIMITIVE_HEADER_SIZE + pieceVertexCount * mVertexSize;
+    }
+
+    return size;
+}
+
+size_t CPrimitiveOptimizer::SimulateCacheMisses(const std::vector<SPendingPrimitive>& primitives) const {
+    if (mSettings.SimulatedCacheSize == 0) {
+        return 0;
+    }
+
+    std::vector<uint32_t> cache(mSettings.SimulatedCacheSize, UINT32_MAX);
+    size_t cacheHead = 0;
+    size_t misses = 0;
+
+    for (const SPendingPrimitive& prim : primitives) {
+        for (const uint32_t index : prim.mIndices) {
+            if (std::find(cache.begin(), cache.end(), index) != cache.end()) {
+                continue;
+            }
+
+            // First in, first out; hits don't refresh an entry.
+            cache[cacheHead] = index;
+            cacheHead = (cacheHead + 1) % cache.size();
+            misses++;
+        }
+    }
+
+    return misses;
+}
+
+void CPrimitiveOptimizer::Optimize(const std::vector<uint32_t>& triangles, std::vector<SPendingPrimitive>& primitives) {
+    if (triangles.size() < 3) {
+        return;
+    }
+
+    std::vector<std::vector<SPendingPrimitive>> candidates;
+
+    BuildList(triangles, candidates.emplace_back());
+
+    bool bUseLinearStripifier = mSettings.Stripifier == EStripifier::Linear ||
+        (mSettings.Stripifier == EStripifier::Auto && triangles.size() / 3 >= mSettings.LinearStripifierThreshold);
+
+    if (bUseLinearStripifier) {
+        BuildLinearStrips(triangles, 2, candidates.emplace_back());
+
+        if (mSettings.ResidualMinStripSize > 2) {
+            BuildLinearStrips(triangles, mSettings.ResidualMinStripSize, candidates.emplace_back());
+        }
+    }
+    else {
+        for (const uint32_t cacheSize : mSettings.StripCacheSizes) {
+            BuildStrips(triangles, cacheSize, 2, candidates.emplace_back());
+
+            if (mSettings.ResidualMinStripSize > 2) {
+                BuildStrips(triangles, cacheSize, mSettings.ResidualMinStripSize, candidates.emplace_back());
+            }
+        }
+    }
+
+    BuildFans(triangles, candidates.emplace_back());
+
+    // Sizes and misses are scored relative to the plain list, so the weight means the same thing for every shape.
+    float sizeWeight = std::clamp(mSettings.SizeWeight, 0.0f, 1.0f);
+    float baseSize = static_cast<float>(std::max<size_t>(MeasureDisplayListSize(candidates[0]), 1));
+    float baseMisses = static_cast<float>(std::max<size_t>(SimulateCacheMisses(candidates[0]), 1));
+
+    size_t bestCandidate = 0;
+    float bestScore = 0.0f;
+
+    for (size_t i = 0; i < candidates.size(); i++) {
+        float size = static_cast<float>(MeasureDisplayListSize(candidates[i])) / baseSize;
+        float misses = static_cast<float>(SimulateCacheMisses(candidates[i])) / baseMisses;
+        float score = sizeWeight * size + (1.0f - sizeWeight) * misses;
+
+        if (i == 0 || score < bestScore) {
+            bestCandidate = i;
+            bestScore = score;
+        }
+    }
+
+    primitives.insert(primitives.end(), candidates[bestCandidate].begin(), candidates[bestCandidate].end());
+}
@@ -1,13 +1,40 @@
 #include "shape.hpp"
 #include "vertex.hpp"
+#include "accessor.hpp"
+#include "bounds.hpp"
+#include "util.hpp"
 
 #include <tiny_gltf.h>
 #include <bstream.h>
-#include <tri_stripper.h>
 #include <glm/ext.hpp>
 #include <glm/geometric.hpp>
 
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <numeric>
+
+// Shape matrix types in SHP1. Multi-matrix shapes select a matrix per vertex with PNMTXIDX.
+const uint8_t SHAPE_MATRIX_TYPE_SINGLE = 0;
+const uint8_t SHAPE_MATRIX_TYPE_MULTI = 3;
+
+// The order GX expects vertex attributes in, both in the descriptor and in the display list.
+// NBT takes the place of Normal for shapes that use it.
+const std::vector<EGXAttribute> DISPLAY_LIST_ATTRIBUTE_ORDER = {
+    EGXAttribute::PositionMatrixIdx,
+    EGXAttribute::Position,
+    EGXAttribute::Normal,
+    EGXAttribute::Color0,
+    EGXAttribute::Color1,
+    EGXAttribute::TexCoord0,
+    EGXAttribute::TexCoord1,
+    EGXAttribute::TexCoord2,
+    EGXAttribute::TexCoord3,
+    EGXAttribute::TexCoord4,
+    EGXAttribute::TexCoord5,
+    EGXAttribute::TexCoord6,
+    EGXAttribute::TexCoord7,
+};
 
 const std::vector<std::string> VERTEX_ATTRIBUTE_NAMES = {
     "POSITION",
@@ -41,27 +68,566 @@ CShape::~CShape() {
     mPrimitives.clear();
 }
 
-void CShape::CalculateBoundingVolume(const std::vector<glm::vec4>& positions) {
-    for (const glm::vec4& p : positions) {
-        if (p.x > mBounds.BoundingBoxMax.x) {
-            mBounds.BoundingBoxMax.x = p.x;
+void CShape::CalculateBoundingVolume(const SAttributeArray& positions, const std::vector<uint32_t>& indices) {
+    mBounds = Util::UConvBoundingVolume();
+
+    // Gather each position the shape uses once, no matter how many primitives share it
+    std::vector<bool> bGathered(positions.Size(), false);
+    std::vector<glm::vec4> points;
+
+    for (const uint32_t i : indices) {
+        if (i >= positions.Size() || bGathered[i]) {
+            continue;
+        }
+
+        const float* position = positions.Get(i);
+        points.push_back(glm::vec4(position[0], position[1], position[2], 0.0f));
+        bGathered[i] = true;
+    }
+
+    if (points.size() == 0) {
+        mBounds.BoundingBoxMin = glm::zero<glm::vec3>();
+        mBounds.BoundingBoxMax = glm::zero<glm::vec3>();
+        mBounds.BoundingSphereRadius = 0.0f;
+        return;
+    }
+
+    float maxLengthSquared = 0.0f;
+    Bounds::ExpandBox(points.data(), points.size(), mBounds.BoundingBoxMin, mBounds.BoundingBoxMax, maxLengthSquared);
+
+    // SHP1 only has room for a radius, so the sphere has to be centered on the box. Measuring out to the farthest
+    // position, rather than to a corner of the box, gives the smallest sphere that's possible around that center.
+    glm::vec3 center = (mBounds.BoundingBoxMin + mBounds.BoundingBoxMax) * 0.5f;
+    mBounds.BoundingSphereRadius = std::sqrt(Bounds::MaxDistanceSquared(points.data(), points.size(), center));
+}
+
+void CShape::CalculateBoundingVolume(const SAttributeArray& positions) {
+    std::vector<uint32_t> indices;
+    indices.reserve(mVertexPool.GetVertexCount());
+
+    for (uint32_t v = 0; v < mVertexPool.GetVertexCount(); v++) {
+        uint16_t positionIndex = mVertexPool.GetIndex(EGXAttribute::Position, v);
+
+        if (positionIndex != UINT16_MAX) {
+            indices.push_back(positionIndex);
+        }
+    }
+
+    CalculateBoundingVolume(positions, indices);
+}
+
+bool CShape::CanMerge(const CShape& other) const {
+    if (mMaterialIndex != other.mMaterialIndex || mDrawMatrixIndex != other.mDrawMatrixIndex) {
+        return false;
+    }
+
+    // The index types can differ, since the merged shape picks its own
+    if (mVertexDescriptor.size() != other.mVertexDescriptor.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < mVertexDescriptor.size(); i++) {
+        if (mVertexDescriptor[i].mAttribute != other.mVertexDescriptor[i].mAttribute) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void CShape::Merge(const CShape& other) {
+    uint32_t vertexOffset = mVertexPool.GetVertexCount();
+    mVertexPool.Append(other.mVertexPool);
+
+    for (const auto& otherPrim : other.mPrimitives) {
+        std::shared_ptr<SPrimitive> prim = std::make_shared<SPrimitive>();
+        prim->mPrimitiveType = otherPrim->mPrimitiveType;
+        prim->mVertices.reserve(otherPrim->mVertices.size());
+
+        for (const uint32_t v : otherPrim->mVertices) {
+            prim->mVertices.push_back(v + vertexOffset);
+        }
+
+        mPrimitives.push_back(prim);
+    }
+}
+
+void CShape::BuildVertexDescriptor() {
+    mVertexDescriptor.clear();
+    mMatrixType = SHAPE_MATRIX_TYPE_SINGLE;
+
+    bool useNBT = mVertexPool.GetVertexCount() != 0 && mVertexPool.GetUseNBT(0);
+
+    for (const EGXAttribute attribute : DISPLAY_LIST_ATTRIBUTE_ORDER) {
+        const std::vector<uint16_t>* indices = mVertexPool.GetIndexArray(attribute);
+        if (indices == nullptr) {
+            continue;
+        }
+
+        uint16_t maxIndex = 0;
+        bool bUsed = false, bHasUnsetIndex = false;
+
+        for (const uint16_t index : *indices) {
+            if (index == UINT16_MAX) {
+                bHasUnsetIndex = true;
+                continue;
+            }
+
+            bUsed = true;
+            maxIndex = std::max(maxIndex, index);
+        }
+
+        // Attributes that no vertex in the shape uses are left out of the descriptor entirely.
+        if (!bUsed) {
+            continue;
+        }
+
+        SVertexDescriptorEntry entry;
+        entry.mAttribute = attribute;
+
+        // Position matrix indices are sent directly, and mean the shape draws with several matrices.
+        if (attribute == EGXAttribute::PositionMatrixIdx) {
+            entry.mIndexType = EGXAttributeIndexType::Direct;
+            mMatrixType = SHAPE_MATRIX_TYPE_MULTI;
+        }
+        // 8-bit indices are only used when every index fits below 0xFF, since GX treats all bits set as a null index.
+        else {
+            entry.mIndexType = maxIndex < UINT8_MAX && !bHasUnsetIndex ? EGXAttributeIndexType::Index8 : EGXAttributeIndexType::Index16;
+        }
+
+        if (attribute == EGXAttribute::Normal && useNBT) {
+            entry.mAttribute = EGXAttribute::NBT;
+        }
+
+        mVertexDescriptor.push_back(entry);
+    }
+}
+
+uint32_t CShape::GetDisplayListVertexSize() const {
+    uint32_t size = 0;
+
+    for (const SVertexDescriptorEntry& entry : mVertexDescriptor) {
+        size += entry.mIndexType == EGXAttributeIndexType::Index16 ? 2 : 1;
+    }
+
+    return size;
+}
+
+void CShape::OptimizePrimitives(shared_vector<SPrimitive>& primitives, const SPrimitiveSettings& settings) const {
+    shared_vector<SPrimitive> optimized;
+    std::vector<uint32_t> triangles;
+
+    // Every triangle list is optimized together; other primitives are kept as they are.
+    for (const auto& prim : primitives) {
+        if (prim->mPrimitiveType == EGXPrimitiveType::Triangles) {
+            triangles.insert(triangles.end(), prim->mVertices.begin(), prim->mVertices.end());
+        }
+        else {
+            optimized.push_back(prim);
+        }
+    }
+
+    if (triangles.size() == 0) {
+        return;
+    }
+
+    std::vector<SPendingPrimitive> encoded;
+    CPrimitiveOptimizer optimizer(settings, GetDisplayListVertexSize());
+    optimizer.Optimize(triangles, encoded);
+
+    for (SPendingPrimitive& pending : encoded) {
+        std::shared_ptr<SPrimitive> prim = std::make_shared<SPrimitive>();
+        prim->mPrimitiveType = pending.mPrimitiveType;
+        prim->mVertices = std::move(pending.mIndices);
+
+        optimized.push_back(prim);
+    }
+
+    primitives = std::move(optimized);
+}
+
+void CShape::PartitionPackets() {
+    // Break every primitive down into independent triangles, lines and points, which can go in any packet.
+    std::vector<EGXPrimitiveType> elementTypes;
+    std::vector<uint32_t> elementStarts;
+    std::vector<uint32_t> elementVertices;
+
+    auto pushElement = [&](EGXPrimitiveType type, std::initializer_list<uint32_t> vertices) {
+        elementTypes.push_back(type);
+        elementStarts.push_back(static_cast<uint32_t>(elementVertices.size()));
+        elementVertices.insert(elementVertices.end(), vertices);
+    };
+
+    for (const auto& prim : mPrimitives) {
+        const std::vector<uint32_t>& v = prim->mVertices;
+
+        switch (prim->mPrimitiveType) {
+            case EGXPrimitiveType::Triangles:
+                for (size_t i = 0; i + 2 < v.size(); i += 3) {
+                    pushElement(EGXPrimitiveType::Triangles, { v[i], v[i + 1], v[i + 2] });
+                }
+                break;
+            case EGXPrimitiveType::TriangleStrips:
+                for (size_t i = 0; i + 2 < v.size(); i++) {
+                    if (i % 2 == 0) {
+                        pushElement(EGXPrimitiveType::Triangles, { v[i], v[i + 1], v[i + 2] });
+                    }
+                    else {
+                        pushElement(EGXPrimitiveType::Triangles, { v[i + 1], v[i], v[i + 2] });
+                    }
+                }
+                break;
+            case EGXPrimitiveType::TriangleFan:
+                for (size_t i = 1; i + 1 < v.size(); i++) {
+                    pushElement(EGXPrimitiveType::Triangles, { v[0], v[i], v[i + 1] });
+                }
+                break;
+            case EGXPrimitiveType::Lines:
+                for (size_t i = 0; i + 1 < v.size(); i += 2) {
+                    pushElement(EGXPrimitiveType::Lines, { v[i], v[i + 1] });
+                }
+                break;
+            case EGXPrimitiveType::LineStrips:
+                for (size_t i = 0; i + 1 < v.size(); i++) {
+                    pushElement(EGXPrimitiveType::Lines, { v[i], v[i + 1] });
+                }
+                break;
+            case EGXPrimitiveType::Points:
+                for (size_t i = 0; i < v.size(); i++) {
+                    pushElement(EGXPrimitiveType::Points, { v[i] });
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    elementStarts.push_back(static_cast<uint32_t>(elementVertices.size()));
+    uint32_t elementCount = static_cast<uint32_t>(elementTypes.size());
+
+    // The distinct draw matrices each element uses
+    std::vector<std::array<uint16_t, 3>> elementMatrices(elementCount);
+    std::vector<uint8_t> elementMatrixCounts(elementCount, 0);
+    uint32_t matrixCount = 0;
+
+    for (uint32_t e = 0; e < elementCount; e++) {
+        for (uint32_t i = elementStarts[e]; i < elementStarts[e + 1]; i++) {
+            uint16_t matrix = mVertexPool.GetPosMatrixIndex(elementVertices[i]);
+
+            auto matricesEnd = elementMatrices[e].begin() + elementMatrixCounts[e];
+            if (std::find(elementMatrices[e].begin(), matricesEnd, matrix) == matricesEnd) {
+                elementMatrices[e][elementMatrixCounts[e]++] = matrix;
+                matrixCount = std::max<uint32_t>(matrixCount, matrix + 1);
+            }
+        }
+    }
+
+    // The elements that use each matrix, stored back to back. Assigned elements are swapped to the front
+    // of their matrix's range as they're found, so later packets don't step over them again.
+    std::vector<uint32_t> matrixElementStart(matrixCount + 1, 0);
+    std::vector<uint32_t> matrixLiveStart;
+    std::vector<uint32_t> matrixElements;
+
+    for (uint32_t e = 0; e < elementCount; e++) {
+        for (uint32_t i = 0; i < elementMatrixCounts[e]; i++) {
+            matrixElementStart[elementMatrices[e][i] + 1]++;
+        }
+    }
+
+    for (uint32_t m = 0; m < matrixCount; m++) {
+        matrixElementStart[m + 1] += matrixElementStart[m];
+    }
+
+    matrixLiveStart.assign(matrixElementStart.begin(), matrixElementStart.end() - 1);
+    matrixElements.resize(matrixElementStart[matrixCount]);
+
+    for (uint32_t e = 0; e < elementCount; e++) {
+        for (uint32_t i = 0; i < elementMatrixCounts[e]; i++) {
+            matrixElements[matrixLiveStart[elementMatrices[e][i]]++] = e;
+        }
+    }
+
+    matrixLiveStart.assign(matrixElementStart.begin(), matrixElementStart.end() - 1);
+
+    std::vector<uint8_t> assigned(elementCount, 0);
+    // How many of each element's matrices the current packet is missing, valid when its stamp matches the packet
+    std::vector<uint8_t> missing(elementCount, 0);
+    std::vector<uint32_t> missingStamp(elementCount, UINT32_MAX);
+    // Which packet last added each matrix
+    std::vector<uint32_t> matrixStamp(matrixCount, UINT32_MAX);
+
+    std::vector<uint16_t> packetMatrices;
+    std::vector<uint32_t> packetElements;
+    // Elements that share a matrix with the packet, by how many more matrices they'd need. Entries go stale
+    // as the counts drop, and are checked against the current count when they come out.
+    std::array<std::vector<uint32_t>, 3> candidates;
+
+    std::vector<uint16_t> slotMatrices(MAX_PACKET_MATRIX_COUNT, UINT16_MAX);
+    uint32_t packetIndex = 0;
+    uint32_t cursor = 0;
+
+    mPackets.clear();
+
+    auto getMissing = [&](uint32_t e) -> uint8_t {
+        if (missingStamp[e] != packetIndex) {
+            missingStamp[e] = packetIndex;
+            missing[e] = 0;
+
+            for (uint32_t i = 0; i < elementMatrixCounts[e]; i++) {
+                missing[e] += matrixStamp[elementMatrices[e][i]] != packetIndex;
+            }
+        }
+
+        return missing[e];
+    };
+
+    auto addMatrix = [&](uint16_t matrix) {
+        packetMatrices.push_back(matrix);
+        matrixStamp[matrix] = packetIndex;
+
+        uint32_t& live = matrixLiveStart[matrix];
+        for (uint32_t i = live; i < matrixElementStart[matrix + 1]; i++) {
+            uint32_t e = matrixElements[i];
+
+            if (assigned[e]) {
+                std::swap(matrixElements[i], matrixElements[live]);
+                live++;
+                continue;
+            }
+
+            // Counts computed before this matrix was added are one too high
+            if (missingStamp[e] == packetIndex) {
+                missing[e]--;
+            }
+
+            candidates[getMissing(e)].push_back(e);
+        }
+    };
+
+    auto addElement = [&](uint32_t e) {
+        for (uint32_t i = 0; i < elementMatrixCounts[e]; i++) {
+            if (matrixStamp[elementMatrices[e][i]] != packetIndex) {
+                addMatrix(elementMatrices[e][i]);
+            }
+        }
+
+        assigned[e] = 1;
+        packetElements.push_back(e);
+    };
+
+    while (true) {
+        while (cursor < elementCount && assigned[cursor]) {
+            cursor++;
+        }
+
+        if (cursor == elementCount) {
+            break;
+        }
+
+        packetMatrices.clear();
+        packetElements.clear();
+        for (auto& bucket : candidates) {
+            bucket.clear();
+        }
+
+        // Start next to the previous packet when possible, so more of its matrices can stay loaded.
+        uint32_t seed = cursor;
+
+        for (size_t slot = 0; slot < slotMatrices.size() && seed == cursor; slot++) {
+            uint16_t matrix = slotMatrices[slot];
+            if (matrix == UINT16_MAX) {
+                continue;
+            }
+
+            uint32_t& live = matrixLiveStart[matrix];
+            while (live < matrixElementStart[matrix + 1] && assigned[matrixElements[live]]) {
+                live++;
+            }
+
+            if (live < matrixElementStart[matrix + 1]) {
+                seed = matrixElements[live];
+            }
+        }
+
+        // Grow the packet greedily, always taking the element that needs the fewest new matrices. Free elements,
+        // whose matrices are all loaded already, are taken before anything that would use up a slot.
+        addElement(seed);
+
+        while (true) {
+            uint32_t next = UINT32_MAX;
+
+            for (uint32_t needed = 0; needed < candidates.size() && next == UINT32_MAX; needed++) {
+                auto& bucket = candidates[needed];
+
+                while (!bucket.empty()) {
+                    uint32_t e = bucket.back();
+                    bucket.pop_back();
+
+                    if (assigned[e] || getMissing(e) != needed) {
+                        continue;
+                    }
+
+                    if (packetMatrices.size() + needed > MAX_PACKET_MATRIX_COUNT) {
+                        continue;
+                    }
+
+                    next = e;
+                    break;
+                }
+            }
+
+            // Nothing connected fits, so try the next element in the original order before giving up on the packet.
+            if (next == UINT32_MAX) {
+                while (cursor < elementCount && assigned[cursor]) {
+                    cursor++;
+                }
+
+                if (cursor < elementCount && packetMatrices.size() + getMissing(cursor) <= MAX_PACKET_MATRIX_COUNT) {
+                    next = cursor;
+                }
+            }
+
+            if (next == UINT32_MAX) {
+                break;
+            }
+
+            addElement(next);
+        }
+
+        // Matrices the previous packet already loaded stay in their slots, and the rest take slots no longer needed.
+        SShapePacket& packet = mPackets.emplace_back();
+        packet.mMatrixTable.assign(MAX_PACKET_MATRIX_COUNT, UINT16_MAX);
+
+        std::vector<bool> slotUsed(MAX_PACKET_MATRIX_COUNT, false);
+        std::vector<uint16_t> newMatrices;
+
+        for (const uint16_t matrix : packetMatrices) {
+            auto slotItr = std::find(slotMatrices.begin(), slotMatrices.end(), matrix);
+
+            if (slotItr != slotMatrices.end()) {
+                slotUsed[slotItr - slotMatrices.begin()] = true;
+            }
+            else {
+                newMatrices.push_back(matrix);
+            }
+        }
+
+        size_t slot = 0;
+        for (const uint16_t matrix : newMatrices) {
+            while (slotUsed[slot]) {
+                slot++;
+            }
+
+            slotMatrices[slot] = matrix;
+            slotUsed[slot] = true;
+            packet.mMatrixTable[slot] = matrix;
+        }
+
+        size_t slotCount = MAX_PACKET_MATRIX_COUNT;
+        while (slotCount > 0 && !slotUsed[slotCount - 1]) {
+            slotCount--;
+        }
+
+        packet.mMatrixTable.resize(slotCount);
+        packet.mSlotMatrices = slotMatrices;
+
+        // Rebuild the packet's primitives from its elements. Triangles are re-encoded afterwards.
+        std::shared_ptr<SPrimitive> lists[3];
+        const EGXPrimitiveType listTypes[3] = { EGXPrimitiveType::Triangles, EGXPrimitiveType::Lines, EGXPrimitiveType::Points };
+
+        for (const uint32_t e : packetElements) {
+            size_t listIndex = std::find(listTypes, listTypes + 3, elementTypes[e]) - listTypes;
+
+            if (lists[listIndex] == nullptr) {
+                lists[listIndex] = std::make_shared<SPrimitive>();
+                lists[listIndex]->mPrimitiveType = listTypes[listIndex];
+                packet.mPrimitives.push_back(lists[listIndex]);
+            }
+
+            lists[listIndex]->mVertices.insert(lists[listIndex]->mVertices.end(),
+                elementVertices.begin() + elementStarts[e], elementVertices.begin() + elementStarts[e + 1]);
+        }
+
+        packetIndex++;
+    }
+}
+
+void CShape::BuildPackets(const SPrimitiveSettings& settings) {
+    BuildVertexDescriptor();
+    mPackets.clear();
+
+    if (mMatrixType == SHAPE_MATRIX_TYPE_MULTI) {
+        PartitionPackets();
+    }
+
+    // Single-matrix shapes draw everything in one packet, with the shape's own matrix.
+    if (mPackets.size() == 0) {
+        SShapePacket& packet = mPackets.emplace_back();
+        packet.mPrimitives = mPrimitives;
+
+        if (mDrawMatrixIndex != UINT16_MAX) {
+            packet.mSlotMatrices = { mDrawMatrixIndex };
+            packet.mMatrixTable = { mDrawMatrixIndex };
         }
-        if (p.x < mBounds.BoundingBoxMin.x) {
-            mBounds.BoundingBoxMin.x = p.x;
+    }
+
+    for (SShapePacket& packet : mPackets) {
+        OptimizePrimitives(packet.mPrimitives, settings);
+    }
+}
+
+void CShape::WritePrimitive(bStream::CStream& stream, const SShapePacket& packet, EGXPrimitiveType primitiveType, const uint32_t* vertices, size_t vertexCount) const {
+    stream.writeUInt8(static_cast<uint8_t>(primitiveType));
+    stream.writeUInt16(static_cast<uint16_t>(vertexCount));
+
+    for (size_t i = 0; i < vertexCount; i++) {
+        uint32_t vertex = vertices[i];
+
+        for (const SVertexDescriptorEntry& entry : mVertexDescriptor) {
+            if (entry.mAttribute == EGXAttribute::PositionMatrixIdx) {
+                // Vertices select the packet slot holding their draw matrix. Slots address the matrix memory
+                // in rows, three per matrix.
+                const auto& slots = packet.mSlotMatrices;
+                size_t slot = std::find(slots.begin(), slots.end(), mVertexPool.GetPosMatrixIndex(vertex)) - slots.begin();
+
+                stream.writeUInt8(static_cast<uint8_t>(slot * 3));
+                continue;
+            }
+
+            uint16_t index = mVertexPool.GetIndex(entry.mAttribute, vertex);
+
+            if (entry.mIndexType == EGXAttributeIndexType::Index8) {
+                stream.writeUInt8(static_cast<uint8_t>(index));
+            }
+            else {
+                stream.writeUInt16(index);
+            }
         }
+    }
+}
 
-        if (p.y > mBounds.BoundingBoxMax.y) {
-            mBounds.BoundingBoxMax.y = p.y;
+void CShape::WriteDisplayList(bStream::CStream& stream, const SShapePacket& packet) const {
+    for (const auto& prim : packet.mPrimitives) {
+        const std::vector<uint32_t>& vertices = prim->mVertices;
+        if (vertices.size() == 0) {
+            continue;
         }
-        if (p.y < mBounds.BoundingBoxMin.y) {
-            mBounds.BoundingBoxMin.y = p.y;
+
+        if (vertices.size() <= MAX_PRIMITIVE_VERTEX_COUNT) {
+            WritePrimitive(stream, packet, prim->mPrimitiveType, vertices.data(), vertices.size());
+            continue;
         }
 
-        if (p.z > mBounds.BoundingBoxMax.z) {
-            mBounds.BoundingBoxMax.z = p.z;
+        std::vector<std::vector<uint32_t>> pieces;
+        SplitPrimitive(prim->mPrimitiveType, vertices, MAX_PRIMITIVE_VERTEX_COUNT, pieces);
+
+        if (pieces.size() == 0) {
+            std::cout << "Shape " << mIndex << " has a primitive with " << vertices.size() << " vertices, more than a display list can draw at once! It will be skipped." << std::endl;
+            continue;
         }
-        if (p.z < mBounds.BoundingBoxMin.z) {
-            mBounds.BoundingBoxMin.z = p.z;
+
+        for (const std::vector<uint32_t>& piece : pieces) {
+            WritePrimitive(stream, packet, prim->mPrimitiveType, piece.data(), piece.size());
         }
     }
 }
@@ -120,209 +686,426 @@ EGXAttribute GetVertexAttributeFromType(const std::string& type) {
     return EGXAttribute::Null;
 }
 
+EGXPrimitiveType GetPrimitiveTypeFromMode(int mode) {
+    switch (mode) {
+        case TINYGLTF_MODE_POINTS:
+            return EGXPrimitiveType::Points;
+        case TINYGLTF_MODE_LINE:
+            return EGXPrimitiveType::Lines;
+        // Line loops are drawn as line strips that end where they started.
+        case TINYGLTF_MODE_LINE_LOOP:
+        case TINYGLTF_MODE_LINE_STRIP:
+            return EGXPrimitiveType::LineStrips;
+        case TINYGLTF_MODE_TRIANGLES:
+            return EGXPrimitiveType::Triangles;
+        case TINYGLTF_MODE_TRIANGLE_STRIP:
+            return EGXPrimitiveType::TriangleStrips;
+        case TINYGLTF_MODE_TRIANGLE_FAN:
+            return EGXPrimitiveType::TriangleFan;
+        default:
+            return EGXPrimitiveType::None;
+    }
+}
+
 void CShapeData::ReadGltfVertexAttribute(
     const tinygltf::Model* model,
     std::vector<bStream::CMemoryStream>& buffers,
     uint32_t attributeAccessorIndex,
     std::vector<glm::vec4>& values
 ) {
-    const auto& accessor = model->accessors[attributeAccessorIndex];
-    const auto& view = model->bufferViews[accessor.bufferView];
+    if (!Accessor::ReadVec4(model, buffers, attributeAccessorIndex, values)) {
+        std::cout << "Unable to read vertex attribute accessor " << attributeAccessorIndex << "!" << std::endl;
+    }
+}
 
-    int32_t numComponents = tinygltf::GetNumComponentsInType(accessor.type);
-    if (numComponents == -1) {
-        return;
+void CShapeData::ReadGltfVertexAttribute(
+    const tinygltf::Model* model,
+    std::vector<bStream::CMemoryStream>& buffers,
+    uint32_t attributeAccessorIndex,
+    SAttributeArray& values
+) {
+    if (!Accessor::ReadFloats(model, buffers, attributeAccessorIndex, values.ComponentCount, values.Values)) {
+        std::cout << "Unable to read vertex attribute accessor " << attributeAccessorIndex << "!" << std::endl;
     }
+}
 
-    auto& attributeStream = buffers[view.buffer];
-    attributeStream.seek(view.byteOffset);
+void CShapeData::ReadGltfIndices(
+    const tinygltf::Model* model,
+    std::vector<bStream::CMemoryStream>& buffers,
+    uint32_t indexAccessorIndex,
+    std::vector<uint32_t>& indices
+) {
+    if (!Accessor::ReadIndices(model, buffers, indexAccessorIndex, indices)) {
+        std::cout << "Unable to read index accessor " << indexAccessorIndex << "!" << std::endl;
+    }
+}
 
-    for (uint32_t i = 0; i < accessor.count; i++) {
-        glm::vec4 value = glm::zero<glm::vec4>();
+void CShapeData::DecodePrimitive(
+    const tinygltf::Model* model,
+    std::vector<bStream::CMemoryStream>& buffers,
+    const tinygltf::Mesh& mesh,
+    const tinygltf::Primitive& prim,
+    SDecodedPrimitive& decoded
+) {
+    EGXPrimitiveType primitiveType = GetPrimitiveTypeFromMode(prim.mode);
+    if (primitiveType == EGXPrimitiveType::None) {
+        std::cout << "Primitive in mesh \'" << mesh.name << "\' uses unknown mode " << prim.mode << ", and will be skipped." << std::endl;
+        return;
+    }
 
-        for (uint32_t j = 0; j < numComponents; j++) {
-            float compValue = 0;
+    auto& primitiveAttributes = decoded.mAttributes;
+    auto& jointIndices = decoded.mJointIndices;
+    auto& weights = decoded.mWeights;
 
-            switch (accessor.componentType) {
-            case TINYGLTF_COMPONENT_TYPE_BYTE:
-                compValue = static_cast<float>(attributeStream.readInt8());
-                break;
-            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
-                compValue = static_cast<float>(attributeStream.readUInt8());
-                break;
-            case TINYGLTF_COMPONENT_TYPE_SHORT:
-                compValue = static_cast<float>(attributeStream.readInt16());
-                break;
-            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
-                compValue = static_cast<float>(attributeStream.readUInt16());
-                break;
-            case TINYGLTF_COMPONENT_TYPE_INT:
-                compValue = static_cast<float>(attributeStream.readInt32());
-                break;
-            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
-                compValue = static_cast<float>(attributeStream.readUInt32());
-                break;
-            case TINYGLTF_COMPONENT_TYPE_FLOAT:
-                compValue = static_cast<float>(attributeStream.readFloat());
-                break;
-            default:
-                break;
+    // Read vertex attributes
+    for (const auto& [name, index] : prim.attributes) {
+        // Vertex attributes
+        if (std::find(VERTEX_ATTRIBUTE_NAMES.begin(), VERTEX_ATTRIBUTE_NAMES.end(), name) != VERTEX_ATTRIBUTE_NAMES.end()) {
+            EGXAttribute attribute = GetVertexAttributeFromType(name);
+            if (attribute == EGXAttribute::Null) {
+                continue;
             }
 
-            value[j] = compValue;
+            ReadGltfVertexAttribute(model, buffers, prim.attributes.at(name), primitiveAttributes[attribute]);
+        }
+        // Joint indices for skinning
+        else if (name == "JOINTS_0") {
+            ReadGltfVertexAttribute(model, buffers, prim.attributes.at(name), jointIndices);
+        }
+        // Weights for skinning
+        else if (name == "WEIGHTS_0") {
+            ReadGltfVertexAttribute(model, buffers, prim.attributes.at(name), weights);
+        }
+        else {
+            std::cout << "Unknown glTF attribute \'" << name << "\'!" << std::endl;
         }
-
-        values.push_back(value);
     }
-}
 
-void CShapeData::ReadGltfIndices(
-    const tinygltf::Model* model,
-    std::vector<bStream::CMemoryStream>& buffers,
-    uint32_t indexAccessorIndex,
-    std::vector<uint16_t>& indices
-) {
-    const auto& indicesAccessor = model->accessors[indexAccessorIndex];
-    const auto& indicesView = model->bufferViews[indicesAccessor.bufferView];
+    const auto& positions = primitiveAttributes[EGXAttribute::Position];
+    uint32_t vertexCount = static_cast<uint32_t>(positions.Size());
 
-    auto& indicesStream = buffers[indicesView.buffer];
-    indicesStream.seek(indicesView.byteOffset);
+    // Read vertex indices, or make our own if the primitive doesn't have any
+    std::vector<uint32_t> rawIndices;
 
-    for (uint32_t i = 0; i < indicesAccessor.count; i++) {
-        uint16_t index = UINT32_MAX;
+    if (prim.indices >= 0) {
+        ReadGltfIndices(model, buffers, prim.indices, rawIndices);
+    }
+    else {
+        rawIndices.resize(vertexCount);
+        std::iota(rawIndices.begin(), rawIndices.end(), 0);
+    }
 
-        switch (indicesAccessor.componentType) {
-        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
-            index = static_cast<uint16_t>(indicesStream.readUInt8());
+    // Drop indices that point outside of the vertex data, rather than reading garbage later
+    auto invalidItr = std::remove_if(rawIndices.begin(), rawIndices.end(), [&](uint32_t i) { return i >= vertexCount; });
+    if (invalidItr != rawIndices.end()) {
+        std::cout << "Primitive in mesh \'" << mesh.name << "\' has " << (rawIndices.end() - invalidItr)
+            << " out-of-range indices, which will be ignored." << std::endl;
+        rawIndices.erase(invalidItr, rawIndices.end());
+    }
+
+    if (prim.mode == TINYGLTF_MODE_LINE_LOOP && rawIndices.size() != 0) {
+        rawIndices.push_back(rawIndices[0]);
+    }
+
+    // Drop trailing vertices that don't make up a whole primitive
+    size_t minVertexCount = 1;
+    switch (primitiveType) {
+        case EGXPrimitiveType::Triangles:
+            rawIndices.resize(rawIndices.size() - rawIndices.size() % 3);
+            break;
+        case EGXPrimitiveType::Lines:
+            rawIndices.resize(rawIndices.size() - rawIndices.size() % 2);
             break;
-        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
-            index = static_cast<uint16_t>(indicesStream.readUInt16());
+        case EGXPrimitiveType::TriangleStrips:
+        case EGXPrimitiveType::TriangleFan:
+            minVertexCount = 3;
             break;
-        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
-            index = static_cast<uint16_t>(indicesStream.readUInt32());
+        case EGXPrimitiveType::LineStrips:
+            minVertexCount = 2;
             break;
         default:
             break;
+    }
+
+    if (rawIndices.size() < minVertexCount) {
+        return;
+    }
+
+    // If there is skinning info, analyze it to see which joint this shape belongs to.
+    uint32_t jointIndex = UINT32_MAX;
+
+    if (jointIndices.size() != 0) {
+        for (uint32_t i = 0; i < jointIndices.size(); i++) {
+            if (weights[i][0] < 1.0f) {
+                jointIndex = 0;
+                break;
+            }
+            else {
+                if (jointIndex != UINT32_MAX) {
+                    if (jointIndex != jointIndices[i][0]) {
+                        jointIndex = 0;
+                        break;
+                    }
+                }
+                else {
+                    jointIndex = jointIndices[i][0];
+                }
+            }
         }
+    }
+    // Otherwise, just set its joint index to the root.
+    else {
+        jointIndex = 0;
+    }
+
+    std::shared_ptr<CShape> shape = std::make_shared<CShape>();
+
+    shape->SetMaterialIndex(prim.material);
+    shape->SetMaterialName(model->materials[prim.material].name);
+    shape->SetJointIndex(jointIndex);
+
+    shape->CalculateBoundingVolume(positions, rawIndices);
+
+    decoded.mShape = shape;
+    auto& pendingPrimitives = decoded.mPendingPrimitives;
+
+    // Process index data. Vertex attributes are added to the vertex data arrays later, in order.
+    // Triangle lists are re-encoded by CShape::BuildPackets; everything else is kept as authored.
+    SPendingPrimitive& pending = pendingPrimitives.emplace_back();
+    pending.mPrimitiveType = primitiveType;
+    pending.mIndices = std::move(rawIndices);
+}
 
-        indices.push_back(index);
+void CShapeData::MergePrimitive(SDecodedPrimitive& decoded, CVertexData& vertexData) {
+    std::shared_ptr<CShape> shape = decoded.mShape;
+    if (shape == nullptr) {
+        return;
     }
+
+    shape->SetIndex(static_cast<uint32_t>(mShapes.size()));
+
+    // Maps the primitive's vertices to the shape's pool, so vertices shared between strips are stored once
+    std::vector<uint32_t> poolIndices(decoded.mAttributes[EGXAttribute::Position].Size(), UINT32_MAX);
+
+    for (const SPendingPrimitive& pending : decoded.mPendingPrimitives) {
+        std::shared_ptr<SPrimitive> prim = std::make_shared<SPrimitive>();
+        prim->mPrimitiveType = pending.mPrimitiveType;
+
+        vertexData.BuildConverterPrimitive(decoded.mAttributes, pending.mIndices, decoded.mJointIndices, decoded.mWeights,
+            shape->GetVertexPool(), poolIndices, prim);
+        shape->AddPrimitive(prim);
+    }
+
+    mShapes.push_back(shape);
 }
 
 void CShapeData::BuildVertexData(tinygltf::Model* model, CVertexData& vertexData, std::vector<bStream::CMemoryStream>& buffers) {
+    std::vector<std::pair<const tinygltf::Mesh*, const tinygltf::Primitive*>> primitives;
+
     for (const tinygltf::Mesh& mesh : model->meshes) {
         for (const tinygltf::Primitive& prim : mesh.primitives) {
-            std::shared_ptr<CShape> shape = std::make_shared<CShape>();
-
-            shape->SetIndex(static_cast<uint32_t>(mShapes.size()));
-            shape->SetMaterialIndex(prim.material);
-            shape->SetMaterialName(model->materials[prim.material].name);
-
-            // Read vertex indices
-            std::vector<uint16_t> rawIndices;
-            ReadGltfIndices(model, buffers, prim.indices, rawIndices);
-
-            // Read vertex attributes
-            std::map<EGXAttribute, std::vector<glm::vec4>> primitiveAttributes;
-            std::vector<glm::vec4> jointIndices;
-            std::vector<glm::vec4> weights;
-
-            for (const auto& [name, index] : prim.attributes) {
-                // Vertex attributes
-                if (std::find(VERTEX_ATTRIBUTE_NAMES.begin(), VERTEX_ATTRIBUTE_NAMES.end(), name) != VERTEX_ATTRIBUTE_NAMES.end()) {
-                    EGXAttribute attribute = GetVertexAttributeFromType(name);
-                    if (attribute == EGXAttribute::Null) {
-                        continue;
-                    }
+            primitives.push_back({ &mesh, &prim });
+        }
+    }
 
-                    ReadGltfVertexAttribute(model, buffers, prim.attributes.at(name), primitiveAttributes[attribute]);
-                }
-                // Joint indices for skinning
-                else if (name == "JOINTS_0") {
-                    ReadGltfVertexAttribute(model, buffers, prim.attributes.at(name), jointIndices);
-                }
-                // Weights for skinning
-                else if (name == "WEIGHTS_0") {
-                    ReadGltfVertexAttribute(model, buffers, prim.attributes.at(name), weights);
-                }
-                else {
-                    std::cout << "Unknown glTF attribute \'" << name << "\'!" << std::endl;
-                }
-            }
+    // Decoding is independent for each primitive, so they're spread across threads.
+    // Merging attributes into the shared vertex data happens in the original order, so the output
+    // doesn't depend on the thread count. Primitives are handled in windows to bound how much
+    // decoded data is alive at once.
+    size_t windowSize = std::max<size_t>(Util::GetThreadCount() * 2, 1);
 
-            shape->CalculateBoundingVolume(primitiveAttributes.at(EGXAttribute::Position));
+    for (size_t windowStart = 0; windowStart < primitives.size(); windowStart += windowSize) {
+        size_t windowCount = std::min(windowSize, primitives.size() - windowStart);
+        std::vector<SDecodedPrimitive> decodedPrimitives(windowCount);
 
-            // Process index data and add vertex attributes to the vertex data arrays
-            switch (prim.mode) {
-                case TINYGLTF_MODE_TRIANGLES:
-                {
-                    triangle_stripper::indices indicesToStrip;
-                    for (const uint16_t i : rawIndices) {
-                        indicesToStrip.push_back(static_cast<size_t>(i));
-                    }
+        Util::ParallelFor(windowCount, [&](size_t i) {
+            const auto& [mesh, prim] = primitives[windowStart + i];
+            DecodePrimitive(model, buffers, *mesh, *prim, decodedPrimitives[i]);
+        });
 
-                    triangle_stripper::tri_stripper stripper(indicesToStrip);
+        for (SDecodedPrimitive& decoded : decodedPrimitives) {
+            MergePrimitive(decoded, vertexData);
+        }
+    }
+}
 
-                    triangle_stripper::primitive_vector strippedPrimitives;
-                    stripper.Strip(&strippedPrimitives);
+void CShapeData::BuildPackets() {
+    Util::ParallelFor(mShapes.size(), [&](size_t i) {
+        mShapes[i]->BuildPackets(mPrimitiveSettings);
+    });
+}
 
-                    for (const auto& strip : strippedPrimitives) {
-                        std::shared_ptr<SPrimitive> prim = std::make_shared<SPrimitive>();
-                        prim->mPrimitiveType = EGXPrimitiveType::TriangleStrips;
+void CShapeData::WriteSHP1(bStream::CStream& stream) {
+    size_t streamStartPos = stream.tell();
 
-                        std::vector<uint16_t> strippedIndices;
-                        for (const triangle_stripper::index i : strip.Indices) {
-                            strippedIndices.push_back(static_cast<uint16_t>(i));
-                        }
+    // Shapes with the same vertex descriptor share a single copy of it
+    std::vector<std::vector<SVertexDescriptorEntry>> descriptors;
+    std::vector<uint16_t> descriptorOffsets;
+    std::vector<uint16_t> shapeDescriptors;
 
-                        vertexData.BuildConverterPrimitive(primitiveAttributes, strippedIndices, jointIndices, weights, prim);
-                        shape->AddPrimitive(prim);
-                    }
+    uint16_t nextDescriptorOffset = 0;
 
-                    break;
-                }
-                // TODO: Add handling for other primitive types?
-                default:
-                {
-                    std::shared_ptr<SPrimitive> prim = std::make_shared<SPrimitive>();
-                    prim->mPrimitiveType = EGXPrimitiveType::TriangleStrips;
+    // Descriptors were built along with the packets
+    for (const auto& shape : mShapes) {
+        const auto& descriptorItr = std::find(descriptors.begin(), descriptors.end(), shape->GetVertexDescriptor());
+        if (descriptorItr != descriptors.end()) {
+            shapeDescriptors.push_back(static_cast<uint16_t>(descriptorItr - descriptors.begin()));
+            continue;
+        }
 
-                    vertexData.BuildConverterPrimitive(primitiveAttributes, rawIndices, jointIndices, weights, prim);
-                    shape->AddPrimitive(prim);
+        shapeDescriptors.push_back(static_cast<uint16_t>(descriptors.size()));
+        descriptors.push_back(shape->GetVertexDescriptor());
+        descriptorOffsets.push_back(nextDescriptorOffset);
 
-                    break;
-                }
-            }
+        // Each entry is 8 bytes, plus the null entry that ends the list
+        nextDescriptorOffset += static_cast<uint16_t>((shape->GetVertexDescriptor().size() + 1) * 8);
+    }
 
-            // If there is skinning info, analyze it to see which joint this shape belongs to.
-            uint32_t jointIndex = UINT32_MAX;
+    // Header
+    stream.writeUInt32(0x53485031);     // FourCC ('SHP1')
+    stream.writeUInt32(0);              // Placeholder for section size
+    stream.writeUInt16(mShapes.size()); // Number of shapes
+    stream.writeUInt16(UINT16_MAX);     // Padding
 
-            if (jointIndices.size() != 0) {
-                for (uint32_t i = 0; i < jointIndices.size(); i++) {
-                    if (weights[i][0] < 1.0f) {
-                        jointIndex = 0;
-                        break;
-                    }
-                    else {
-                        if (jointIndex != UINT32_MAX) {
-                            if (jointIndex != jointIndices[i][0]) {
-                                jointIndex = 0;
-                                break;
-                            }
-                        }
-                        else {
-                            jointIndex = jointIndices[i][0];
-                        }
-                    }
-                }
+    // Offsets
+    stream.writeUInt32(0); // Placeholder for shape data offset
+    stream.writeUInt32(0); // Placeholder for remap table offset
+    stream.writeUInt32(0); // Name table offset, unused
+    stream.writeUInt32(0); // Placeholder for vertex descriptor offset
+    stream.writeUInt32(0); // Placeholder for matrix table offset
+    stream.writeUInt32(0); // Placeholder for display list data offset
+    stream.writeUInt32(0); // Placeholder for matrix data offset
+    stream.writeUInt32(0); // Placeholder for packet location offset
+
+    // Write shape data offset
+    Util::WriteOffset(&stream, streamStartPos, 0x0C);
+    // Write shape data. Each packet has one matrix data entry, so both are indexed by the same running count.
+    uint16_t firstPacket = 0;
+
+    for (uint16_t i = 0; i < mShapes.size(); i++) {
+        const std::shared_ptr<CShape> shape = mShapes[i];
+        const Util::UConvBoundingVolume& bounds = shape->GetBounds();
+        uint16_t packetCount = static_cast<uint16_t>(shape->GetPackets().size());
+
+        stream.writeUInt8(shape->GetMatrixType());
+        stream.writeUInt8(UINT8_MAX);
+        stream.writeUInt16(packetCount);                                 // Number of packets
+        stream.writeUInt16(descriptorOffsets[shapeDescriptors[i]]);      // Vertex descriptor offset
+        stream.writeUInt16(firstPacket);                                 // First matrix data index
+        stream.writeUInt16(firstPacket);                                 // First packet index
+        stream.writeUInt16(UINT16_MAX);
+
+        firstPacket += packetCount;
+
+        // Bounding sphere radius
+        stream.writeFloat(bounds.BoundingSphereRadius);
+
+        // Bounding box min
+        stream.writeFloat(bounds.BoundingBoxMin.x);
+        stream.writeFloat(bounds.BoundingBoxMin.y);
+        stream.writeFloat(bounds.BoundingBoxMin.z);
+
+        // Bounding box max
+        stream.writeFloat(bounds.BoundingBoxMax.x);
+        stream.writeFloat(bounds.BoundingBoxMax.y);
+        stream.writeFloat(bounds.BoundingBoxMax.z);
+    }
+
+    // Write remap table offset
+    Util::WriteOffset(&stream, streamStartPos, 0x10);
+    // Write remap table
+    for (uint16_t i = 0; i < mShapes.size(); i++) {
+        stream.writeUInt16(i);
+    }
+
+    Util::PadStreamWithString(&stream, 4);
+
+    // Write vertex descriptor offset
+    Util::WriteOffset(&stream, streamStartPos, 0x18);
+    // Write vertex descriptors
+    for (const auto& descriptor : descriptors) {
+        for (const SVertexDescriptorEntry& entry : descriptor) {
+            stream.writeUInt32(static_cast<uint32_t>(entry.mAttribute));
+            stream.writeUInt32(static_cast<uint32_t>(entry.mIndexType));
+        }
+
+        stream.writeUInt32(static_cast<uint32_t>(EGXAttribute::Null));
+        stream.writeUInt32(static_cast<uint32_t>(EGXAttributeIndexType::None));
+    }
+
+    // Write matrix table offset
+    Util::WriteOffset(&stream, streamStartPos, 0x1C);
+    // Write matrix table. Packets without a table of their own fall back to their shape's joint.
+    std::vector<std::pair<uint16_t, uint32_t>> packetMatrixRanges;
+    uint32_t matrixTableSize = 0;
+
+    for (const auto& shape : mShapes) {
+        for (const SShapePacket& packet : shape->GetPackets()) {
+            packetMatrixRanges.push_back({ static_cast<uint16_t>(std::max<size_t>(packet.mMatrixTable.size(), 1)), matrixTableSize });
+
+            if (packet.mMatrixTable.size() == 0) {
+                stream.writeUInt16(static_cast<uint16_t>(shape->GetJointIndex()));
             }
-            // Otherwise, just set its joint index to the root.
-            else {
-                jointIndex = 0;
+
+            for (const uint16_t matrix : packet.mMatrixTable) {
+                stream.writeUInt16(matrix);
             }
 
-            shape->SetJointIndex(jointIndex);
-            mShapes.push_back(shape);
+            matrixTableSize += packetMatrixRanges.back().first;
         }
     }
+
+    // Display lists are read by the GPU, which needs them aligned to 32 bytes
+    Util::PadStreamWithString(&stream, 32);
+
+    // Write display list data offset
+    Util::WriteOffset(&stream, streamStartPos, 0x20);
+    // Write display lists, padded with GX NOPs
+    size_t displayListStartPos = stream.tell();
+    std::vector<std::pair<uint32_t, uint32_t>> packetLocations;
+
+    for (const auto& shape : mShapes) {
+        for (const SShapePacket& packet : shape->GetPackets()) {
+            size_t packetStartPos = stream.tell();
+
+            shape->WriteDisplayList(stream, packet);
+            Util::PadStreamWithString(&stream, 32, std::string(1, '\0'));
+
+            packetLocations.push_back({
+                static_cast<uint32_t>(stream.tell() - packetStartPos),
+                static_cast<uint32_t>(packetStartPos - displayListStartPos)
+            });
+        }
+    }
+
+    // Write matrix data offset
+    Util::WriteOffset(&stream, streamStartPos, 0x24);
+    // Write matrix data
+    size_t packetIndex = 0;
+
+    for (const auto& shape : mShapes) {
+        for (const SShapePacket& packet : shape->GetPackets()) {
+            const auto& [entryCount, firstEntry] = packetMatrixRanges[packetIndex++];
+
+            // Matrix used when the packet doesn't load its own
+            uint16_t useMatrix = packet.mSlotMatrices.size() != 0 ? packet.mSlotMatrices[0] : static_cast<uint16_t>(shape->GetJointIndex());
+
+            stream.writeUInt16(useMatrix);
+            stream.writeUInt16(entryCount); // Number of matrix table entries
+            stream.writeUInt32(firstEntry); // First matrix table entry
+        }
+    }
+
+    // Write packet location offset
+    Util::WriteOffset(&stream, streamStartPos, 0x28);
+    // Write packet locations
+    for (const auto& [size, offset] : packetLocations) {
+        stream.writeUInt32(size);
+        stream.writeUInt32(offset);
+    }
+
+    Util::PadStreamWithString(&stream, 32);
+
+    // Write section size
+    Util::WriteOffset(&stream, streamStartPos, 4);
 }
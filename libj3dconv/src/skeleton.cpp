@@ -1,5 +1,7 @@
 #include "skeleton.hpp"
 #include "shape.hpp"
+#include "vertex.hpp"
+#include "bounds.hpp"
 #include "jutnametab.hpp"
 #include "util.hpp"
 
@@ -7,56 +9,63 @@
 #include <tiny_gltf.h>
 
 #include <algorithm>
+#include <cmath>
 
 const float INT16_RAD_ANGLE_RATIO = 32768.0f / glm::pi<float>();
 
+// Most points fit in one go when calculating joint bounds, so a joint that moves a huge mesh is split across threads too
+const size_t JOINT_BOUNDS_CHUNK_SIZE = 16384;
+
 /* SJoint */
 
-void SJoint::WriteHierarchyRecursive(bStream::CStream& stream) {
-    stream.writeUInt16(static_cast<uint16_t>(EHierarchyNodeType::Joint));
-    stream.writeUInt16(JointIndex);
-
-    if (AttachedShapes.size() != 0) {
-        // Sort shapes by material name, ascending alphabetically
-        std::sort(
-            AttachedShapes.begin(),
-            AttachedShapes.end(),
-            [](const std::shared_ptr<CShape> a, const std::shared_ptr<CShape> b) {
-                return a->GetMaterialName() < b->GetMaterialName();
-            }
-        );
+static void WriteHierarchyNode(bStream::CStream& stream, EHierarchyNodeType type, uint16_t index = 0) {
+    stream.writeUInt16(static_cast<uint16_t>(type));
+    stream.writeUInt16(index);
+}
 
-        for (const std::shared_ptr<CShape> s : AttachedShapes) {
-            stream.writeUInt16(static_cast<uint16_t>(EHierarchyNodeType::Down));
-            stream.writeUInt16(0);
+void SJoint::WriteHierarchy(bStream::CStream& stream) {
+    // Each entry is a joint we're inside of and the index of the next child to visit.
+    std::vector<std::pair<SJoint*, size_t>> stack;
 
-            stream.writeUInt16(static_cast<uint16_t>(EHierarchyNodeType::Material));
-            stream.writeUInt16(s->GetMaterialIndex());
+    auto enterJoint = [&](SJoint* joint) {
+        WriteHierarchyNode(stream, EHierarchyNodeType::Joint, joint->JointIndex);
 
-            stream.writeUInt16(static_cast<uint16_t>(EHierarchyNodeType::Down));
-            stream.writeUInt16(0);
+        // Shapes are already in the order CSkeletonData::PlanDrawOrder picked
+        for (const std::shared_ptr<CShape>& s : joint->AttachedShapes) {
+            WriteHierarchyNode(stream, EHierarchyNodeType::Down);
+            WriteHierarchyNode(stream, EHierarchyNodeType::Material, s->GetMaterialIndex());
+            WriteHierarchyNode(stream, EHierarchyNodeType::Down);
+            WriteHierarchyNode(stream, EHierarchyNodeType::Shape, s->GetIndex());
+        }
 
-            stream.writeUInt16(static_cast<uint16_t>(EHierarchyNodeType::Shape));
-            stream.writeUInt16(s->GetIndex());
+        if (joint->Children.size() != 0) {
+            WriteHierarchyNode(stream, EHierarchyNodeType::Down);
         }
-    }
 
-    if (Children.size() != 0) {
-        stream.writeUInt16(static_cast<uint16_t>(EHierarchyNodeType::Down));
-        stream.writeUInt16(0);
+        stack.push_back({ joint, 0 });
+    };
+
+    enterJoint(this);
+
+    while (!stack.empty()) {
+        SJoint* joint = stack.back().first;
+        size_t nextChild = stack.back().second++;
 
-        for (auto j : Children) {
-            j->WriteHierarchyRecursive(stream);
+        if (nextChild < joint->Children.size()) {
+            enterJoint(joint->Children[nextChild].get());
+            continue;
         }
 
-        stream.writeUInt16(static_cast<uint16_t>(EHierarchyNodeType::Up));
-        stream.writeUInt16(0);
-    }
+        if (joint->Children.size() != 0) {
+            WriteHierarchyNode(stream, EHierarchyNodeType::Up);
+        }
+
+        // We wrote 2 "down"s for each attached shape, so write as many "up"s.
+        for (uint32_t i = 0; i < joint->AttachedShapes.size() * 2; i++) {
+            WriteHierarchyNode(stream, EHierarchyNodeType::Up);
+        }
 
-    // We wrote 2 "down"s for each attached shape, so write as many "up"s.
-    for (uint32_t i = 0; i < AttachedShapes.size() * 2; i++) {
-        stream.writeUInt16(static_cast<uint16_t>(EHierarchyNodeType::Up));
-        stream.writeUInt16(0);
+        stack.pop_back();
     }
 }
 
@@ -68,6 +77,13 @@ CSkeletonData::CSkeletonData() : mRootJoint(nullptr) {
 
 CSkeletonData::~CSkeletonData() {
     mRootJoint = nullptr;
+
+    // mJoints owns every joint, so dropping the child links first keeps a long chain
+    // from being destroyed one nested destructor at a time.
+    for (const auto& j : mJoints) {
+        j->Children.clear();
+    }
+
     mJoints.clear();
 }
 
@@ -104,6 +120,14 @@ void CSkeletonData::CreateSkeleton(tinygltf::Model* model) {
 
     uint32_t rootJointNodeIndex = UINT32_MAX;
 
+    // Nodes directly under the scene root, one of which should be the skeleton's root
+    std::vector<bool> sceneRootChildren(nodes.size(), false);
+    for (const int i : sceneRootNode.children) {
+        sceneRootChildren[i] = true;
+    }
+
+    mNodeJointIndices.assign(nodes.size(), UINT32_MAX);
+
     // First, create all the joints at once to ensure
     // that they are in the correct order.
     for (const int jointIndex : skin.joints) {
@@ -139,50 +163,56 @@ void CSkeletonData::CreateSkeleton(tinygltf::Model* model) {
             };
         }
 
+        mNodeJointIndices[jointIndex] = curJoint->JointIndex;
         mJoints.push_back(curJoint);
 
         // Find the index of the skeleton's root node while we're at it.
-        if (rootJointNodeIndex == UINT32_MAX) {
-            for (const int i : sceneRootNode.children) {
-                if (i == jointIndex) {
-                    rootJointNodeIndex = i;
-                    break;
-                }
-            }
+        if (rootJointNodeIndex == UINT32_MAX && sceneRootChildren[jointIndex]) {
+            rootJointNodeIndex = jointIndex;
         }
     }
 
     // Once we've created all the nodes, bind them together in a hierarchy.
-    BuildHierarchyRecursive(nodes, nullptr, rootJointNodeIndex);
+    BuildHierarchy(nodes, rootJointNodeIndex);
 }
 
-void CSkeletonData::BuildHierarchyRecursive(const std::vector<tinygltf::Node>& nodes, std::shared_ptr<SJoint> parent, uint32_t currentIndex) {
-    auto currentJointItr = std::find_if(
-        mJoints.begin(),
-        mJoints.end(),
-        [&currentIndex](std::shared_ptr<SJoint> j) {
-            return j->OriginalNodeIndex == currentIndex;
+void CSkeletonData::BuildHierarchy(const std::vector<tinygltf::Node>& nodes, uint32_t rootNodeIndex) {
+    // Each entry is a node still to visit and the joint it hangs from. Children are pushed in reverse,
+    // so they come off the stack, and get attached to their parent, in their original order.
+    std::vector<std::pair<std::shared_ptr<SJoint>, uint32_t>> stack = { { nullptr, rootNodeIndex } };
+    std::vector<bool> visited(nodes.size(), false);
+
+    while (!stack.empty()) {
+        auto parent = stack.back().first;
+        uint32_t currentIndex = stack.back().second;
+        stack.pop_back();
+
+        // Nodes that aren't joints are skipped along with everything under them. Don't know if this
+        // is possible for the root, but just in case...
+        if (currentIndex >= nodes.size() || mNodeJointIndices[currentIndex] == UINT32_MAX) {
+            continue;
         }
-    );
 
-    // Don't know if this is possible, but just in case...
-    if (currentJointItr == mJoints.end()) {
-        return;
-    }
+        // A node reachable twice would be a broken glTF, so only attach it the first time
+        if (visited[currentIndex]) {
+            continue;
+        }
+        visited[currentIndex] = true;
 
-    auto currentJoint = *currentJointItr;
+        auto currentJoint = mJoints[mNodeJointIndices[currentIndex]];
 
-    if (parent == nullptr) {
-        mRootJoint = currentJoint;
-    }
-    else {
-        currentJoint->Parent = parent;
-        parent->Children.push_back(currentJoint);
-    }
+        if (parent == nullptr) {
+            mRootJoint = currentJoint;
+        }
+        else {
+            currentJoint->Parent = parent;
+            parent->Children.push_back(currentJoint);
+        }
 
-    const auto& currentNode = nodes[currentIndex];
-    for (const auto i : currentNode.children) {
-        BuildHierarchyRecursive(nodes, currentJoint, i);
+        const auto& children = nodes[currentIndex].children;
+        for (auto itr = children.rbegin(); itr != children.rend(); itr++) {
+            stack.push_back({ currentJoint, static_cast<uint32_t>(*itr) });
+        }
     }
 }
 
@@ -205,6 +235,282 @@ void CSkeletonData::AttachShapesToSkeleton(shared_vector<CShape>& shapes) {
     }
 }
 
+void CSkeletonData::PlanDrawOrder(shared_vector<CShape>& shapes, const CVertexData& vertexData, const tinygltf::Model* model) {
+    const SAttributeArray& positions = vertexData.GetAttributeValues(EGXAttribute::Position);
+
+    // Materials are compared by base color texture too, so that a material change can at least keep the texture loaded.
+    auto getMaterialTexture = [&](uint32_t material) -> int {
+        if (model == nullptr || material >= model->materials.size()) {
+            return -1;
+        }
+
+        return model->materials[material].pbrMetallicRoughness.baseColorTexture.index;
+    };
+
+    uint32_t currentMaterial = UINT32_MAX;
+    int currentTexture = -1;
+
+    // Picks the index of the candidate that keeps the current material, then one that keeps the current texture, then the first.
+    auto pickNext = [&](size_t count, auto&& hasMaterial, auto&& hasTexture) -> size_t {
+        for (size_t i = 0; i < count; i++) {
+            if (hasMaterial(i, currentMaterial)) {
+                return i;
+            }
+        }
+
+        if (currentTexture != -1) {
+            for (size_t i = 0; i < count; i++) {
+                if (hasTexture(i, currentTexture)) {
+                    return i;
+                }
+            }
+        }
+
+        return 0;
+    };
+
+    shared_vector<CShape> drawOrder;
+    drawOrder.reserve(shapes.size());
+
+    // Which of the original shapes have been placed or merged into another, by their original index
+    std::vector<bool> bHandled(shapes.size(), false);
+
+    auto planJoint = [&](SJoint* joint) {
+        // Group the joint's shapes by material, keeping their order within each group
+        std::vector<std::pair<uint32_t, shared_vector<CShape>>> groups;
+
+        for (const auto& shape : joint->AttachedShapes) {
+            auto groupItr = std::find_if(groups.begin(), groups.end(), [&](const auto& g) { return g.first == shape->GetMaterialIndex(); });
+
+            if (groupItr == groups.end()) {
+                groups.push_back({ shape->GetMaterialIndex(), { shape } });
+            }
+            else {
+                groupItr->second.push_back(shape);
+            }
+        }
+
+        // Most joints don't have any shapes to draw
+        if (groups.empty()) {
+            return;
+        }
+
+        // Same-texture groups end up next to each other
+        std::stable_sort(groups.begin(), groups.end(), [&](const auto& a, const auto& b) {
+            return std::make_pair(getMaterialTexture(a.first), a.first) < std::make_pair(getMaterialTexture(b.first), b.first);
+        });
+
+        // Start with whatever the previous joint left bound
+        size_t firstGroup = pickNext(groups.size(),
+            [&](size_t i, uint32_t material) { return groups[i].first == material; },
+            [&](size_t i, int texture) { return getMaterialTexture(groups[i].first) == texture; }
+        );
+        std::rotate(groups.begin(), groups.begin() + firstGroup, groups.begin() + firstGroup + 1);
+
+        joint->AttachedShapes.clear();
+
+        for (auto& [material, groupShapes] : groups) {
+            std::shared_ptr<CShape> merged = nullptr;
+            bool bMergedAny = false;
+
+            for (const auto& shape : groupShapes) {
+                if (shape->GetIndex() < bHandled.size()) {
+                    bHandled[shape->GetIndex()] = true;
+                }
+
+                shape->BuildVertexDescriptor();
+
+                if (merged != nullptr && merged->CanMerge(*shape)) {
+                    merged->Merge(*shape);
+                    bMergedAny = true;
+                    continue;
+                }
+
+                if (merged != nullptr && bMergedAny) {
+                    merged->CalculateBoundingVolume(positions);
+                }
+
+                merged = shape;
+                bMergedAny = false;
+
+                joint->AttachedShapes.push_back(shape);
+                drawOrder.push_back(shape);
+            }
+
+            if (merged != nullptr && bMergedAny) {
+                merged->CalculateBoundingVolume(positions);
+            }
+
+            currentMaterial = material;
+            currentTexture = getMaterialTexture(material);
+        }
+    };
+
+    if (mRootJoint != nullptr) {
+        // Each entry is a joint we're inside of and the children it has yet to visit.
+        std::vector<std::pair<SJoint*, shared_vector<SJoint>>> stack;
+
+        auto enterJoint = [&](SJoint* joint) {
+            planJoint(joint);
+
+            stack.push_back({ joint, std::move(joint->Children) });
+            joint->Children.clear();
+        };
+
+        enterJoint(mRootJoint.get());
+
+        while (!stack.empty()) {
+            auto& [joint, remaining] = stack.back();
+
+            if (remaining.size() == 0) {
+                stack.pop_back();
+                continue;
+            }
+
+            // Visit next the child whose own shapes can carry on with what's bound now
+            size_t next = pickNext(remaining.size(),
+                [&](size_t i, uint32_t material) {
+                    const auto& attached = remaining[i]->AttachedShapes;
+                    return std::any_of(attached.begin(), attached.end(), [&](const auto& s) { return s->GetMaterialIndex() == material; });
+                },
+                [&](size_t i, int texture) {
+                    const auto& attached = remaining[i]->AttachedShapes;
+                    return std::any_of(attached.begin(), attached.end(), [&](const auto& s) { return getMaterialTexture(s->GetMaterialIndex()) == texture; });
+                }
+            );
+
+            std::shared_ptr<SJoint> child = remaining[next];
+            remaining.erase(remaining.begin() + next);
+
+            joint->Children.push_back(child);
+            enterJoint(child.get());
+        }
+    }
+
+    // Shapes on joints outside the hierarchy aren't in INF1, but keep them in SHP1 all the same
+    for (const auto& shape : shapes) {
+        if (shape->GetIndex() < bHandled.size() && !bHandled[shape->GetIndex()]) {
+            drawOrder.push_back(shape);
+        }
+    }
+
+    for (uint32_t i = 0; i < drawOrder.size(); i++) {
+        drawOrder[i]->SetIndex(i);
+    }
+
+    shapes = std::move(drawOrder);
+}
+
+void CSkeletonData::CalculateJointBounds(const shared_vector<CShape>& shapes, const CVertexData& vertexData, const std::vector<glm::mat4>& inverseBindMatrices) {
+    const SAttributeArray& positions = vertexData.GetAttributeValues(EGXAttribute::Position);
+
+    // Calls func(joint, position index) for every joint that moves every vertex.
+    // Vertices without influences move with their shape's joint.
+    auto forEachInfluence = [&](auto&& func) {
+        for (const auto& shape : shapes) {
+            const CVertexPool& pool = shape->GetVertexPool();
+
+            for (uint32_t v = 0; v < pool.GetVertexCount(); v++) {
+                uint16_t positionIndex = pool.GetIndex(EGXAttribute::Position, v);
+                if (positionIndex == UINT16_MAX || positionIndex >= positions.Size()) {
+                    continue;
+                }
+
+                uint32_t influenceCount = pool.GetInfluenceCount(v);
+                if (influenceCount == 0) {
+                    func(shape->GetJointIndex(), positionIndex);
+                    continue;
+                }
+
+                for (uint32_t i = 0; i < influenceCount; i++) {
+                    if (pool.GetWeights(v)[i] > 0.0f) {
+                        func(pool.GetJointIndices(v)[i], positionIndex);
+                    }
+                }
+            }
+        }
+    };
+
+    // Bucket the position indices by joint
+    std::vector<uint32_t> jointStarts(mJoints.size() + 1, 0);
+    forEachInfluence([&](uint32_t joint, uint16_t) {
+        if (joint < mJoints.size()) {
+            jointStarts[joint + 1]++;
+        }
+    });
+
+    for (size_t i = 0; i < mJoints.size(); i++) {
+        jointStarts[i + 1] += jointStarts[i];
+    }
+
+    std::vector<uint32_t> jointPositions(jointStarts.back());
+    std::vector<uint32_t> jointCursors(jointStarts.begin(), jointStarts.end() - 1);
+
+    forEachInfluence([&](uint32_t joint, uint16_t positionIndex) {
+        if (joint < mJoints.size()) {
+            jointPositions[jointCursors[joint]++] = positionIndex;
+        }
+    });
+
+    // Each chunk of a joint's positions is bounded on its own, then the chunks are merged per joint.
+    struct SBoundsChunk {
+        uint32_t Joint;
+        uint32_t Start;
+        uint32_t End;
+
+        glm::vec3 BoxMin = glm::vec3(FLT_MAX);
+        glm::vec3 BoxMax = glm::vec3(-FLT_MAX);
+        float MaxLengthSquared = 0.0f;
+    };
+
+    std::vector<SBoundsChunk> chunks;
+    for (uint32_t j = 0; j < mJoints.size(); j++) {
+        for (uint32_t start = jointStarts[j]; start < jointStarts[j + 1]; start += JOINT_BOUNDS_CHUNK_SIZE) {
+            chunks.push_back({ j, start, std::min<uint32_t>(start + JOINT_BOUNDS_CHUNK_SIZE, jointStarts[j + 1]) });
+        }
+    }
+
+    Util::ParallelFor(chunks.size(), [&](size_t c) {
+        SBoundsChunk& chunk = chunks[c];
+
+        glm::mat4 inverseBindMatrix = chunk.Joint < inverseBindMatrices.size() ? inverseBindMatrices[chunk.Joint] : glm::identity<glm::mat4>();
+
+        std::vector<glm::vec4> localPositions(chunk.End - chunk.Start);
+        for (uint32_t i = chunk.Start; i < chunk.End; i++) {
+            const float* p = positions.Get(jointPositions[i]);
+            localPositions[i - chunk.Start] = inverseBindMatrix * glm::vec4(p[0], p[1], p[2], 1.0f);
+        }
+
+        Bounds::ExpandBox(localPositions.data(), localPositions.size(), chunk.BoxMin, chunk.BoxMax, chunk.MaxLengthSquared);
+    });
+
+    // Joints without any vertices keep empty bounds at their origin
+    std::vector<SBoundsChunk> jointBounds(mJoints.size());
+    for (const SBoundsChunk& chunk : chunks) {
+        SBoundsChunk& merged = jointBounds[chunk.Joint];
+
+        merged.BoxMin = glm::min(merged.BoxMin, chunk.BoxMin);
+        merged.BoxMax = glm::max(merged.BoxMax, chunk.BoxMax);
+        merged.MaxLengthSquared = std::max(merged.MaxLengthSquared, chunk.MaxLengthSquared);
+    }
+
+    for (uint32_t j = 0; j < mJoints.size(); j++) {
+        Util::UConvBoundingVolume& bounds = mJoints[j]->Bounds;
+
+        if (jointStarts[j] == jointStarts[j + 1]) {
+            bounds.BoundingBoxMin = glm::zero<glm::vec3>();
+            bounds.BoundingBoxMax = glm::zero<glm::vec3>();
+            bounds.BoundingSphereRadius = 0.0f;
+            continue;
+        }
+
+        // The sphere is centered on the joint, so it reaches out to the farthest vertex
+        bounds.BoundingBoxMin = jointBounds[j].BoxMin;
+        bounds.BoundingBoxMax = jointBounds[j].BoxMax;
+        bounds.BoundingSphereRadius = std::sqrt(jointBounds[j].MaxLengthSquared);
+    }
+}
+
 void CSkeletonData::WriteINF1(bStream::CStream& stream, uint32_t vertexCount) {
     size_t streamStartPos = stream.tell();
 
@@ -219,7 +525,7 @@ void CSkeletonData::WriteINF1(bStream::CStream& stream, uint32_t vertexCount) {
     stream.writeUInt32(0x18);        // Offset to hierarchy data; always 0x18
 
     // Write hierarchy
-    mRootJoint->WriteHierarchyRecursive(stream);
+    mRootJoint->WriteHierarchy(stream);
 
     // End the hierarchy
     stream.writeUInt32(0);
@@ -5,6 +5,10 @@
 #include "bstream.h"
 
 #include <tiny_gltf.h>
+#include <stb_image.h>
+
+#include <cstring>
+#include <iostream>
 
 /* CTextureData */
 
@@ -43,41 +47,334 @@ EFilterMode CTextureData::ConvertFilterMode(int mode) {
             return EFilterMode::LinearMipmapNearest;
         case TINYGLTF_TEXTURE_FILTER_LINEAR_MIPMAP_LINEAR:
             return EFilterMode::LinearMipmapLinear;
+        default:
+            return EFilterMode::Linear;
+    }
+}
+
+uint8_t CTextureData::GetGXFilterMode(EFilterMode mode, bool bHasMipmaps) {
+    switch (mode) {
+        case EFilterMode::Nearest:
+            return 0;
+        case EFilterMode::Linear:
+            return 1;
+        case EFilterMode::NearestMipmapNearest:
+            return bHasMipmaps ? 2 : 0;
+        case EFilterMode::LinearMipmapNearest:
+            return bHasMipmaps ? 3 : 1;
+        case EFilterMode::NearestMipmapLinear:
+            return bHasMipmaps ? 4 : 0;
+        case EFilterMode::LinearMipmapLinear:
+            return bHasMipmaps ? 5 : 1;
+        default:
+            return 1;
+    }
+}
+
+bool CTextureData::DecodeImage(const tinygltf::Image& img, std::vector<uint8_t>& data, int& width, int& height) {
+    // Images loaded by tinygltf are already decoded, but may have fewer than four components
+    // or 16 bits per component, so they're converted to RGBA8.
+    if (!img.as_is) {
+        if ((img.bits != 8 && img.bits != 16) || img.component < 1 || img.component > 4) {
+            return false;
+        }
+
+        size_t pixelCount = static_cast<size_t>(img.width) * img.height;
+        size_t componentSize = img.bits / 8;
+
+        if (img.image.size() < pixelCount * img.component * componentSize) {
+            return false;
+        }
+
+        // Keeps the top byte of each 16-bit component, the same as stb_image does
+        auto readComponent = [&](size_t index) -> uint8_t {
+            if (componentSize == 1) {
+                return img.image[index];
+            }
+
+            uint16_t value = 0;
+            std::memcpy(&value, &img.image[index * 2], sizeof(value));
+            return static_cast<uint8_t>(value >> 8);
+        };
+
+        data.resize(pixelCount * 4);
+
+        for (size_t i = 0; i < pixelCount; i++) {
+            size_t src = i * img.component;
+            uint8_t* dst = &data[i * 4];
+
+            // One or two components are intensity and alpha, three or four are RGB and alpha.
+            if (img.component < 3) {
+                dst[0] = dst[1] = dst[2] = readComponent(src);
+            }
+            else {
+                dst[0] = readComponent(src);
+                dst[1] = readComponent(src + 1);
+                dst[2] = readComponent(src + 2);
+            }
+
+            dst[3] = img.component % 2 == 0 ? readComponent(src + img.component - 1) : 0xFF;
+        }
+
+        width = img.width;
+        height = img.height;
+
+        return true;
+    }
+
+    int components = 0;
+    stbi_uc* pixels = stbi_load_from_memory(img.image.data(), static_cast<int>(img.image.size()), &width, &height, &components, 4);
+    if (pixels == nullptr) {
+        return false;
     }
+
+    data.assign(pixels, pixels + static_cast<size_t>(width) * height * 4);
+    stbi_image_free(pixels);
+
+    return true;
 }
 
 void CTextureData::ProcessTextureData(const tinygltf::Model* model, std::vector<bStream::CMemoryStream>& buffers) {
+    // Only images that a texture points at are decoded; unused images are skipped entirely.
+    std::vector<int> textureImages;
+    std::vector<int> imageSlots(model->images.size(), -1);
+
     for (const tinygltf::Texture& tex : model->textures) {
+        if (tex.source < 0 || tex.source >= static_cast<int>(model->images.size()) || imageSlots[tex.source] != -1) {
+            continue;
+        }
+
+        imageSlots[tex.source] = static_cast<int>(textureImages.size());
+        textureImages.push_back(tex.source);
+    }
+
+    // Decoding is independent per image, so run it in parallel and merge the results in texture order below.
+    std::vector<SDecodedImage> decodedImages(textureImages.size());
+    Util::ParallelFor(textureImages.size(), [&](size_t i) {
+        SDecodedImage& decoded = decodedImages[i];
+        decoded.mValid = DecodeImage(model->images[textureImages[i]], decoded.mData, decoded.mWidth, decoded.mHeight);
+    });
+
+    for (size_t t = 0; t < model->textures.size(); t++) {
+        const tinygltf::Texture& tex = model->textures[t];
+
+        if (tex.source < 0 || tex.source >= static_cast<int>(model->images.size())) {
+            std::cout << "Texture references invalid image " << tex.source << ", skipping." << std::endl;
+            continue;
+        }
+
         const tinygltf::Image& img = model->images[tex.source];
-        const tinygltf::Sampler& smp = model->samplers[tex.sampler];
+        const SDecodedImage& decoded = decodedImages[imageSlots[tex.source]];
+
+        if (!decoded.mValid) {
+            std::cout << "Failed to decode image \"" << img.name << "\", skipping." << std::endl;
+            continue;
+        }
 
         std::shared_ptr<STexture> newTexture = std::make_shared<STexture>();
         newTexture->mName = img.name;
-        newTexture->mData = img.image;
-        newTexture->mWidth = img.width;
-        newTexture->mHeight = img.height;
+        newTexture->mGltfTextureIndex = static_cast<int>(t);
+        newTexture->mData = decoded.mData;
+        newTexture->mWidth = decoded.mWidth;
+        newTexture->mHeight = decoded.mHeight;
 
-        newTexture->mWrapS = ConvertWrapMode(smp.wrapS);
-        newTexture->mWrapT = ConvertWrapMode(smp.wrapT);
-        newTexture->mFilterMin = ConvertFilterMode(smp.minFilter);
-        newTexture->mFilterMag = ConvertFilterMode(smp.magFilter);
+        // Textures without a sampler use the glTF defaults.
+        if (tex.sampler >= 0 && tex.sampler < static_cast<int>(model->samplers.size())) {
+            const tinygltf::Sampler& smp = model->samplers[tex.sampler];
+
+            newTexture->mWrapS = ConvertWrapMode(smp.wrapS);
+            newTexture->mWrapT = ConvertWrapMode(smp.wrapT);
+            newTexture->mFilterMin = ConvertFilterMode(smp.minFilter);
+            newTexture->mFilterMag = ConvertFilterMode(smp.magFilter);
+        }
+        else {
+            newTexture->mWrapS = EWrapMode::Repeat;
+            newTexture->mWrapT = EWrapMode::Repeat;
+        }
 
         // Disable alpha by default
         newTexture->mPaletteFormat = EPaletteFormat::RGB565;
 
-        if (img.component == 4) {
-            // Check the alpha component of each pixel to see if it's less than 0xFF
-            for (uint32_t i = 3; i < img.image.size(); i += 4) {
-                if (img.image[i] < 0xFF) {
-                    // If the alpha is less than 0xFF, enable alpha and leave the loop
-                    newTexture->mPaletteFormat = EPaletteFormat::RGB5A3;
-                    break;
-                }
+        // Check the alpha component of each pixel to see how much of it is see-through.
+        // Decoded images are always RGBA, so images without alpha come out opaque here.
+        for (size_t i = 3; i < newTexture->mData.size(); i += 4) {
+            if (newTexture->mData[i] == 0xFF) {
+                continue;
+            }
+
+            // If the alpha is less than 0xFF, enable alpha
+            newTexture->mPaletteFormat = EPaletteFormat::RGB5A3;
+            newTexture->mAlpha = ETextureAlpha::Cutout;
+
+            // Partial alpha can't get any worse, so leave the loop
+            if (newTexture->mData[i] != 0) {
+                newTexture->mAlpha = ETextureAlpha::Translucent;
+                break;
             }
         }
 
+        // Grayscale palettes only need intensity and alpha
+        bool bGrayscale = IsGrayscale(newTexture->mData);
+        if (bGrayscale) {
+            newTexture->mPaletteFormat = EPaletteFormat::IA8;
+        }
+
+        newTexture->mFormat = ChooseFormat(*newTexture, bGrayscale);
+
         mTextures.push_back(newTexture);
     }
+
+    // Each encoder spreads its own tiles across threads. Textures that can't be encoded are dropped,
+    // since TEX1 has no way to describe a texture without image data.
+    shared_vector<STexture> encodedTextures;
+
+    for (auto& tex : mTextures) {
+        if (EncodeTexture(*tex)) {
+            encodedTextures.push_back(tex);
+        }
+    }
+
+    mTextures = std::move(encodedTextures);
+
+    // Skipped textures leave gaps, so glTF texture indices have to be mapped to TEX1 ones
+    mTextureIndices.assign(model->textures.size(), -1);
+    for (size_t i = 0; i < mTextures.size(); i++) {
+        mTextureIndices[mTextures[i]->mGltfTextureIndex] = static_cast<int>(i);
+    }
+}
+
+bool CTextureData::IsGrayscale(const std::vector<uint8_t>& data) {
+    for (size_t i = 0; i + 3 < data.size(); i += 4) {
+        if (data[i] != data[i + 1] || data[i] != data[i + 2]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+EGXTextureFormat CTextureData::ChooseFormat(const STexture& texture, bool bGrayscale) {
+    EGXTextureFormat format = EGXTextureFormat::CMPR;
+
+    // Grayscale keeps full intensity precision, with alpha alongside if it's needed
+    if (bGrayscale) {
+        format = texture.mAlpha == ETextureAlpha::Opaque ? EGXTextureFormat::I8 : EGXTextureFormat::IA8;
+    }
+    // CMPR only has one bit of alpha, so blended alpha needs a direct format
+    else if (texture.mAlpha == ETextureAlpha::Translucent) {
+        format = EGXTextureFormat::RGB5A3;
+    }
+
+    // Colors can only be counted in RGBA data
+    size_t texelCount = texture.mWidth * texture.mHeight;
+    if (texture.mData.size() != texelCount * 4) {
+        return format;
+    }
+
+    bool bSixteenBit = format == EGXTextureFormat::IA8 || format == EGXTextureFormat::RGB5A3;
+
+    // C4 is never larger than the direct formats, but C8 only saves space over the 16-bit ones
+    if (mTextureSettings.bLosslessPalettes) {
+        uint32_t colorCount = GXTexture::CountPaletteColors(texture.mPaletteFormat, texture.mData.data(), texelCount, 256);
+
+        if (colorCount <= 16) {
+            return EGXTextureFormat::C4;
+        }
+
+        if (colorCount <= 256 && bSixteenBit) {
+            return EGXTextureFormat::C8;
+        }
+    }
+
+    if (mTextureSettings.bQuantizePalettes && bSixteenBit) {
+        return EGXTextureFormat::C8;
+    }
+
+    return format;
+}
+
+bool CTextureData::UsesMipmaps(EFilterMode mode) {
+    return mode != EFilterMode::Nearest && mode != EFilterMode::Linear;
+}
+
+bool CTextureData::EncodeTexture(STexture& texture) {
+    if (texture.mWidth == 0 || texture.mHeight == 0) {
+        std::cout << "Texture \"" << texture.mName << "\" is empty, skipping." << std::endl;
+        return false;
+    }
+
+    // Only RGBA8 pixels can be encoded
+    if (texture.mData.size() != texture.mWidth * texture.mHeight * 4) {
+        std::cout << "Texture \"" << texture.mName << "\" isn't RGBA, so it can't be encoded, skipping." << std::endl;
+        return false;
+    }
+
+    uint32_t width = static_cast<uint32_t>(texture.mWidth);
+    uint32_t height = static_cast<uint32_t>(texture.mHeight);
+
+    texture.mMipCount = 1;
+
+    // GX can only mipmap textures that are a power of two in both directions
+    if (mTextureSettings.bGenerateMipmaps && UsesMipmaps(texture.mFilterMin)) {
+        if ((width & (width - 1)) == 0 && (height & (height - 1)) == 0) {
+            texture.mMipCount = GXTexture::GetMaxMipCount(texture.mFormat, width, height);
+        }
+        else {
+            std::cout << "Texture \"" << texture.mName << "\" isn't a power of two in size, so it won't have mipmaps." << std::endl;
+        }
+    }
+
+    // Each level is downsampled from the one before it, and they're all stored back to back
+    std::vector<std::vector<uint8_t>> mipLevels(texture.mMipCount - 1);
+    size_t imageDataSize = GXTexture::GetImageSize(texture.mFormat, width, height);
+
+    for (uint32_t level = 1, levelWidth = width, levelHeight = height; level < texture.mMipCount; level++) {
+        const uint8_t* source = level == 1 ? texture.mData.data() : mipLevels[level - 2].data();
+
+        mipLevels[level - 1].resize(static_cast<size_t>(levelWidth / 2) * (levelHeight / 2) * 4);
+        GXTexture::DownsampleImage(source, levelWidth, levelHeight, mipLevels[level - 1].data());
+
+        levelWidth /= 2;
+        levelHeight /= 2;
+        imageDataSize += GXTexture::GetImageSize(texture.mFormat, levelWidth, levelHeight);
+    }
+
+    texture.mImageData.resize(imageDataSize);
+    uint8_t* imageData = texture.mImageData.data();
+
+    for (uint32_t level = 0; level < texture.mMipCount; level++) {
+        const uint8_t* rgba = level == 0 ? texture.mData.data() : mipLevels[level - 1].data();
+
+        if (!EncodeImage(texture, rgba, width, height, imageData, level == 0)) {
+            std::cout << "Texture \"" << texture.mName << "\" has a format that can't be encoded, skipping." << std::endl;
+            return false;
+        }
+
+        imageData += GXTexture::GetImageSize(texture.mFormat, width, height);
+        width /= 2;
+        height /= 2;
+    }
+
+    return true;
+}
+
+bool CTextureData::EncodeImage(STexture& texture, const uint8_t* rgba, uint32_t width, uint32_t height, uint8_t* dst, bool bBaseLevel) {
+    switch (texture.mFormat) {
+        case EGXTextureFormat::CMPR:
+            GXTexture::EncodeCMPR(rgba, width, height, mTextureSettings.CMPRQuality, dst);
+            return true;
+        // Mip levels have to share the TLUT built for the full size image
+        case EGXTextureFormat::C4:
+        case EGXTextureFormat::C8:
+        case EGXTextureFormat::C14X2:
+            if (bBaseLevel) {
+                return GXTexture::EncodePalette(texture.mFormat, texture.mPaletteFormat, rgba, width, height, dst, texture.mPaletteData);
+            }
+
+            return GXTexture::EncodePaletteIndices(texture.mFormat, texture.mPaletteFormat, texture.mPaletteData, rgba, width, height, dst);
+        default:
+            return GXTexture::EncodeDirect(texture.mFormat, rgba, width, height, dst);
+    }
 }
 
 void CTextureData::WriteTEX1(bStream::CStream& stream) {
@@ -95,10 +392,64 @@ void CTextureData::WriteTEX1(bStream::CStream& stream) {
 
     Util::PadStreamWithString(&stream, 32);
 
+    // Texture headers. Each one's image data offset is relative to the header itself.
+    size_t headersStartPos = stream.tell();
+
     for (auto& tex : mTextures) {
         textureNameTable.AddName(tex->mName);
+
+        stream.writeUInt8(static_cast<uint8_t>(tex->mFormat));
+        stream.writeUInt8(static_cast<uint8_t>(tex->mAlpha));
+        stream.writeUInt16(static_cast<uint16_t>(tex->mWidth));
+        stream.writeUInt16(static_cast<uint16_t>(tex->mHeight));
+        stream.writeUInt8(static_cast<uint8_t>(tex->mWrapS));
+        stream.writeUInt8(static_cast<uint8_t>(tex->mWrapT));
+
+        // Palette
+        stream.writeUInt8(tex->mPaletteData.empty() ? 0 : 1);           // Palette enabled
+        stream.writeUInt8(static_cast<uint8_t>(tex->mPaletteFormat));    // Palette format
+        stream.writeUInt16(tex->mPaletteData.size() / 2);               // Palette entry count
+        stream.writeUInt32(0);                                           // Placeholder for palette data offset
+
+        // Filtering and LOD. LODs are in eighths.
+        bool bHasMipmaps = tex->mMipCount > 1;
+
+        stream.writeUInt8(bHasMipmaps ? 1 : 0);                          // Mipmaps enabled
+        stream.writeUInt8(0);                                            // Edge LOD
+        stream.writeUInt8(0);                                            // Bias clamp
+        stream.writeUInt8(0);                                            // Max anisotropy
+        stream.writeUInt8(GetGXFilterMode(tex->mFilterMin, bHasMipmaps)); // Minification filter
+        stream.writeUInt8(GetGXFilterMode(tex->mFilterMag, false));      // Magnification filter
+        stream.writeInt8(0);                                             // Min LOD
+        stream.writeInt8((tex->mMipCount - 1) * 8);                      // Max LOD
+        stream.writeUInt8(tex->mMipCount);                               // Image count
+        stream.writeUInt8(0);                                            // Padding
+        stream.writeInt16(0);                                            // LOD bias
+
+        stream.writeUInt32(0);                                           // Placeholder for image data offset
     }
 
+    // Image data, each image and palette aligned to 32 bytes. Palettes come right before their image.
+    for (size_t i = 0; i < mTextures.size(); i++) {
+        const std::vector<uint8_t>& paletteData = mTextures[i]->mPaletteData;
+
+        if (!paletteData.empty()) {
+            Util::PadStreamWithString(&stream, 32);
+            Util::WriteOffset(&stream, headersStartPos + i * 0x20, 0x0C);
+
+            stream.writeString(std::string(paletteData.begin(), paletteData.end()));
+        }
+
+        Util::PadStreamWithString(&stream, 32);
+        Util::WriteOffset(&stream, headersStartPos + i * 0x20, 0x1C);
+
+        const std::vector<uint8_t>& imageData = mTextures[i]->mImageData;
+        // writeString is the only bulk write CStream has, and it copies the bytes as-is
+        stream.writeString(std::string(imageData.begin(), imageData.end()));
+    }
+
+    Util::PadStreamWithString(&stream, 32);
+
     // Write name table offset
     Util::WriteOffset(&stream, streamStartPos, 0x10);
     // Write name table
@@ -1,14 +1,192 @@
 #include "util.hpp"
 
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 #include <bstream.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace Util {
 	const std::string PADDING_STRING = "This is padding data to alignm";
 
+	std::atomic<uint32_t> ThreadCount = 0;
+
+	void SetThreadCount(uint32_t threadCount) {
+		ThreadCount = threadCount;
+	}
+
+	uint32_t GetThreadCount() {
+		if (ThreadCount != 0)
+			return ThreadCount;
+
+		return std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	// One ParallelFor call. The first exception thrown by func is kept and rethrown on the calling thread.
+	struct SParallelJob {
+		const std::function<void(size_t)>* Func = nullptr;
+		size_t Count = 0;
+		std::atomic<size_t> NextIndex = 0;
+
+		std::mutex ErrorMutex;
+		std::exception_ptr Error;
+
+		void Run() {
+			for (size_t i = NextIndex++; i < Count; i = NextIndex++) {
+				try {
+					(*Func)(i);
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(ErrorMutex);
+					if (Error == nullptr)
+						Error = std::current_exception();
+
+					// Hand out no more work; indices that already started still finish.
+					NextIndex = Count;
+				}
+			}
+		}
+	};
+
+	// Worker threads that live for the rest of the program, so ParallelFor doesn't start and join threads on every call.
+	// Threads are only added when a call asks for more than the pool has.
+	class CThreadPool {
+		std::vector<std::thread> mThreads;
+
+		std::mutex mMutex;
+		std::condition_variable mWorkReady;
+		std::condition_variable mWorkDone;
+
+		SParallelJob* mJob = nullptr;
+		uint64_t mGeneration = 0;
+		// Workers still allowed to join the current job, and workers running it
+		size_t mOpenSlots = 0;
+		size_t mBusyWorkers = 0;
+		bool mStopping = false;
+
+		// Only one job runs at a time
+		std::mutex mDispatchMutex;
+
+		void WorkerMain() {
+			InParallelFor = true;
+			uint64_t lastGeneration = 0;
+
+			while (true) {
+				SParallelJob* job = nullptr;
+
+				{
+					std::unique_lock<std::mutex> lock(mMutex);
+					mWorkReady.wait(lock, [&]() { return mStopping || (mJob != nullptr && mGeneration != lastGeneration && mOpenSlots != 0); });
+
+					if (mStopping)
+						return;
+
+					job = mJob;
+					lastGeneration = mGeneration;
+					mOpenSlots--;
+					mBusyWorkers++;
+				}
+
+				job->Run();
+
+				{
+					std::lock_guard<std::mutex> lock(mMutex);
+					mBusyWorkers--;
+				}
+
+				mWorkDone.notify_all();
+			}
+		}
+
+	public:
+		// Set on pool threads, and on a thread while it runs a job, so nested calls run inline instead of waiting on the pool.
+		static thread_local bool InParallelFor;
+
+		~CThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mStopping = true;
+			}
+
+			mWorkReady.notify_all();
+
+			for (std::thread& t : mThreads) {
+				t.join();
+			}
+		}
+
+		void Run(SParallelJob& job, size_t threadCount) {
+			std::lock_guard<std::mutex> dispatchLock(mDispatchMutex);
+
+			// The calling thread does its share of the work too
+			size_t workerCount = threadCount - 1;
+
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+
+				while (mThreads.size() < workerCount) {
+					mThreads.emplace_back([this]() { WorkerMain(); });
+				}
+
+				mJob = &job;
+				mGeneration++;
+				mOpenSlots = workerCount;
+			}
+
+			mWorkReady.notify_all();
+
+			InParallelFor = true;
+			job.Run();
+			InParallelFor = false;
+
+			// Workers that haven't woken up yet mustn't pick up the job once it's gone
+			std::unique_lock<std::mutex> lock(mMutex);
+			mJob = nullptr;
+			mOpenSlots = 0;
+			mWorkDone.wait(lock, [&]() { return mBusyWorkers == 0; });
+		}
+	};
+
+	thread_local bool CThreadPool::InParallelFor = false;
+
+	void ParallelFor(size_t count, const std::function<void(size_t)>& func) {
+		size_t threadCount = std::min(static_cast<size_t>(GetThreadCount()), count);
+
+		if (threadCount <= 1 || CThreadPool::InParallelFor) {
+			for (size_t i = 0; i < count; i++) {
+				func(i);
+			}
+
+			return;
+		}
+
+		static CThreadPool pool;
+
+		SParallelJob job;
+		job.Func = &func;
+		job.Count = count;
+
+		pool.Run(job, threadCount);
+
+		if (job.Error != nullptr)
+			std::rethrow_exception(job.Error);
+	}
+
 	std::string LoadTextFile(std::filesystem::path filePath) {
 		if (filePath.empty() || !std::filesystem::exists(filePath))
 			return "";
@@ -46,4 +224,89 @@ namespace Util {
 		stream->writeUInt32(static_cast<uint32_t>(currentStreamPos - relativeTo));
 		stream->seek(currentStreamPos);
 	}
+
+	/* CMappedFile */
+
+	CMappedFile::~CMappedFile() {
+		Close();
+	}
+
+	bool CMappedFile::Open(std::filesystem::path filePath) {
+		Close();
+
+		if (filePath.empty() || !std::filesystem::exists(filePath))
+			return false;
+
+#ifdef _WIN32
+		HANDLE file = CreateFileW(filePath.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			CloseHandle(file);
+			return false;
+		}
+
+		HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr) {
+			CloseHandle(file);
+			return false;
+		}
+
+		void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (data == nullptr) {
+			CloseHandle(mapping);
+			CloseHandle(file);
+			return false;
+		}
+
+		mFileHandle = file;
+		mMappingHandle = mapping;
+		mData = static_cast<const uint8_t*>(data);
+		mSize = static_cast<size_t>(fileSize.QuadPart);
+#else
+		int file = open(filePath.c_str(), O_RDONLY);
+		if (file == -1)
+			return false;
+
+		struct stat fileStat;
+		if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0) {
+			close(file);
+			return false;
+		}
+
+		void* data = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+
+		// The mapping holds its own reference to the file, so the descriptor isn't needed anymore.
+		close(file);
+
+		if (data == MAP_FAILED)
+			return false;
+
+		mData = static_cast<const uint8_t*>(data);
+		mSize = static_cast<size_t>(fileStat.st_size);
+#endif
+
+		return true;
+	}
+
+	void CMappedFile::Close() {
+		if (mData == nullptr)
+			return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(mData);
+		CloseHandle(static_cast<HANDLE>(mMappingHandle));
+		CloseHandle(static_cast<HANDLE>(mFileHandle));
+
+		mMappingHandle = nullptr;
+		mFileHandle = nullptr;
+#else
+		munmap(const_cast<uint8_t*>(mData), mSize);
+#endif
+
+		mData = nullptr;
+		mSize = 0;
+	}
 }
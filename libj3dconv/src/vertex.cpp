@@ -7,26 +7,109 @@
 #include <bstream.h>
 
 #include <algorithm>
+#include <cmath>
+#include <iostream>
 
 const uint8_t FIXED_POINT_EXP_NORMAL = 0x0E;
 const uint8_t FIXED_POINT_EXP_TEXCOORD = 0x08;
 
-/* SVertex */
+// GX fixes the exponent of fixed-point normals by component type.
+const uint8_t FIXED_POINT_EXP_NORMAL_S8 = 0x06;
 
-void SVertex::SetIndex(EGXAttribute attribute, uint16_t index) {
+// The exponent is stored in 5 bits.
+const uint8_t MAX_FIXED_POINT_EXP = 0x1F;
+
+// Attribute indices are 16 bits in SHP1, and UINT16_MAX marks an unused index.
+const size_t MAX_ATTRIBUTE_VALUE_COUNT = UINT16_MAX;
+
+/* CVertexPool */
+
+uint32_t CVertexPool::AddVertex() {
+    uint32_t vertex = GetVertexCount();
+
+    mPositionIndices.push_back(UINT16_MAX);
+    mNormalIndices.push_back(UINT16_MAX);
+
+    for (auto& colorIndices : mColorIndices) {
+        colorIndices.push_back(UINT16_MAX);
+    }
+
+    for (auto& texCoordIndices : mTexCoordIndices) {
+        texCoordIndices.push_back(UINT16_MAX);
+    }
+
+    mPosMatrixIndices.push_back(UINT16_MAX);
+    mUseNBT.push_back(0);
+
+    mInfluenceCounts.push_back(0);
+    mJointIndices.resize(mJointIndices.size() + MAX_VERTEX_INFLUENCES, 0);
+    mWeights.resize(mWeights.size() + MAX_VERTEX_INFLUENCES, 0.0f);
+
+    return vertex;
+}
+
+void CVertexPool::Reserve(size_t count) {
+    mPositionIndices.reserve(count);
+    mNormalIndices.reserve(count);
+
+    for (auto& colorIndices : mColorIndices) {
+        colorIndices.reserve(count);
+    }
+
+    for (auto& texCoordIndices : mTexCoordIndices) {
+        texCoordIndices.reserve(count);
+    }
+
+    mPosMatrixIndices.reserve(count);
+    mUseNBT.reserve(count);
+
+    mInfluenceCounts.reserve(count);
+    mJointIndices.reserve(count * MAX_VERTEX_INFLUENCES);
+    mWeights.reserve(count * MAX_VERTEX_INFLUENCES);
+}
+
+void CVertexPool::Append(const CVertexPool& other) {
+    auto appendArray = [](auto& values, const auto& otherValues) {
+        values.insert(values.end(), otherValues.begin(), otherValues.end());
+    };
+
+    appendArray(mPositionIndices, other.mPositionIndices);
+    appendArray(mNormalIndices, other.mNormalIndices);
+
+    for (uint32_t i = 0; i < 2; i++) {
+        appendArray(mColorIndices[i], other.mColorIndices[i]);
+    }
+
+    for (uint32_t i = 0; i < 8; i++) {
+        appendArray(mTexCoordIndices[i], other.mTexCoordIndices[i]);
+    }
+
+    appendArray(mPosMatrixIndices, other.mPosMatrixIndices);
+    appendArray(mUseNBT, other.mUseNBT);
+
+    appendArray(mInfluenceCounts, other.mInfluenceCounts);
+    appendArray(mJointIndices, other.mJointIndices);
+    appendArray(mWeights, other.mWeights);
+}
+
+std::vector<uint16_t>* CVertexPool::GetIndexArray(EGXAttribute attribute) {
+    return const_cast<std::vector<uint16_t>*>(static_cast<const CVertexPool*>(this)->GetIndexArray(attribute));
+}
+
+const std::vector<uint16_t>* CVertexPool::GetIndexArray(EGXAttribute attribute) const {
     switch (attribute) {
+    case EGXAttribute::PositionMatrixIdx:
+        return &mPosMatrixIndices;
     case EGXAttribute::Position:
-        PositionIndex = index;
-        break;
+        return &mPositionIndices;
     case EGXAttribute::Normal:
-        NormalIndex = index;
-        break;
+    case EGXAttribute::NBT:
+        return &mNormalIndices;
     case EGXAttribute::Color0:
     case EGXAttribute::Color1:
     {
         uint32_t colorIdx = static_cast<uint32_t>(attribute) - static_cast<uint32_t>(EGXAttribute::Color0);
-        ColorIndex[colorIdx] = index;
-        break;
+        return &mColorIndices[colorIdx];
     }
     case EGXAttribute::TexCoord0:
     case EGXAttribute::TexCoord1:
@@ -38,118 +121,506 @@ void SVertex::SetIndex(EGXAttribute attribute, uint16_t index) {
     case EGXAttribute::TexCoord7:
     {
         uint32_t texIdx = static_cast<uint32_t>(attribute) - static_cast<uint32_t>(EGXAttribute::TexCoord0);
-        TexCoordIndex[texIdx] = index;
-        break;
+        return &mTexCoordIndices[texIdx];
     }
     default:
-        break;
+        return nullptr;
+    }
+}
+
+uint16_t CVertexPool::GetIndex(EGXAttribute attribute, uint32_t vertex) const {
+    const std::vector<uint16_t>* indices = GetIndexArray(attribute);
+    if (indices == nullptr) {
+        return UINT16_MAX;
+    }
+
+    return (*indices)[vertex];
+}
+
+void CVertexPool::SetIndex(EGXAttribute attribute, uint32_t vertex, uint16_t index) {
+    std::vector<uint16_t>* indices = GetIndexArray(attribute);
+    if (indices == nullptr) {
+        return;
+    }
+
+    (*indices)[vertex] = index;
+}
+
+bool CVertexPool::AddInfluence(uint32_t vertex, uint16_t jointIndex, float weight) {
+    uint8_t& influenceCount = mInfluenceCounts[vertex];
+    if (influenceCount >= MAX_VERTEX_INFLUENCES) {
+        return false;
+    }
+
+    mJointIndices[vertex * MAX_VERTEX_INFLUENCES + influenceCount] = jointIndex;
+    mWeights[vertex * MAX_VERTEX_INFLUENCES + influenceCount] = weight;
+    influenceCount++;
+
+    return true;
+}
+
+/* SVertexAttributes */
+
+uint32_t GetAttributeComponentCount(EGXAttribute attribute) {
+    switch (attribute) {
+    case EGXAttribute::Position:
+    case EGXAttribute::Normal:
+        return 3;
+    case EGXAttribute::Color0:
+    case EGXAttribute::Color1:
+        return 4;
+    case EGXAttribute::TexCoord0:
+    case EGXAttribute::TexCoord1:
+    case EGXAttribute::TexCoord2:
+    case EGXAttribute::TexCoord3:
+    case EGXAttribute::TexCoord4:
+    case EGXAttribute::TexCoord5:
+    case EGXAttribute::TexCoord6:
+    case EGXAttribute::TexCoord7:
+        return 2;
+    // Tangents, with the bitangent's sign in w
+    case EGXAttribute::NBT:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+SVertexAttributes::SVertexAttributes() {
+    for (size_t i = 0; i < GX_ATTRIBUTE_COUNT; i++) {
+        Arrays[i].ComponentCount = GetAttributeComponentCount(static_cast<EGXAttribute>(i));
     }
 }
 
 /* CVertexData */
 
 CVertexData::CVertexData() {
-
+    for (size_t i = 0; i < GX_ATTRIBUTE_COUNT; i++) {
+        const SAttributeArray* values = &mVertexData.Arrays[i];
+        mVertexDataIndices[i] = attribute_index_set(0, SAttributeValueHash{ values }, SAttributeValueEqual{ values });
+    }
 }
 
 CVertexData::~CVertexData() {
 
 }
 
-bool CVertexData::AttributeContainsValue(EGXAttribute attribute, const glm::vec4& value) {
-    if (mVertexData.find(attribute) == mVertexData.end()) {
-        return false;
+bool CVertexData::AttributeContainsValue(EGXAttribute attribute, const float* value) {
+    return GetIndexOfValueInAttribute(attribute, value) != UINT16_MAX;
+}
+
+uint16_t CVertexData::GetIndexOfValueInAttribute(EGXAttribute attribute, const float* value) {
+    return FindValueInAttribute(attribute, value, false);
+}
+
+void CVertexData::ReportAttributeOverflow(EGXAttribute attribute) {
+    if (!mOverflowedAttributes.insert(attribute).second) {
+        return;
     }
 
-    const auto& attributeValues = mVertexData[attribute];
-    return std::find(attributeValues.begin(), attributeValues.end(), value) != attributeValues.end();
+    std::cout << "Attribute " << static_cast<uint32_t>(attribute) << " has more than " << MAX_ATTRIBUTE_VALUE_COUNT
+        << " unique values, which can't be indexed by a BMD! The model can't be converted." << std::endl;
 }
 
-uint16_t CVertexData::GetIndexOfValueInAttribute(EGXAttribute attribute, const glm::vec4& value) {
-    if (mVertexData.find(attribute) == mVertexData.end()) {
+uint16_t CVertexData::FindValueInAttribute(EGXAttribute attribute, const float* value, bool add) {
+    SAttributeArray& attributeValues = mVertexData[attribute];
+    attribute_index_set& attributeIndices = mVertexDataIndices[static_cast<size_t>(attribute)];
+
+    if (attributeValues.ComponentCount == 0) {
         return UINT16_MAX;
     }
 
-    const auto& attributeValues = mVertexData[attribute];
-    const auto& valueItr = std::find(attributeValues.begin(), attributeValues.end(), value);
+    // The set can only look up values that are in the array, so the value is appended
+    // and then removed again if it turns out to be a duplicate.
+    uint32_t newIndex = static_cast<uint32_t>(attributeValues.Size());
+    attributeValues.Add(value);
 
-    if (valueItr == attributeValues.end()) {
+    const auto& valueItr = attributeIndices.find(newIndex);
+    if (valueItr != attributeIndices.end()) {
+        attributeValues.RemoveLast();
+        return static_cast<uint16_t>(*valueItr);
+    }
+
+    if (!add) {
+        attributeValues.RemoveLast();
         return UINT16_MAX;
     }
 
-    return valueItr - attributeValues.begin();
+    if (newIndex >= MAX_ATTRIBUTE_VALUE_COUNT) {
+        attributeValues.RemoveLast();
+        ReportAttributeOverflow(attribute);
+        return UINT16_MAX;
+    }
+
+    attributeIndices.insert(newIndex);
+    return static_cast<uint16_t>(newIndex);
 }
 
-uint16_t CVertexData::AddValueToAttribute(EGXAttribute attribute, const glm::vec4& value) {
-    mVertexData[attribute].push_back(value);
-    return mVertexData[attribute].size() - 1;
+uint16_t CVertexData::AddValueToAttribute(EGXAttribute attribute, const float* value) {
+    SAttributeArray& attributeValues = mVertexData[attribute];
+    if (attributeValues.ComponentCount == 0) {
+        return UINT16_MAX;
+    }
+
+    if (attributeValues.Size() >= MAX_ATTRIBUTE_VALUE_COUNT) {
+        ReportAttributeOverflow(attribute);
+        return UINT16_MAX;
+    }
+
+    uint32_t newIndex = static_cast<uint32_t>(attributeValues.Size());
+    attributeValues.Add(value);
+
+    // insert() keeps the existing entry for duplicates, so lookups always return the first occurrence.
+    mVertexDataIndices[static_cast<size_t>(attribute)].insert(newIndex);
+
+    return static_cast<uint16_t>(newIndex);
 }
 
-void CVertexData::BuildConverterPrimitive(const std::map<EGXAttribute, std::vector<glm::vec4>>& attributes,
-    const std::vector<uint16_t>& indices, const std::vector<glm::vec4>& jointIndices,
-    const std::vector<glm::vec4>& jointWeights, std::shared_ptr<SPrimitive> primitive) {
+void CVertexData::BuildConverterPrimitive(const SVertexAttributes& attributes,
+    const std::vector<uint32_t>& indices, const std::vector<glm::vec4>& jointIndices,
+    const std::vector<glm::vec4>& jointWeights, CVertexPool& pool, std::vector<uint32_t>& poolIndices,
+    std::shared_ptr<SPrimitive> primitive) {
+
+    bool useNBT = attributes.Has(EGXAttribute::NBT);
+
+    // Only visit the attributes this primitive has. They're in attribute order, so normals come before NBT.
+    std::vector<EGXAttribute> presentAttributes;
+    for (size_t i = 0; i < GX_ATTRIBUTE_COUNT; i++) {
+        if (!attributes.Arrays[i].Empty()) {
+            presentAttributes.push_back(static_cast<EGXAttribute>(i));
+        }
+    }
+
+    primitive->mVertices.reserve(primitive->mVertices.size() + indices.size());
 
     for (uint32_t i = 0; i < indices.size(); i++) {
-        uint16_t vertexIndex = indices[i];
-        std::shared_ptr<SVertex> vtx = std::make_shared<SVertex>();
+        uint32_t vertexIndex = indices[i];
 
-        if (attributes.find(EGXAttribute::NBT) != attributes.end() && attributes.at(EGXAttribute::NBT).size() != 0) {
-            vtx->bUseNBT = true;
+        // This vertex was already added by an earlier primitive in the shape
+        if (poolIndices[vertexIndex] != UINT32_MAX) {
+            primitive->mVertices.push_back(poolIndices[vertexIndex]);
+            continue;
         }
 
+        uint32_t vtx = pool.AddVertex();
+        poolIndices[vertexIndex] = vtx;
+
+        pool.SetUseNBT(vtx, useNBT);
+
+        // Unskinned vertices have no influences, and are attached to the shape's joint.
         if (jointIndices.size() != 0) {
-            for (uint32_t skinIndex = 0; skinIndex < 4; skinIndex++) {
+            for (uint32_t skinIndex = 0; skinIndex < MAX_VERTEX_INFLUENCES; skinIndex++) {
                 if (jointWeights[vertexIndex][skinIndex] != 0.0f) {
-                    //vtx->SkinInfo.JointIndices.push_back(jointIndices[vertexIndex][skinIndex]);
-                    //vtx->SkinInfo.Weights.push_back(jointWeights[vertexIndex][skinIndex]);
+                    pool.AddInfluence(vtx, static_cast<uint16_t>(jointIndices[vertexIndex][skinIndex]), jointWeights[vertexIndex][skinIndex]);
                 }
             }
         }
-        else {
-            //vtx->SkinInfo.JointIndices.push_back(0);
-            //vtx->SkinInfo.Weights.push_back(1.0f);
-        }
 
         // Strip vertex attributes to only unique values, and set the vertex indices to match
-        for (const auto& [attribute, values] : attributes) {
+        for (const EGXAttribute attribute : presentAttributes) {
+            const SAttributeArray& values = attributes[attribute];
+
             if (attribute == EGXAttribute::NBT) {
-                ProcessNBTData(values, vertexIndex, vtx);
+                ProcessNBTData(values, vertexIndex, pool, vtx);
                 continue;
             }
 
-            uint16_t newIndex = GetIndexOfValueInAttribute(attribute, values[vertexIndex]);
-
-            if (newIndex == UINT16_MAX) {
-                newIndex = AddValueToAttribute(attribute, values[vertexIndex]);
-            }
-
-            vtx->SetIndex(attribute, newIndex);
+            pool.SetIndex(attribute, vtx, FindValueInAttribute(attribute, values.Get(vertexIndex), true));
         }
 
         primitive->mVertices.push_back(vtx);
     }
 }
 
-void CVertexData::ProcessNBTData(const std::vector<glm::vec4>& tangents, const uint16_t vertexIndex, std::shared_ptr<SVertex> vertex) {
-    glm::vec4 normal = mVertexData.at(EGXAttribute::Normal)[vertex->NormalIndex];
-    glm::vec4 tangent = tangents[vertexIndex];
+void CVertexData::ProcessNBTData(const SAttributeArray& tangents, const uint32_t vertexIndex, CVertexPool& pool, const uint32_t poolIndex) {
+    uint16_t normalIndex = pool.GetIndex(EGXAttribute::Normal, poolIndex);
+    if (normalIndex == UINT16_MAX || !mVertexData.Has(EGXAttribute::Normal)) {
+        return;
+    }
+
+    const float* normalValue = mVertexData[EGXAttribute::Normal].Get(normalIndex);
+    const float* tangentValue = tangents.Get(vertexIndex);
+
+    glm::vec3 normal(normalValue[0], normalValue[1], normalValue[2]);
+    glm::vec4 tangent(tangentValue[0], tangentValue[1], tangentValue[2], tangentValue[3]);
 
     glm::vec3 bitangent = glm::cross(
         glm::vec3(normal.x, normal.y, normal.z),
         glm::vec3(tangent.x, tangent.y, tangent.z)
     ) * tangent.w;
 
-    std::shared_ptr<SNBTData> nbt = std::make_shared<SNBTData>(normal, tangent, bitangent);
-    const auto itr = std::find_if(mNBTData.begin(), mNBTData.end(), [nbt](std::shared_ptr<SNBTData> const& i) { return *i.get() == *nbt.get(); });
+    SNBTData nbt(normal, tangent, bitangent);
+    const auto itr = mNBTDataIndices.find(nbt);
+
+    if (itr == mNBTDataIndices.end()) {
+        if (mNBTData.size() >= MAX_ATTRIBUTE_VALUE_COUNT) {
+            ReportAttributeOverflow(EGXAttribute::NBT);
+
+            pool.SetIndex(EGXAttribute::NBT, poolIndex, UINT16_MAX);
+            return;
+        }
+
+        uint16_t nbtIndex = static_cast<uint16_t>(mNBTData.size());
+        pool.SetIndex(EGXAttribute::NBT, poolIndex, nbtIndex);
 
-    if (itr == mNBTData.end()) {
-        vertex->NormalIndex = mNBTData.size();
         mNBTData.push_back(nbt);
+        mNBTDataIndices.emplace(nbt, nbtIndex);
 
         return;
     }
 
-    vertex->NormalIndex = itr - mNBTData.begin();
+    pool.SetIndex(EGXAttribute::NBT, poolIndex, itr->second);
+}
+
+SAttributeFormat CVertexData::ChooseAttributeFormat(EGXAttribute attribute, const SAttributeArray& values) {
+    SAttributeFormat floatFormat;
+    float tolerance = 0.0f;
+    std::vector<SAttributeFormat> candidates;
+
+    switch (attribute) {
+        case EGXAttribute::Position:
+            tolerance = mQuantizationSettings.PositionTolerance;
+            candidates = {
+                { EGXComponentType::Unsigned8, 0 },
+                { EGXComponentType::Signed8, 0 },
+                { EGXComponentType::Unsigned16, 0 },
+                { EGXComponentType::Signed16, 0 }
+            };
+            break;
+        case EGXAttribute::Normal:
+            // NBT data is always written as Signed16, and it shares the normal's format.
+            if (mNBTData.size() != 0) {
+                return { EGXComponentType::Signed16, FIXED_POINT_EXP_NORMAL };
+            }
+
+            tolerance = mQuantizationSettings.NormalTolerance;
+            candidates = {
+                { EGXComponentType::Signed8, FIXED_POINT_EXP_NORMAL_S8 },
+                { EGXComponentType::Signed16, FIXED_POINT_EXP_NORMAL }
+            };
+            break;
+        case EGXAttribute::TexCoord0:
+        case EGXAttribute::TexCoord1:
+        case EGXAttribute::TexCoord2:
+        case EGXAttribute::TexCoord3:
+        case EGXAttribute::TexCoord4:
+        case EGXAttribute::TexCoord5:
+        case EGXAttribute::TexCoord6:
+        case EGXAttribute::TexCoord7:
+            tolerance = mQuantizationSettings.TexCoordTolerance;
+            candidates = {
+                { EGXComponentType::Unsigned8, 0 },
+                { EGXComponentType::Signed8, 0 },
+                { EGXComponentType::Unsigned16, 0 },
+                { EGXComponentType::Signed16, 0 }
+            };
+            break;
+        default:
+            return floatFormat;
+    }
+
+    if (values.Empty()) {
+        return floatFormat;
+    }
+
+    // Values are packed at the attribute's component count, so every float is a real component.
+    float minValue = values.Values[0];
+    float maxValue = values.Values[0];
+
+    for (const float value : values.Values) {
+        if (!std::isfinite(value)) {
+            return floatFormat;
+        }
+
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+    }
+
+    for (SAttributeFormat& candidate : candidates) {
+        float rangeMin = 0.0f, rangeMax = 0.0f;
+
+        switch (candidate.ComponentType) {
+            case EGXComponentType::Unsigned8:
+                rangeMin = 0.0f;
+                rangeMax = static_cast<float>(UINT8_MAX);
+                break;
+            case EGXComponentType::Signed8:
+                rangeMin = static_cast<float>(INT8_MIN);
+                rangeMax = static_cast<float>(INT8_MAX);
+                break;
+            case EGXComponentType::Unsigned16:
+                rangeMin = 0.0f;
+                rangeMax = static_cast<float>(UINT16_MAX);
+                break;
+            case EGXComponentType::Signed16:
+                rangeMin = static_cast<float>(INT16_MIN);
+                rangeMax = static_cast<float>(INT16_MAX);
+                break;
+            default:
+                continue;
+        }
+
+        // Normals have a fixed exponent; everything else uses the largest one that still fits the data's bounds.
+        int32_t exponent = candidate.FixedPointExponent;
+        if (attribute != EGXAttribute::Normal) {
+            for (exponent = MAX_FIXED_POINT_EXP; exponent >= 0; exponent--) {
+                float scale = std::ldexp(1.0f, exponent);
+
+                if (std::round(minValue * scale) >= rangeMin && std::round(maxValue * scale) <= rangeMax) {
+                    break;
+                }
+            }
+        }
+
+        if (exponent < 0) {
+            continue;
+        }
+
+        float scale = std::ldexp(1.0f, exponent);
+        if (std::round(minValue * scale) < rangeMin || std::round(maxValue * scale) > rangeMax) {
+            continue;
+        }
+
+        // Measure the real error rather than assuming half a step, so data that sits on the grid can be stored exactly.
+        bool withinTolerance = true;
+        for (const float value : values.Values) {
+            if (std::abs(value - std::round(value * scale) / scale) > tolerance) {
+                withinTolerance = false;
+                break;
+            }
+        }
+
+        if (withinTolerance) {
+            candidate.FixedPointExponent = static_cast<uint8_t>(exponent);
+            return candidate;
+        }
+    }
+
+    return floatFormat;
+}
+
+SAttributeFormat CVertexData::GetAttributeFormat(EGXAttribute attribute) const {
+    const auto& formatItr = mAttributeFormats.find(attribute);
+    if (formatItr != mAttributeFormats.end()) {
+        return formatItr->second;
+    }
+
+    // Attributes that haven't been quantized keep their default storage.
+    switch (attribute) {
+        case EGXAttribute::Normal:
+            return { EGXComponentType::Signed16, FIXED_POINT_EXP_NORMAL };
+        case EGXAttribute::TexCoord0:
+        case EGXAttribute::TexCoord1:
+        case EGXAttribute::TexCoord2:
+        case EGXAttribute::TexCoord3:
+        case EGXAttribute::TexCoord4:
+        case EGXAttribute::TexCoord5:
+        case EGXAttribute::TexCoord6:
+        case EGXAttribute::TexCoord7:
+            return { EGXComponentType::Signed16, FIXED_POINT_EXP_TEXCOORD };
+        default:
+            return { EGXComponentType::Float, 0 };
+    }
+}
+
+void CVertexData::QuantizeAttributes(shared_vector<CShape>& shapes) {
+    std::map<EGXAttribute, std::vector<uint16_t>> indexRemap;
+
+    for (size_t attributeIndex = 0; attributeIndex < GX_ATTRIBUTE_COUNT; attributeIndex++) {
+        EGXAttribute attribute = static_cast<EGXAttribute>(attributeIndex);
+        SAttributeArray& values = mVertexData.Arrays[attributeIndex];
+        attribute_index_set& valueIndices = mVertexDataIndices[attributeIndex];
+
+        if (values.Empty()) {
+            continue;
+        }
+
+        SAttributeFormat format = ChooseAttributeFormat(attribute, values);
+        if (format.ComponentType == EGXComponentType::Float) {
+            continue;
+        }
+
+        mAttributeFormats[attribute] = format;
+
+        // Rebuild the attribute in place from its quantized values, so near-duplicates collapse into a single entry.
+        // Each value is written at or before its old slot, which has already been read by then.
+        float scale = std::ldexp(1.0f, format.FixedPointExponent);
+        size_t valueCount = values.Size();
+        uint32_t uniqueCount = 0;
+
+        std::vector<uint16_t>& remap = indexRemap[attribute];
+        remap.resize(valueCount);
+
+        valueIndices.clear();
+
+        for (size_t i = 0; i < valueCount; i++) {
+            const float* value = values.Get(i);
+            float* quantized = values.Get(uniqueCount);
+
+            for (uint32_t c = 0; c < values.ComponentCount; c++) {
+                quantized[c] = std::round(value[c] * scale) / scale;
+            }
+
+            const auto& result = valueIndices.insert(uniqueCount);
+            if (result.second) {
+                uniqueCount++;
+            }
+
+            remap[i] = static_cast<uint16_t>(*result.first);
+        }
+
+        values.Values.resize(uniqueCount * values.ComponentCount);
+    }
+
+    if (indexRemap.size() == 0) {
+        return;
+    }
+
+    for (const auto& shape : shapes) {
+        CVertexPool& pool = shape->GetVertexPool();
+
+        for (const auto& [attribute, remap] : indexRemap) {
+            std::vector<uint16_t>* indices = pool.GetIndexArray(attribute);
+            if (indices == nullptr) {
+                continue;
+            }
+
+            for (uint32_t vertex = 0; vertex < indices->size(); vertex++) {
+                uint16_t& index = (*indices)[vertex];
+
+                // NBT vertices index the NBT data rather than the normals.
+                if (attribute == EGXAttribute::Normal && pool.GetUseNBT(vertex)) {
+                    continue;
+                }
+
+                if (index < remap.size()) {
+                    index = remap[index];
+                }
+            }
+        }
+    }
+}
+
+void CVertexData::WriteAttributeComponent(bStream::CStream& stream, float value, const SAttributeFormat& format) {
+    float fixedValue = std::round(value * std::ldexp(1.0f, format.FixedPointExponent));
+
+    switch (format.ComponentType) {
+        case EGXComponentType::Unsigned8:
+            stream.writeUInt8(static_cast<uint8_t>(std::clamp(fixedValue, 0.0f, static_cast<float>(UINT8_MAX))));
+            break;
+        case EGXComponentType::Signed8:
+            stream.writeInt8(static_cast<int8_t>(std::clamp(fixedValue, static_cast<float>(INT8_MIN), static_cast<float>(INT8_MAX))));
+            break;
+        case EGXComponentType::Unsigned16:
+            stream.writeUInt16(static_cast<uint16_t>(std::clamp(fixedValue, 0.0f, static_cast<float>(UINT16_MAX))));
+            break;
+        case EGXComponentType::Signed16:
+            stream.writeInt16(static_cast<int16_t>(std::clamp(fixedValue, static_cast<float>(INT16_MIN), static_cast<float>(INT16_MAX))));
+            break;
+        default:
+            stream.writeFloat(value);
+            break;
+    }
 }
 
 void CVertexData::WriteVTX1(bStream::CStream& stream) {
@@ -165,20 +636,25 @@ void CVertexData::WriteVTX1(bStream::CStream& stream) {
     }
 
     // Attribute storage definitions
-    for (const auto& [attribute, values] : mVertexData) {
+    for (size_t attributeIndex = 0; attributeIndex < GX_ATTRIBUTE_COUNT; attributeIndex++) {
+        EGXAttribute attribute = static_cast<EGXAttribute>(attributeIndex);
+        if (!mVertexData.Has(attribute)) {
+            continue;
+        }
+
         uint32_t componentCount = 0, componentType = 0;
         uint8_t fixedPointExponent = 0;
 
         switch (attribute) {
             case EGXAttribute::Position:
                 componentCount = static_cast<uint32_t>(EGXComponentCount::Position_XYZ);
-                componentType = static_cast<uint32_t>(EGXComponentType::Float);
-                fixedPointExponent = 0;
+                componentType = static_cast<uint32_t>(GetAttributeFormat(attribute).ComponentType);
+                fixedPointExponent = GetAttributeFormat(attribute).FixedPointExponent;
                 break;
             case EGXAttribute::Normal:
                 componentCount = static_cast<uint32_t>(EGXComponentCount::Normal_XYZ);
-                componentType = static_cast<uint32_t>(EGXComponentType::Signed16);
-                fixedPointExponent = FIXED_POINT_EXP_NORMAL;
+                componentType = static_cast<uint32_t>(GetAttributeFormat(attribute).ComponentType);
+                fixedPointExponent = GetAttributeFormat(attribute).FixedPointExponent;
                 break;
             case EGXAttribute::Color0:
             case EGXAttribute::Color1:
@@ -195,8 +671,8 @@ void CVertexData::WriteVTX1(bStream::CStream& stream) {
             case EGXAttribute::TexCoord6:
             case EGXAttribute::TexCoord7:
                 componentCount = static_cast<uint32_t>(EGXComponentCount::TexCoord_UV);
-                componentType = static_cast<uint32_t>(EGXComponentType::Signed16);
-                fixedPointExponent = FIXED_POINT_EXP_TEXCOORD;
+                componentType = static_cast<uint32_t>(GetAttributeFormat(attribute).ComponentType);
+                fixedPointExponent = GetAttributeFormat(attribute).FixedPointExponent;
                 break;
             default:
                 break;
@@ -224,7 +700,14 @@ void CVertexData::WriteVTX1(bStream::CStream& stream) {
     Util::PadStreamWithString(&stream, 16);
 
     // Attribute values
-    for (const auto& [attribute, values] : mVertexData) {
+    for (size_t attributeIndex = 0; attributeIndex < GX_ATTRIBUTE_COUNT; attributeIndex++) {
+        EGXAttribute attribute = static_cast<EGXAttribute>(attributeIndex);
+        const SAttributeArray& values = mVertexData.Arrays[attributeIndex];
+
+        if (values.Empty()) {
+            continue;
+        }
+
         size_t currentStreamPos = stream.tell();
 
         uint32_t attributeOffset = 0;
@@ -276,26 +759,25 @@ void CVertexData::WriteVTX1(bStream::CStream& stream) {
         stream.writeUInt32(static_cast<uint32_t>(currentStreamPos - streamStartPos));
         stream.seek(currentStreamPos);
 
-        for (const glm::vec4& value : values) {
+        SAttributeFormat format = GetAttributeFormat(attribute);
+
+        for (size_t i = 0; i < values.Size(); i++) {
+            const float* value = values.Get(i);
+
             switch (attribute) {
                 case EGXAttribute::Position:
-                    stream.writeFloat(value.x);
-                    stream.writeFloat(value.y);
-                    stream.writeFloat(value.z);
-
-                    continue;
                 case EGXAttribute::Normal:
-                    stream.writeInt16(static_cast<int16_t>(value.x / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
-                    stream.writeInt16(static_cast<int16_t>(value.y / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
-                    stream.writeInt16(static_cast<int16_t>(value.z / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+                    WriteAttributeComponent(stream, value[0], format);
+                    WriteAttributeComponent(stream, value[1], format);
+                    WriteAttributeComponent(stream, value[2], format);
 
                     continue;
                 case EGXAttribute::Color0:
                 case EGXAttribute::Color1:
-                    stream.writeUInt8(static_cast<uint8_t>(value.x * 255.0f));
-                    stream.writeUInt8(static_cast<uint8_t>(value.y * 255.0f));
-                    stream.writeUInt8(static_cast<uint8_t>(value.z * 255.0f));
-                    stream.writeUInt8(static_cast<uint8_t>(value.w * 255.0f));
+                    stream.writeUInt8(static_cast<uint8_t>(value[0] * 255.0f));
+                    stream.writeUInt8(static_cast<uint8_t>(value[1] * 255.0f));
+                    stream.writeUInt8(static_cast<uint8_t>(value[2] * 255.0f));
+                    stream.writeUInt8(static_cast<uint8_t>(value[3] * 255.0f));
 
                     continue;
                 case EGXAttribute::TexCoord0:
@@ -306,8 +788,8 @@ void CVertexData::WriteVTX1(bStream::CStream& stream) {
                 case EGXAttribute::TexCoord5:
                 case EGXAttribute::TexCoord6:
                 case EGXAttribute::TexCoord7:
-                    stream.writeInt16(static_cast<int16_t>(value.x / std::powf(0.5f, FIXED_POINT_EXP_TEXCOORD)));
-                    stream.writeInt16(static_cast<int16_t>(value.y / std::powf(0.5f, FIXED_POINT_EXP_TEXCOORD)));
+                    WriteAttributeComponent(stream, value[0], format);
+                    WriteAttributeComponent(stream, value[1], format);
 
                     continue;
                 default:
@@ -345,17 +827,17 @@ void CVertexData::WriteVTX1(bStream::CStream& stream) {
 
 void CVertexData::WriteNBTData(bStream::CStream& stream) {
     for (const auto& nbt : mNBTData) {
-        stream.writeInt16(static_cast<int16_t>(nbt->Normal.x / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
-        stream.writeInt16(static_cast<int16_t>(nbt->Normal.y / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
-        stream.writeInt16(static_cast<int16_t>(nbt->Normal.z / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Normal.x / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Normal.y / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Normal.z / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
 
-        stream.writeInt16(static_cast<int16_t>(nbt->Tangent.x / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
-        stream.writeInt16(static_cast<int16_t>(nbt->Tangent.y / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
-        stream.writeInt16(static_cast<int16_t>(nbt->Tangent.z / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Tangent.x / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Tangent.y / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Tangent.z / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
 
-        stream.writeInt16(static_cast<int16_t>(nbt->Bitangent.x / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
-        stream.writeInt16(static_cast<int16_t>(nbt->Bitangent.y / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
-        stream.writeInt16(static_cast<int16_t>(nbt->Bitangent.z / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Bitangent.x / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Bitangent.y / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
+        stream.writeInt16(static_cast<int16_t>(nbt.Bitangent.z / std::powf(0.5f, FIXED_POINT_EXP_NORMAL)));
     }
 
     // Pad section to 32 bytes